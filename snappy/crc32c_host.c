@@ -0,0 +1,60 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "dpu_snappy.h"
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+/**
+ * Add bytes to a running checksum using the SSE4.2 crc32 instruction,
+ * eight bytes at a time.
+ *
+ * @param crc: running checksum
+ * @param buf: data to add
+ * @param len: length of data
+ * @return Updated running checksum
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint64_t crc64 = crc;
+
+	// Align the buffer so the 8-byte loads don't cross cache lines
+	while (len && ((uintptr_t)buf & 7)) {
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t val;
+		memcpy(&val, buf, sizeof(val));
+		crc64 = _mm_crc32_u64(crc64, val);
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *buf++);
+
+	return (uint32_t)crc64;
+}
+#endif
+
+uint32_t crc32c_host(uint32_t crc, const uint8_t *buf, size_t len)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_sse42(crc, buf, len);
+#endif
+
+	while (len > UINT32_MAX) {
+		crc = crc32c_update(crc, buf, UINT32_MAX);
+		buf += UINT32_MAX;
+		len -= UINT32_MAX;
+	}
+	return crc32c_update(crc, buf, len);
+}
@@ -8,12 +8,46 @@
 #include "built_ins.h"
 
 #include "dpu_compress.h"
+#include "crc32c.h"
 
 /**
- * WRAM space in bytes remaining per tasklet after allocated
- * buffers and stack are accounted for.
+ * WRAM space in bytes remaining per active tasklet after allocated
+ * buffers, the stacks of every tasklet the program is built with and the
+ * shared checksum table are accounted for.
  */
-#define WRAM_PER_TASKLET ((65536 / NR_TASKLETS) - (2 * OUT_BUFFER_LENGTH) - STACK_SIZE_DEFAULT)
+#define WRAM_PER_TASKLET(nr_tasklets) (((65536 - sizeof(crc32c_table) - (NR_TASKLETS * STACK_SIZE_DEFAULT)) / (nr_tasklets)) - (2 * OUT_BUFFER_LENGTH))
+
+// Smallest hash table used for a block, in entries
+#define MIN_HASH_TABLE_SIZE 256
+
+// Copies with larger offsets need the 4-byte offset of EL_TYPE_COPY_4
+#define MAX_COPY_2_OFFSET BITMASK(16)
+
+// Chained blocks find matches in the previous block through the entries of
+// the previous epoch, which are lost whenever the epoch wraps around, so they
+// use 32-bit entries unless 16-bit ones leave this many bits for the epoch
+#define CHAINED_EPOCH_BITS 3
+
+/**
+ * Hash table used to find matches. Each entry holds the offset of a position
+ * in the block in its low bits, and the epoch of the block that wrote it in
+ * the remaining high bits. Entries from another epoch read as offset 0, the
+ * same as a cleared table, so the table only needs to be cleared when the
+ * epoch wraps around, which happens less often the smaller the blocks are.
+ * Entries are 16 bits, or 32 bits for blocks above 64KB whose offsets do not
+ * fit, which halves the number of entries in the same WRAM. With chained
+ * blocks, entries of the previous epoch are offsets in the previous block.
+ */
+struct hash_table {
+	void *entries;			// Epoch and offset of each entry
+	uint32_t entry_bits;	// Size of each entry in bits, 16 or 32
+	uint32_t max_size;		// Number of entries allocated
+	uint32_t size;			// Number of entries used by the current block
+	uint32_t dirty;			// Number of entries cleared since the epoch last wrapped around
+	uint32_t offset_bits;	// Number of low bits holding the offset
+	uint32_t epoch;			// Epoch of the current block
+	uint32_t history;		// Length of the previous block if its entries can be used, 0 otherwise
+};
 
 /**
  * Calculate the rounded down log base 2 of an unsigned integer.
@@ -27,13 +61,103 @@ static inline int32_t log2_floor(uint32_t n)
 }
 
 /**
- * Advance the sequential reader by some amount.
+ * Calculate the rounded up log base 2 of an unsigned integer.
+ *
+ * @param n: value to perform the calculation on
+ * @return Log base 2 ceiling of n
+ */
+static inline int32_t log2_ceil(uint32_t n)
+{
+	return (n <= 1) ? 0 : log2_floor(n - 1) + 1;
+}
+
+/**
+ * Start a new epoch of the hash table for the next block, and size the
+ * table to the block. Entries are only cleared the first time they are
+ * used after the epoch wraps around.
+ *
+ * @param table: hash table to reset
+ * @param size_to_compress: size we are compressing
+ * @param history_length: length of the previous block, if the entries it
+ *                        stored may be used to copy from it, 0 otherwise
+ */
+static void next_hash_table(struct hash_table *table, uint32_t size_to_compress, uint32_t history_length)
+{
+	table->size = MIN(MIN_HASH_TABLE_SIZE, table->max_size);
+	while ((table->size < table->max_size) && (table->size < size_to_compress))
+		table->size <<= 1;
+
+	table->history = history_length;
+	table->epoch++;
+	if ((table->epoch >> (table->entry_bits - table->offset_bits)) != 0) {
+		table->epoch = 0;
+		table->dirty = 0;
+		table->history = 0;
+	}
+
+	if (table->dirty < table->size) {
+		uint32_t entry_bytes = table->entry_bits / 8;
+		memset((uint8_t *)table->entries + table->dirty * entry_bytes, 0, (table->size - table->dirty) * entry_bytes);
+		table->dirty = table->size;
+	}
+}
+
+/**
+ * Get the offset stored in a hash table entry.
+ *
+ * @param table: hash table to read
+ * @param hval: hash of the entry
+ * @return Offset from the start of the block, wrapped around below 0 if the
+ *         entry is from the previous block, 0 if it is from an earlier block
+ */
+static inline uint32_t hash_table_get(struct hash_table *table, uint32_t hval)
+{
+	uint32_t entry = (table->entry_bits == 32) ? ((uint32_t *)table->entries)[hval] : ((uint16_t *)table->entries)[hval];
+	uint32_t epoch = entry >> table->offset_bits;
+	if (epoch == table->epoch)
+		return entry & BITMASK(table->offset_bits);
+	if ((table->history != 0) && (epoch == (table->epoch - 1)))
+		return (entry & BITMASK(table->offset_bits)) - table->history;
+	return 0;
+}
+
+/**
+ * Store an offset in a hash table entry.
+ *
+ * @param table: hash table to write
+ * @param hval: hash of the entry
+ * @param offset: offset from the start of the block
+ */
+static inline void hash_table_set(struct hash_table *table, uint32_t hval, uint32_t offset)
+{
+	uint32_t entry = (table->epoch << table->offset_bits) | offset;
+	if (table->entry_bits == 32)
+		((uint32_t *)table->entries)[hval] = entry;
+	else
+		((uint16_t *)table->entries)[hval] = entry;
+}
+
+/**
+ * Advance the sequential reader by some amount. If the stream has block
+ * checksums, the bytes passed over are added to the running checksum while
+ * they are still in the sequential read cache.
  *
  * @param input: holds input buffer information
  * @param len: number of bytes to advance seqential reader by
  */
 static inline void advance_seqread(struct in_buffer_context *input, uint32_t len)
 {
+	if (input->flags & SNAPPY_FLAG_CRC32C) {
+		while (len > SEQREAD_CACHE_SIZE) {
+			input->crc = crc32c_update(input->crc, input->ptr, SEQREAD_CACHE_SIZE);
+			__mram_ptr uint8_t *curr_ptr = seqread_tell(input->ptr, &input->sr);
+			input->ptr = seqread_seek(curr_ptr + SEQREAD_CACHE_SIZE, &input->sr);
+			input->curr += SEQREAD_CACHE_SIZE;
+			len -= SEQREAD_CACHE_SIZE;
+		}
+		input->crc = crc32c_update(input->crc, input->ptr, len);
+	}
+
 	__mram_ptr uint8_t *curr_ptr = seqread_tell(input->ptr, &input->sr);
 	input->ptr = seqread_seek(curr_ptr + len, &input->sr);
 	input->curr += len;
@@ -96,29 +220,64 @@ static inline void read_two_uint32(struct in_buffer_context *input, uint32_t off
 }
 
 /**
- * Write the compressed length of a block to the output_offset. Must first read 8
- * bytes at output_offset, add in the compressed length, and then write the buffer back.
+ * Check that a 4-byte match is long enough to be worth a copy. Copies that
+ * need a 4-byte offset take 5 bytes, so their match must be 5 bytes or more.
+ *
+ * @param input: holds input buffer information
+ * @param curr: offset of the position being matched
+ * @param candidate: offset of the earlier position whose first 4 bytes match
+ * @return True if a copy of the match is no larger than the bytes it replaces
+ */
+static inline bool long_enough_match(struct in_buffer_context *input, uint32_t curr, uint32_t candidate)
+{
+	if ((curr - candidate) <= MAX_COPY_2_OFFSET)
+		return true;
+	return (read_uint32(input, curr + 1) >> 24) == (read_uint32(input, candidate + 1) >> 24);
+}
+
+/**
+ * Write the header of a block, its compressed length and optionally its
+ * checksum, to the output_offset. The part of the header that has already
+ * been written back to MRAM is filled in by reading 16 bytes at output_offset,
+ * adding in the header, and then writing the buffer back. The part that is
+ * still in the append window is filled in there, since the window will
+ * overwrite MRAM when it is written back.
  *
+ * @param input: holds input buffer information
  * @param output: holds output buffer information
  * @param offset: offset from start of output buffer to write to
- * @param compressed_len: length value to write
+ * @param compressed_len: length value to write, with the block type in its top bits
  */
-static void write_compressed_length(struct out_buffer_context *output, uint32_t offset, uint32_t compressed_len) 
+static void write_block_header(struct in_buffer_context *input, struct out_buffer_context *output, uint32_t offset, uint32_t compressed_len)
 {
-	uint8_t data_read[16];
-	uint32_t aligned_offset = WINDOW_ALIGN(offset, 8);
-	mram_read(&output->buffer[aligned_offset], data_read, 16);
+	uint8_t header[8];
+	uint32_t header_len = BLOCK_HEADER_LENGTH(input->flags);
+
+	header[0] = compressed_len & 0xFF;
+	header[1] = (compressed_len >> 8) & 0xFF;
+	header[2] = (compressed_len >> 16) & 0xFF;
+	header[3] = (compressed_len >> 24) & 0xFF;
+	if (input->flags & SNAPPY_FLAG_CRC32C) {
+		uint32_t crc = crc32c_mask(input->crc);
+		header[4] = crc & 0xFF;
+		header[5] = (crc >> 8) & 0xFF;
+		header[6] = (crc >> 16) & 0xFF;
+		header[7] = (crc >> 24) & 0xFF;
+	}
 
-	offset %= 8;
+	uint32_t in_mram = 0;
+	if (offset < output->append_window) {
+		in_mram = MIN(header_len, output->append_window - offset);
 
-	// Fill in the compressed length
-	data_read[offset] = compressed_len & 0xFF;
-	data_read[offset + 1] = (compressed_len >> 8) & 0xFF;
-	data_read[offset + 2] = (compressed_len >> 16) & 0xFF;
-	data_read[offset + 3] = (compressed_len >> 24) & 0xFF;
-	
-	// Write the buffer back
-	mram_write(data_read, &output->buffer[aligned_offset], 16);
+		uint8_t data_read[16];
+		uint32_t aligned_offset = WINDOW_ALIGN(offset, 8);
+		mram_read(&output->buffer[aligned_offset], data_read, 16);
+		memcpy(&data_read[offset % 8], header, in_mram);
+		mram_write(data_read, &output->buffer[aligned_offset], 16);
+	}
+
+	if (in_mram < header_len)
+		memcpy(&output->append_ptr[offset + in_mram - output->append_window], &header[in_mram], header_len - in_mram);
 }
 
 /**
@@ -185,6 +344,61 @@ static void copy_output_buffer(struct in_buffer_context *input, struct out_buffe
 	}
 }
 
+/**
+ * Move the output back to an earlier offset, dropping everything written
+ * after it. If the offset has already been written back to MRAM, the window
+ * holding it is read back into the append window.
+ *
+ * @param output: holds output buffer information
+ * @param offset: offset from start of output buffer to move back to
+ */
+static void rewind_output_buffer(struct out_buffer_context *output, uint32_t offset)
+{
+	if (offset < output->append_window) {
+		output->append_window = WINDOW_ALIGN(offset, OUT_BUFFER_LENGTH);
+		mram_read(&output->buffer[output->append_window], output->append_ptr, OUT_BUFFER_LENGTH);
+	}
+	output->curr = offset;
+}
+
+/**
+ * Check if a block is one byte repeated. The check usually stops within the
+ * first bytes in the sequential read cache. If the block is a run, the
+ * sequential reader is moved past it, otherwise it is left at the start of
+ * the block.
+ *
+ * @param input: holds input buffer information
+ * @param input_size: size of the block
+ * @param value[out]: byte the block is made of
+ * @return True if every byte of the block is the same
+ */
+static bool read_run_block(struct in_buffer_context *input, uint32_t input_size, uint8_t *value)
+{
+	__mram_ptr uint8_t *block_start = seqread_tell(input->ptr, &input->sr);
+	uint32_t checked = 0;
+
+	*value = input->ptr[0];
+	input->crc = CRC32C_INIT;
+	while (checked < input_size) {
+		uint32_t len = MIN(input_size - checked, SEQREAD_CACHE_SIZE);
+		for (uint32_t i = 0; i < len; i++) {
+			if (input->ptr[i] != *value) {
+				if (checked != 0) {
+					input->ptr = seqread_seek(block_start, &input->sr);
+					input->curr -= checked;
+					input->crc = CRC32C_INIT;
+				}
+				return false;
+			}
+		}
+
+		advance_seqread(input, len);
+		checked += len;
+	}
+
+	return true;
+}
+
 /**
  * Hash function.
  *
@@ -280,7 +494,7 @@ static void emit_literal(struct in_buffer_context *input, struct out_buffer_cont
  */
 static void emit_copy_less_than64(struct out_buffer_context *output, uint32_t offset, uint32_t len)
 {
-	uint8_t tag[3];
+	uint8_t tag[5];
 	uint8_t tag_len = 0;
 
 	if ((len < 12) && (offset < 2048)) {
@@ -288,6 +502,14 @@ static void emit_copy_less_than64(struct out_buffer_context *output, uint32_t of
 		tag[1] = offset & 0xFF;
 		tag_len = 2;
 	}
+	else if (offset > MAX_COPY_2_OFFSET) {
+		tag[0] = EL_TYPE_COPY_4 + ((len - 1) << 2);
+		tag[1] = offset & 0xFF;
+		tag[2] = (offset >> 8) & 0xFF;
+		tag[3] = (offset >> 16) & 0xFF;
+		tag[4] = (offset >> 24) & 0xFF;
+		tag_len = 5;
+	}
 	else {
 		tag[0] = EL_TYPE_COPY_2 + ((len - 1) << 2);
 		tag[1] = offset & 0xFF;
@@ -332,19 +554,19 @@ static void emit_copy(struct out_buffer_context *output, uint32_t offset, uint32
  * @param input: holds input buffer information
  * @param output: holds output buffer information
  * @param input_size: size of the input to compress
- * @param table: pointer to allocated hash table
- * @param table_size: size of the hash table
+ * @param table: hash table set up for this block by next_hash_table
  */
-static void compress_block(struct in_buffer_context *input, struct out_buffer_context *output, uint32_t input_size, uint16_t *table, uint32_t table_size)
+static void compress_block(struct in_buffer_context *input, struct out_buffer_context *output, uint32_t input_size, struct hash_table *table)
 {
 	uint32_t base_input = input->curr;
 	uint32_t curr_input = input->curr;
 	uint32_t input_end = input->curr + input_size;
-	const int32_t shift = 32 - log2_floor(table_size);
+	const int32_t shift = 32 - log2_floor(table->size);
 
-	// Make room for the compressed length
-	output->curr += 4;
+	// Make room for the block header
+	output->curr += BLOCK_HEADER_LENGTH(input->flags);
 	uint32_t output_start = output->curr;
+	input->crc = CRC32C_INIT;
 
 	/*
 	 * Bytes in [next_emit, input->curr) will be emitted as literal bytes.
@@ -394,18 +616,14 @@ static void compress_block(struct in_buffer_context *input, struct out_buffer_co
 				uint32_t bytes_between_hash_lookups = skip_bytes++ >> 5;
 				next_input = curr_input + bytes_between_hash_lookups;
 
-				if (next_input > input_limit) {
-					if (next_emit < input_end)
-						emit_literal(input, output, input_end - next_emit);
-					
-					write_compressed_length(output, output_start - 4, output->curr - output_start);
-					return;
-				}		
+				if (next_input > input_limit)
+					goto emit_remainder;
 
 				next_hash = hash(input, read_uint32(input, next_input), shift);
-				candidate = base_input + table[hval];
-				table[hval] = curr_input - base_input;
-			} while (read_uint32(input, curr_input) != read_uint32(input, candidate));
+				candidate = base_input + hash_table_get(table, hval);
+				hash_table_set(table, hval, curr_input - base_input);
+			} while ((read_uint32(input, curr_input) != read_uint32(input, candidate)) ||
+					!long_enough_match(input, curr_input, candidate));
 			
 			/*
 			 * Step 2: A 4-byte match has been found.  We'll later see if more
@@ -443,48 +661,112 @@ static void compress_block(struct in_buffer_context *input, struct out_buffer_co
 				 * compression we first update table[Hash(input->curr - 1, ...)]/
 				 */
 				next_emit = curr_input;
-				if (curr_input >= input_limit) {
-					if (next_emit < input_end)
-						emit_literal(input, output, input_end - next_emit);
-					
-					write_compressed_length(output, output_start - 4, output->curr - output_start);
-					return;
-				}
+				if (curr_input >= input_limit)
+					goto emit_remainder;
 
 				read_two_uint32(input, curr_input - 1, prev_curr_bytes);
 				
 				uint32_t prev_hash = hash(input, prev_curr_bytes[0], shift);
-				table[prev_hash] = curr_input - base_input - 1;
+				hash_table_set(table, prev_hash, curr_input - base_input - 1);
 
 				uint32_t curr_hash = hash(input, prev_curr_bytes[1], shift);
-				candidate = base_input + table[curr_hash];
-				table[curr_hash] = curr_input - base_input;
-			} while(prev_curr_bytes[1] == read_uint32(input, candidate));
+				candidate = base_input + hash_table_get(table, curr_hash);
+				hash_table_set(table, curr_hash, curr_input - base_input);
+			} while ((prev_curr_bytes[1] == read_uint32(input, candidate)) &&
+					long_enough_match(input, curr_input, candidate));
 		}
 	}
+
+emit_remainder:
+	// Emit the remaining bytes as a literal
+	if (next_emit < input_end)
+		emit_literal(input, output, input_end - next_emit);
+
+	// If the block did not get smaller, store it raw instead
+	uint32_t compressed_len = output->curr - output_start;
+	uint32_t block_type = BLOCK_TYPE_SNAPPY;
+	if (compressed_len >= input_size) {
+		rewind_output_buffer(output, output_start);
+		input->ptr = seqread_seek(input->buffer + base_input, &input->sr);
+		input->curr = base_input;
+		input->crc = CRC32C_INIT;
+
+		copy_output_buffer(input, output, input_size);
+		compressed_len = input_size;
+		block_type = BLOCK_TYPE_RAW;
+	}
+
+	write_block_header(input, output, output_start - BLOCK_HEADER_LENGTH(input->flags), compressed_len | (block_type << BLOCK_TYPE_SHIFT));
+}
+
+/**
+ * Store a block that is one byte repeated as a run block, which holds just
+ * that byte.
+ *
+ * @param input: holds input buffer information, already moved past the block
+ * @param output: holds output buffer information
+ * @param value: byte the block is made of
+ */
+static void compress_run_block(struct in_buffer_context *input, struct out_buffer_context *output, uint8_t value)
+{
+	uint32_t header_offset = output->curr;
+	output->curr += BLOCK_HEADER_LENGTH(input->flags);
+	write_output_buffer(output, &value, 1);
+	write_block_header(input, output, header_offset, 1 | (BLOCK_TYPE_RUN << BLOCK_TYPE_SHIFT));
 }
 
 /************ Public Functions *************/
 
-snappy_status dpu_compress(struct in_buffer_context *input, struct out_buffer_context *output, uint32_t block_size)
+uint32_t dpu_compress_table_bytes(uint32_t nr_tasklets)
 {
-	// Calculate hash table size
-	uint32_t table_size = 1 << log2_floor(WRAM_PER_TASKLET);
-	uint32_t num_table_entries = table_size >> 1;
-	
-	// Allocate the hash table for compression
-	uint16_t *table = (uint16_t *)mem_alloc(table_size);
+	return 1 << log2_floor(WRAM_PER_TASKLET(nr_tasklets));
+}
+
+snappy_status dpu_compress(struct in_buffer_context *input, struct out_buffer_context *output, void *table_entries, uint32_t table_bytes, uint32_t block_size, uint32_t group_blocks)
+{
+	// Each block only uses as much of the table as its size needs. Whatever
+	// an earlier call left in it is cleared along with the first block.
+	uint32_t epoch_bits = (group_blocks > 1) ? CHAINED_EPOCH_BITS : 0;
+	struct hash_table table;
+	table.entries = table_entries;
+	table.offset_bits = log2_ceil(block_size);
+	table.entry_bits = ((table.offset_bits + epoch_bits) > 16) ? 32 : 16;
+	table.max_size = table_bytes / (table.entry_bits / 8);
+	table.size = 0;
+	table.dirty = 0;
+	table.epoch = 0;
+	table.history = 0;
 	
 	uint32_t length_remain = input->length;
+	uint32_t group_pos = 0;
+	bool prev_compressed = false;
 	while (input->curr < input->length) {
 		// Get the next block size to compress
 		uint32_t to_compress = MIN(length_remain, block_size);
 
-		// Reset the hash table
-		memset(table, 0, table_size);	
-	
-		// Compress the current block
-		compress_block(input, output, to_compress, table, num_table_entries);
+		// Store runs of one byte without compressing them
+		uint8_t value;
+		if (read_run_block(input, to_compress, &value)) {
+			compress_run_block(input, output, value);
+			prev_compressed = false;
+		}
+		else {
+			// Start a new epoch of the hash table for this block, keeping the
+			// entries of the previous block if it is in the same group
+			uint32_t history_length = ((group_pos != 0) && prev_compressed) ? block_size : 0;
+			next_hash_table(&table, to_compress, history_length);
+
+			// Compress the current block
+			compress_block(input, output, to_compress, &table);
+			prev_compressed = true;
+		}
+
+		// Every tasklet starts on a group boundary
+		if (++group_pos == group_blocks)
+			group_pos = 0;
+
+		if (input->flags & SNAPPY_FLAG_CRC32C)
+			input->crc_fold = crc32c_update_word(input->crc_fold, crc32c_mask(input->crc));
 	
 		length_remain -= to_compress;
 	}
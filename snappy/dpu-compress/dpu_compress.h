@@ -16,6 +16,61 @@
 #undef SEQREAD_CACHE_SIZE
 #define SEQREAD_CACHE_SIZE OUT_BUFFER_LENGTH
 
+// Format flags, must match the ones in dpu_snappy.h
+#define SNAPPY_FLAG_CRC32C (1 << 0)
+#define SNAPPY_FLAG_CHAINED (1 << 3)
+
+// Length of the header in front of each compressed block
+#define BLOCK_HEADER_LENGTH(_flags) (sizeof(uint32_t) + (((_flags) & SNAPPY_FLAG_CRC32C) ? sizeof(uint32_t) : 0))
+
+// Block types, must match the ones in dpu_snappy.h
+#define BLOCK_TYPE_SNAPPY 0U		// Snappy compressed data
+#define BLOCK_TYPE_RAW 1U		// The decompressed data, stored as is
+#define BLOCK_TYPE_RUN 2U		// One byte, repeated for the whole decompressed block
+#define BLOCK_TYPE_SHIFT 30
+#define GET_BLOCK_TYPE(_size) ((_size) >> BLOCK_TYPE_SHIFT)
+#define GET_BLOCK_SIZE(_size) ((_size) & BITMASK(BLOCK_TYPE_SHIFT))
+
+// Most jobs one DPU runs in a launch, must match the one in dpu_context.h
+#define MAX_DPU_JOBS 4096
+
+/**
+ * A range of whole groups of blocks of one input that a tasklet compresses
+ * on its own. The host writes a table of them to MRAM, and the DPU writes
+ * the length of each job's output back to it. Must match the one in
+ * dpu_context.h.
+ */
+struct dpu_job {
+	uint32_t input_offset;	// Offset of the input in input_buffer
+	uint32_t input_length;	// Length of the input
+	uint32_t output_offset;	// Offset of the output in output_buffer, a multiple of 8
+	uint32_t output_length;	// Length of the output, set once the job is compressed
+	uint32_t block_size;	// Size of each block
+	uint32_t flags;			// Format flags of the stream
+	uint32_t group_blocks;	// Blocks in each group, 1 if blocks are not chained
+	uint32_t file;			// Index of the input on the host, not used by the DPU
+};
+
+// Entries of task_jobs in dpu_params, NR_TASKLETS + 1 rounded up so the
+// parameters are a whole number of 8-byte words
+#define DPU_PARAMS_TASK_JOBS (((NR_TASKLETS) + 2) & ~1)
+
+// Entries of the checksum folds the tasklets report, NR_TASKLETS rounded up
+// to a whole number of 8-byte words
+#define DPU_TASKLET_CRCS (((NR_TASKLETS) + 1) & ~1)
+
+/**
+ * Parameters of a launch, written by the host to each DPU in one transfer
+ * before every launch. Must match the one in dpu_context.h.
+ */
+struct dpu_params {
+	uint32_t active_tasklets;	// Number of tasklets that run jobs, the others exit right away
+	uint32_t claim_jobs;		// Whether the tasklets claim the jobs one at a time instead of running their own range
+	uint32_t next_job;			// Index in job_table of the next job to claim, 0 at launch
+	uint32_t dictionary_length;	// Length of the preset dictionary, for the jobs with SNAPPY_FLAG_DICT, not used when compressing
+	uint32_t task_jobs[DPU_PARAMS_TASK_JOBS];	// Index in job_table of each tasklet's first job, then the number of jobs
+};
+
 // Return values
 typedef enum {
     SNAPPY_OK = 0,              // Success code
@@ -40,6 +95,9 @@ typedef struct in_buffer_context
 	seqreader_t sr;
 	uint32_t curr;
 	uint32_t length;
+	uint32_t flags;		// Format flags of the stream
+	uint32_t crc;		// Running checksum of the current block
+	uint32_t crc_fold;	// Running checksum of the masked checksums of all finished blocks
 } in_buffer_context;
 
 typedef struct out_buffer_context
@@ -51,15 +109,28 @@ typedef struct out_buffer_context
 	uint32_t length;			// Total size of output buffer in bytes
 } out_buffer_context;
 
+/**
+ * Calculate the size of the hash table each tasklet compresses with, the
+ * largest that fits in its share of WRAM.
+ *
+ * @param nr_tasklets: number of tasklets sharing the WRAM
+ * @return Size of the table in bytes
+ */
+uint32_t dpu_compress_table_bytes(uint32_t nr_tasklets);
+
 /**
  * Perform the Snappy compression on the DPU.
  *
  * @param input: holds input buffer information
  * @param output: holds output buffer information
+ * @param table_entries: hash table of table_bytes bytes, passed to every call
+ * @param table_bytes: size of the table, from dpu_compress_table_bytes
  * @param block_size: size to compress at a time
+ * @param group_blocks: number of blocks in each group of chained blocks,
+ *                      1 if every block is compressed on its own
  * @return SNAPPY_OK if successful, error code otherwise
  */
-snappy_status dpu_compress(struct in_buffer_context *input, struct out_buffer_context *output, uint32_t block_size);
+snappy_status dpu_compress(struct in_buffer_context *input, struct out_buffer_context *output, void *table_entries, uint32_t table_bytes, uint32_t block_size, uint32_t group_blocks);
 
 #endif
 
@@ -1,28 +1,51 @@
 #include <mram.h>
 #include <defs.h>
+#include <mutex.h>
 #include <perfcounter.h>
 #include <stdio.h>
 #include "alloc.h"
 #include "dpu_compress.h"
+#include "crc32c.h"
 
 // Comment out to count instructions
 #define COUNT_CYC
 
 // WRAM variables
-__host uint32_t block_size;
-__host uint32_t input_length;
-__host uint32_t output_length[NR_TASKLETS];
-__host uint32_t input_block_offset[NR_TASKLETS];
-__host uint32_t output_offset[NR_TASKLETS];
+__host __dma_aligned struct dpu_params params; // Parameters of the launch, see dpu_params
+__host __dma_aligned uint32_t input_crc[DPU_TASKLET_CRCS]; // Fold of the block checksums of each tasklet's input
 
 // MRAM buffers
 uint8_t __mram_noinit input_buffer[MEGABYTE(30)];
 uint8_t __mram_noinit output_buffer[MEGABYTE(30)];
+__dma_aligned struct dpu_job __mram_noinit job_table[MAX_DPU_JOBS]; // Jobs of every tasklet, see dpu_compress.h
+
+// Guards params.next_job
+MUTEX_INIT(job_mutex);
+
+/**
+ * Pick the next job a tasklet runs. Each tasklet runs its own range of the
+ * job table in order, unless the tasklets claim jobs, and then it takes the
+ * first job no other tasklet has taken yet.
+ *
+ * @param next: index of the job after the last one this tasklet ran
+ * @return Index in job_table of the job to run
+ */
+static uint32_t claim_job(uint32_t next)
+{
+	if (!params.claim_jobs)
+		return next;
+
+	mutex_lock(job_mutex);
+	next = params.next_job++;
+	mutex_unlock(job_mutex);
+	return next;
+}
 
 int main()
 {
 	struct in_buffer_context input;
 	struct out_buffer_context output;
+	__dma_aligned struct dpu_job job;
 	uint8_t idx = me();
 
 #ifdef COUNT_CYC	
@@ -31,65 +54,74 @@ int main()
 	perfcounter_config(COUNT_INSTRUCTIONS, (idx == 0)? true : false);
 #endif
 
+	// The program is built with the most tasklets the host may ask for, and
+	// the ones it does not use exit right away
+	if (idx >= params.active_tasklets)
+		return 0;
+
 	printf("DPU starting, tasklet %d\n", idx);
 	
-	// Check that this tasklet has work to run
-	if ((idx != 0) && (input_block_offset[idx] == 0)) {
+	// Check that this tasklet has work to run. The DPUs may have run another
+	// job since the program was loaded, so results are cleared first. Claimed
+	// jobs are taken from all the jobs of the DPU.
+	input_crc[idx] = 0;
+	uint32_t last = params.claim_jobs ? params.task_jobs[params.active_tasklets] : params.task_jobs[idx + 1];
+	uint32_t i = claim_job(params.task_jobs[idx]);
+	if (i >= last) {
 		//printf("Tasklet %d has nothing to run\n", idx);
-		output_length[idx] = 0;
 		return 0;
 	}
 
-	// Prepare the input and output descriptors
-	uint32_t input_start = (input_block_offset[idx] - input_block_offset[0]) * block_size;
-	uint32_t output_start = output_offset[idx] - output_offset[0];
-
-	input.buffer = input_buffer + input_start;
+	// The buffers are shared by all the jobs of this tasklet
 	input.cache = seqread_alloc();
-	input.ptr = seqread_init(input.cache, input_buffer + input_start, &input.sr);
-	input.curr = 0;
-	input.length = 0;
-
-	output.buffer = output_buffer + output_start;
+	input.crc_fold = CRC32C_INIT;
 	output.append_ptr = (uint8_t*)ALIGN(mem_alloc(OUT_BUFFER_LENGTH), 8);
-	output.append_window = 0;
-	output.curr = 0;
-	output.length = 0;
-
-	// Calculate the length this tasklet parses
-	if (idx < (NR_TASKLETS - 1)) {
-		int32_t input_end = (input_block_offset[idx + 1] - input_block_offset[0]) * block_size;
-
-		// If the end position is zero, then the next task has no work
-		// to run. Use the remainder of the input length to calculate this
-		// task's length.
-		if (input_end <= 0) {
-			input.length = input_length - input_start;
-		}
-		else {
-			input.length = input_end - input_start;
-		}
-	}
-	else {
-		input.length = input_length - input_start;
-	}
+	uint32_t table_bytes = dpu_compress_table_bytes(params.active_tasklets);
+	void *table_entries = mem_alloc(table_bytes);
+
+	uint32_t total_length = 0;
+	uint32_t claimed_crc = 0;
+	for (; i < last; i = claim_job(i + 1)) {
+		mram_read(&job_table[i], &job, sizeof(job));
+
+		// Prepare the input and output descriptors
+		input.buffer = input_buffer + job.input_offset;
+		input.ptr = seqread_init(input.cache, input_buffer + job.input_offset, &input.sr);
+		input.curr = 0;
+		input.length = job.input_length;
+		input.flags = job.flags;
+		input.crc = CRC32C_INIT;
+		if (params.claim_jobs)
+			input.crc_fold = CRC32C_INIT;
 
-	if (input.length != 0) {
-		// Do the uncompress
-		if (dpu_compress(&input, &output, block_size))
+		output.buffer = output_buffer + job.output_offset;
+		output.append_window = 0;
+		output.curr = 0;
+		output.length = 0;
+
+		// Do the compress, and the checksums of every job's blocks are folded
+		// together, or each claimed job's on their own
+		uint32_t chain_blocks = (job.flags & SNAPPY_FLAG_CHAINED) ? job.group_blocks : 1;
+		if (dpu_compress(&input, &output, table_entries, table_bytes, job.block_size, chain_blocks))
 		{
 			printf("Tasklet %d: failed in %ld cycles\n", idx, perfcounter_get());
 			return -1;
 		}
-		output_length[idx] = output.length;
+
+		if (params.claim_jobs)
+			claimed_crc ^= ~input.crc_fold;
+
+		job.output_length = output.length;
+		mram_write(&job, &job_table[i], sizeof(job));
+		total_length += job.input_length;
 	}
+	input_crc[idx] = params.claim_jobs ? claimed_crc : ~input.crc_fold;
 
 #ifdef COUNT_CYC
-	printf("Tasklet %d: %ld cycles, %d bytes\n", idx, perfcounter_get(), input.length);
+	printf("Tasklet %d: %ld cycles, %d bytes\n", idx, perfcounter_get(), total_length);
 #else
-	printf("Tasklet %d: %ld instructions, %d bytes\n", idx, perfcounter_get(), input.length);
+	printf("Tasklet %d: %ld instructions, %d bytes\n", idx, perfcounter_get(), total_length);
 #endif
 
 	return 0;
 }
-
@@ -11,6 +11,7 @@
 #include <mram.h>
 #include <defs.h>
 #include "dpu_decompress.h"
+#include "crc32c.h"
 
 /*******************
  * Memory helpers  *
@@ -131,7 +132,7 @@ static inline uint32_t read_long_literal_size(struct in_buffer_context *input, u
  * @param output: holds output buffer information
  * @param len: length of data to copy over
  */
-static void writer_append_dpu(struct in_buffer_context *input, struct out_buffer_context *output, uint16_t len)
+static void writer_append_dpu(struct in_buffer_context *input, struct out_buffer_context *output, uint32_t len)
 {
 	uint32_t curr_index = output->curr - output->append_window;
 	while (len)
@@ -149,6 +150,8 @@ static void writer_append_dpu(struct in_buffer_context *input, struct out_buffer
 		uint32_t to_copy = MIN(OUT_BUFFER_LENGTH - curr_index, len);
 
 		memcpy(&output->append_ptr[curr_index], input->ptr, to_copy);
+		if (output->flags & SNAPPY_FLAG_CRC32C)
+			output->crc = crc32c_update(output->crc, &output->append_ptr[curr_index], to_copy);
 		output->curr += to_copy;
 		len -= to_copy;
 		curr_index += to_copy;
@@ -158,6 +161,78 @@ static void writer_append_dpu(struct in_buffer_context *input, struct out_buffer
 	}
 }
 
+/**
+ * Append a run of one byte to the output buffer.
+ *
+ * @param output: holds output buffer information
+ * @param value: byte to append
+ * @param len: number of times to append it
+ */
+static void writer_fill_dpu(struct out_buffer_context *output, uint8_t value, uint32_t len)
+{
+	uint32_t curr_index = output->curr - output->append_window;
+	while (len)
+	{
+		// If we are past the window, write the current window back to MRAM and start a new one
+		if (curr_index >= OUT_BUFFER_LENGTH)
+		{
+			dbg_printf("Past EOB - writing back output %d\n", output->append_window);
+			mram_write(output->append_ptr, &output->buffer[output->append_window], OUT_BUFFER_LENGTH);
+
+			output->append_window += OUT_BUFFER_LENGTH;
+			curr_index = 0;
+		}
+
+		uint32_t to_fill = MIN(OUT_BUFFER_LENGTH - curr_index, len);
+
+		memset(&output->append_ptr[curr_index], value, to_fill);
+		if (output->flags & SNAPPY_FLAG_CRC32C)
+			output->crc = crc32c_update(output->crc, &output->append_ptr[curr_index], to_fill);
+		output->curr += to_fill;
+		len -= to_fill;
+		curr_index += to_fill;
+	}
+}
+
+/**
+ * Append data from the preset dictionary to the output buffer. The dictionary
+ * is read from MRAM through the read buffer.
+ *
+ * @param output: holds output buffer information
+ * @param dict_index: offset in the dictionary to start copying from
+ * @param len: length of data to copy over
+ */
+static void writer_append_dict_dpu(struct out_buffer_context *output, uint32_t dict_index, uint32_t len)
+{
+	uint32_t curr_index = output->curr - output->append_window;
+	while (len)
+	{
+		// If we are past the window, write the current window back to MRAM and start a new one
+		if (curr_index >= OUT_BUFFER_LENGTH)
+		{
+			dbg_printf("Past EOB - writing back output %d\n", output->append_window);
+			mram_write(output->append_ptr, &output->buffer[output->append_window], OUT_BUFFER_LENGTH);
+
+			output->append_window += OUT_BUFFER_LENGTH;
+			curr_index = 0;
+		}
+
+		uint32_t to_copy = MIN(OUT_BUFFER_LENGTH - curr_index, len);
+		uint32_t index_offset = dict_index - WINDOW_ALIGN(dict_index, 8);
+		if ((to_copy + index_offset) > OUT_BUFFER_LENGTH)
+			to_copy = OUT_BUFFER_LENGTH - index_offset;
+		mram_read(&output->dictionary[dict_index - index_offset], output->read_buf, ALIGN(to_copy + index_offset, 8));
+
+		memcpy(&output->append_ptr[curr_index], output->read_buf + index_offset, to_copy);
+		if (output->flags & SNAPPY_FLAG_CRC32C)
+			output->crc = crc32c_update(output->crc, &output->append_ptr[curr_index], to_copy);
+		output->curr += to_copy;
+		len -= to_copy;
+		curr_index += to_copy;
+		dict_index += to_copy;
+	}
+}
+
 /**
  * Copy and append previous data to the output buffer. The data may
  * already be existing in the append buffer or read buffer in WRAM,
@@ -170,8 +245,28 @@ static void writer_append_dpu(struct in_buffer_context *input, struct out_buffer
  */
 static bool write_copy_dpu(struct out_buffer_context *output, uint32_t copy_length, uint32_t offset)
 {
-	// We only copy previous data, not future data
-	if (offset > output->curr)
+	// Copies that start before the block read the end of the dictionary
+	// first, and carry on from the start of the block
+	uint32_t block_pos = output->curr - output->block_start;
+	if ((output->flags & SNAPPY_FLAG_DICT) && (offset > block_pos))
+	{
+		uint32_t dict_offset = offset - block_pos;
+		if (dict_offset > output->dict_length)
+		{
+			printf("Invalid offset detected: 0x%x\n", offset);
+			return false;
+		}
+
+		uint32_t dict_copy = MIN(copy_length, dict_offset);
+		writer_append_dict_dpu(output, output->dict_length - dict_offset, dict_copy);
+		copy_length -= dict_copy;
+		if (copy_length == 0)
+			return true;
+	}
+
+	// We only copy previous data of this block, or of the previous block
+	// of its group, not future data
+	if (offset > (output->curr - output->window_start))
 	{
 		printf("Invalid offset detected: 0x%x\n", offset);
 		return false;
@@ -209,6 +304,8 @@ static bool write_copy_dpu(struct out_buffer_context *output, uint32_t copy_leng
 		}		
 		
 		memcpy(&output->append_ptr[curr_index], read_ptr, to_copy);
+		if (output->flags & SNAPPY_FLAG_CRC32C)
+			output->crc = crc32c_update(output->crc, &output->append_ptr[curr_index], to_copy);
 		output->curr += to_copy;
 		copy_length -= to_copy;
 		curr_index += to_copy;
@@ -225,15 +322,46 @@ snappy_status dpu_uncompress(struct in_buffer_context *input, struct out_buffer_
 {
 	dbg_printf("curr: %u length: %u\n", input->curr, input->length);
 	dbg_printf("output length: %u\n", output->length);
+	uint32_t group_pos = 0;
 	while (input->curr < input->length) 
 	{
-		// Read the compressed block size
+		// Read the compressed block size and type
 		uint32_t compressed_size = READ_BYTE(input) |
 						(READ_BYTE(input) << 8) |
 						(READ_BYTE(input) << 16) |
 						(READ_BYTE(input) << 24);
+		uint32_t block_type = GET_BLOCK_TYPE(compressed_size);
+		compressed_size = GET_BLOCK_SIZE(compressed_size);
+
+		// Chained blocks may copy from the previous block of their group,
+		// every tasklet starts at the first block of a group
+		output->window_start = (group_pos != 0) ? output->block_start : output->curr;
+		output->block_start = output->curr;
+		if (++group_pos == output->group_blocks)
+			group_pos = 0;
+
+		// Skip over the stored checksum, the host checks the fold of the
+		// checksums we calculate against the stored ones
+		if (output->flags & SNAPPY_FLAG_CRC32C) {
+			advance_seqread(input, sizeof(uint32_t));
+			output->crc = CRC32C_INIT;
+		}
 		uint32_t block_end = input->curr + compressed_size;
 
+		// Raw blocks are copied as one literal, and runs are filled in
+		// without reading anything else from MRAM
+		if (block_type == BLOCK_TYPE_RAW) {
+			writer_append_dpu(input, output, compressed_size);
+		}
+		else if (block_type == BLOCK_TYPE_RUN) {
+			if (compressed_size != 1)
+				return SNAPPY_INVALID_INPUT;
+			writer_fill_dpu(output, READ_BYTE(input), MIN(output->block_size, output->length - output->curr));
+		}
+		else if (block_type != BLOCK_TYPE_SNAPPY) {
+			return SNAPPY_INVALID_INPUT;
+		}
+
 		while (input->curr < block_end) {
 			uint32_t length;
 			uint32_t offset;
@@ -284,11 +412,14 @@ snappy_status dpu_uncompress(struct in_buffer_context *input, struct out_buffer_
 				break;
 			}
 		}
+
+		if (output->flags & SNAPPY_FLAG_CRC32C)
+			output->crc_fold = crc32c_update_word(output->crc_fold, crc32c_mask(output->crc));
 	}
 
 	// Write out the final buffer
 	if (output->append_window < output->length) {
-		uint32_t len_final = output->length % OUT_BUFFER_LENGTH;
+		uint32_t len_final = ALIGN(output->length % OUT_BUFFER_LENGTH, 8);
 		if (len_final == 0)
 			len_final = OUT_BUFFER_LENGTH;
 
@@ -22,6 +22,61 @@
 #undef SEQREAD_CACHE_SIZE
 #define SEQREAD_CACHE_SIZE OUT_BUFFER_LENGTH
 
+// Format flags, must match the ones in dpu_snappy.h
+#define SNAPPY_FLAG_CRC32C (1 << 0)
+#define SNAPPY_FLAG_DICT (1 << 2)
+#define SNAPPY_FLAG_CHAINED (1 << 3)
+
+// Largest preset dictionary, must match the one in dpu_snappy.h
+#define SNAPPY_MAX_DICT_LENGTH KILOBYTE(32)
+
+// Block types, must match the ones in dpu_snappy.h
+#define BLOCK_TYPE_SNAPPY 0U		// Snappy compressed data
+#define BLOCK_TYPE_RAW 1U		// The decompressed data, stored as is
+#define BLOCK_TYPE_RUN 2U		// One byte, repeated for the whole decompressed block
+#define BLOCK_TYPE_SHIFT 30
+#define GET_BLOCK_TYPE(_size) ((_size) >> BLOCK_TYPE_SHIFT)
+#define GET_BLOCK_SIZE(_size) ((_size) & BITMASK(BLOCK_TYPE_SHIFT))
+
+// Most jobs one DPU runs in a launch, must match the one in dpu_context.h
+#define MAX_DPU_JOBS 4096
+
+/**
+ * A range of whole groups of blocks of one compressed input that a tasklet
+ * decompresses on its own. The host writes a table of them to MRAM. Must
+ * match the one in dpu_context.h.
+ */
+struct dpu_job {
+	uint32_t input_offset;	// Offset of the first block header in input_buffer
+	uint32_t input_length;	// Length of the blocks, headers included
+	uint32_t output_offset;	// Offset of the output in output_buffer, a multiple of 8
+	uint32_t output_length;	// Decompressed length of the blocks
+	uint32_t block_size;	// Decompressed size of every block but the last of the stream
+	uint32_t flags;			// Format flags of the stream
+	uint32_t group_blocks;	// Blocks in each group, 1 if blocks are not chained
+	uint32_t file;			// Index of the input on the host, not used by the DPU
+};
+
+// Entries of task_jobs in dpu_params, NR_TASKLETS + 1 rounded up so the
+// parameters are a whole number of 8-byte words
+#define DPU_PARAMS_TASK_JOBS (((NR_TASKLETS) + 2) & ~1)
+
+// Entries of the checksum folds the tasklets report, NR_TASKLETS rounded up
+// to a whole number of 8-byte words
+#define DPU_TASKLET_CRCS (((NR_TASKLETS) + 1) & ~1)
+
+/**
+ * Parameters of a launch, written by the host to each DPU in one transfer
+ * before every launch. Must match the one in dpu_context.h.
+ */
+struct dpu_params {
+	uint32_t active_tasklets;	// Number of tasklets that run jobs, the others exit right away
+	uint32_t claim_jobs;		// Whether the tasklets claim the jobs one at a time instead of running their own range
+	uint32_t next_job;			// Index in job_table of the next job to claim, 0 at launch
+	uint32_t dictionary_length;	// Length of the preset dictionary, for the jobs with SNAPPY_FLAG_DICT
+	uint32_t task_jobs[DPU_PARAMS_TASK_JOBS];	// Index in job_table of each tasklet's first job, then the number of jobs
+};
+
 // Return values
 typedef enum {
     SNAPPY_OK = 0,              // Success code
@@ -68,6 +123,15 @@ typedef struct out_buffer_context
 	uint8_t *read_buf;
 	uint32_t curr; /* current offset in output buffer in MRAM */
 	uint32_t length; /* total size of output buffer in bytes */
+	uint32_t block_size; /* decompressed size of every block but the last */
+	uint32_t block_start; /* offset in output buffer of the current block */
+	uint32_t window_start; /* offset in output buffer of the first byte copies may reach back to */
+	uint32_t group_blocks; /* blocks in each group, 1 if blocks are not chained */
+	__mram_ptr uint8_t *dictionary; /* the preset dictionary in MRAM, which comes right before every block */
+	uint32_t dict_length; /* length of the preset dictionary, 0 if there is none */
+	uint32_t flags; /* format flags of the stream */
+	uint32_t crc; /* running checksum of the current block */
+	uint32_t crc_fold; /* running checksum of the masked checksums of all finished blocks */
 } out_buffer_context;
 
 /**
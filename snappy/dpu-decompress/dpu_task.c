@@ -1,27 +1,52 @@
 #include <mram.h>
 #include <defs.h>
+#include <mutex.h>
 #include <perfcounter.h>
 #include <stdio.h>
 #include "alloc.h"
 #include "dpu_decompress.h"
+#include "crc32c.h"
 
 // Comment out to count instructions
 #define COUNT_CYC
 
 // WRAM variables
-__host uint32_t input_length;
-__host uint32_t output_length;
-__host uint32_t input_offset[NR_TASKLETS];
-__host uint32_t output_offset[NR_TASKLETS];
+__host __dma_aligned struct dpu_params params; // Parameters of the launch, see dpu_params
+__host __dma_aligned uint32_t output_crc[DPU_TASKLET_CRCS]; // Fold of the block checksums of each tasklet's output
 
 // MRAM buffers
 uint8_t __mram_noinit input_buffer[MEGABYTE(30)];
 uint8_t __mram_noinit output_buffer[MEGABYTE(30)];
+uint8_t __mram_noinit dictionary_buffer[SNAPPY_MAX_DICT_LENGTH];
+__dma_aligned struct dpu_job __mram_noinit job_table[MAX_DPU_JOBS]; // Jobs of every tasklet, see dpu_decompress.h
+
+// Guards params.next_job
+MUTEX_INIT(job_mutex);
+
+/**
+ * Pick the next job a tasklet runs. Each tasklet runs its own range of the
+ * job table in order, unless the tasklets claim jobs, and then it takes the
+ * first job no other tasklet has taken yet.
+ *
+ * @param next: index of the job after the last one this tasklet ran
+ * @return Index in job_table of the job to run
+ */
+static uint32_t claim_job(uint32_t next)
+{
+	if (!params.claim_jobs)
+		return next;
+
+	mutex_lock(job_mutex);
+	next = params.next_job++;
+	mutex_unlock(job_mutex);
+	return next;
+}
 
 int main()
 {
 	struct in_buffer_context input;
 	struct out_buffer_context output;
+	__dma_aligned struct dpu_job job;
 	uint8_t idx = me();
 
 #ifdef COUNT_CYC
@@ -30,66 +55,71 @@ int main()
 	perfcounter_config(COUNT_INSTRUCTIONS, (idx == 0)? true : false);
 #endif
 
+	// The program is built with the most tasklets the host may ask for, and
+	// the ones it does not use exit right away
+	if (idx >= params.active_tasklets)
+		return 0;
+
 	printf("DPU starting, tasklet %d\n", idx);
 	
-	// Check that this tasklet has work to run 
-	if ((idx != 0) && (input_offset[idx] == 0)) {
+	// Check that this tasklet has work to run. Claimed jobs are taken from
+	// all the jobs of the DPU.
+	output_crc[idx] = 0;
+	uint32_t last = params.claim_jobs ? params.task_jobs[params.active_tasklets] : params.task_jobs[idx + 1];
+	uint32_t i = claim_job(params.task_jobs[idx]);
+	if (i >= last) {
 		printf("Tasklet %d has nothing to run\n", idx);
 		return 0;
 	}
 
-	// Prepare the input and output descriptors
-	uint32_t input_start = input_offset[idx] - input_offset[0];
-	uint32_t output_start = output_offset[idx] - output_offset[0];
-
+	// The buffers are shared by all the jobs of this tasklet
 	input.cache = seqread_alloc();
-	input.ptr = seqread_init(input.cache, input_buffer + input_start, &input.sr);
-	input.curr = 0;
-	input.length = 0;
-
-	output.buffer = output_buffer + output_start;
 	output.append_ptr = (uint8_t*)ALIGN(mem_alloc(OUT_BUFFER_LENGTH), 8);
-	output.append_window = 0;
 	output.read_buf = (uint8_t*)ALIGN(mem_alloc(OUT_BUFFER_LENGTH), 8);
-	output.curr = 0;
-	output.length = 0;
-
-	// Calculate the actual length this tasklet parses
-	if (idx < (NR_TASKLETS - 1)) {
-		int32_t input_end = input_offset[idx + 1] - input_offset[0];
-		int32_t output_end = output_offset[idx + 1] - output_offset[0];
-
-		// If the end position is negative, then the next task has no work
-		// to run. Use the remainder of the input length to calculate this
-		// task's length.
-		if ((input_end <= 0) || (output_end <= 0)) {
-			input.length = input_length - input_start;
-			output.length = output_length - output_start;
-		}
-		else {
-			input.length = input_end - input_start;
-			output.length = output_end - output_start;
-		}
-	}
-	else {
-		input.length = input_length - input_start;
-		output.length = output_length - output_start;
-	} 
+	output.dictionary = dictionary_buffer;
+	output.crc_fold = CRC32C_INIT;
 
-	if (input.length != 0) {
-		// Do the uncompress
+	uint32_t total_length = 0;
+	uint32_t claimed_crc = 0;
+	for (; i < last; i = claim_job(i + 1)) {
+		mram_read(&job_table[i], &job, sizeof(job));
+
+		// Prepare the input and output descriptors
+		input.ptr = seqread_init(input.cache, input_buffer + job.input_offset, &input.sr);
+		input.curr = 0;
+		input.length = job.input_length;
+
+		output.buffer = output_buffer + job.output_offset;
+		output.append_window = 0;
+		output.curr = 0;
+		output.length = job.output_length;
+		output.block_size = job.block_size;
+		output.block_start = 0;
+		output.window_start = 0;
+		output.group_blocks = (job.flags & SNAPPY_FLAG_CHAINED) ? job.group_blocks : 1;
+		output.dict_length = (job.flags & SNAPPY_FLAG_DICT) ? params.dictionary_length : 0;
+		output.flags = job.flags;
+		output.crc = CRC32C_INIT;
+		if (params.claim_jobs)
+			output.crc_fold = CRC32C_INIT;
+
+		// Do the uncompress, and the checksums of every job's blocks are folded
+		// together, or each claimed job's on their own
 		if (dpu_uncompress(&input, &output))
 		{
 			printf("Tasklet %d: failed in %ld cycles\n", idx, perfcounter_get());
 			return -1;
 		}
+		if (params.claim_jobs)
+			claimed_crc ^= ~output.crc_fold;
+		total_length += job.input_length;
 	}
+	output_crc[idx] = params.claim_jobs ? claimed_crc : ~output.crc_fold;
 
 #ifdef COUNT_CYC
-	printf("Tasklet %d: %ld cycles, %d bytes\n", idx, perfcounter_get(), input.length);
+	printf("Tasklet %d: %ld cycles, %d bytes\n", idx, perfcounter_get(), total_length);
 #else
-	printf("Tasklet %d: %ld instructions, %d bytes\n", idx, perfcounter_get(), input.length);
+	printf("Tasklet %d: %ld instructions, %d bytes\n", idx, perfcounter_get(), total_length);
 #endif	
 	return 0;
 }
-
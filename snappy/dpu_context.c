@@ -0,0 +1,559 @@
+#include <dpu.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dpu_context.h"
+#include "crc32c.h"
+
+void dpu_context_init(struct dpu_context *ctx, uint32_t nr_dpus, uint32_t nr_tasklets, uint32_t nr_waves, bool keep_allocated)
+{
+	ctx->allocated = false;
+	ctx->keep_allocated = keep_allocated;
+	ctx->program = NULL;
+	ctx->nr_dpus = (nr_dpus == 0) ? NR_DPUS : nr_dpus;
+	ctx->nr_tasklets = ((nr_tasklets == 0) || (nr_tasklets > NR_TASKLETS)) ? NR_TASKLETS : nr_tasklets;
+	ctx->nr_waves = (nr_waves == 0) ? 1 : nr_waves;
+	ctx->claim_jobs = false;
+}
+
+void dpu_context_load(struct dpu_context *ctx, const char *program, struct program_runtime *runtime)
+{
+	struct timeval start;
+	struct timeval end;
+
+	runtime->d_alloc = 0;
+	if (!ctx->allocated) {
+		gettimeofday(&start, NULL);
+		DPU_ASSERT(dpu_alloc(ctx->nr_dpus, NULL, &ctx->dpus));
+		gettimeofday(&end, NULL);
+
+		ctx->allocated = true;
+		ctx->program = NULL;
+		runtime->d_alloc = get_runtime(&start, &end);
+	}
+
+	runtime->load = 0;
+	if ((ctx->program != NULL) && (strcmp(ctx->program, program) == 0))
+		return;
+
+	gettimeofday(&start, NULL);
+	DPU_ASSERT(dpu_load(ctx->dpus, program, NULL));
+	gettimeofday(&end, NULL);
+
+	ctx->program = program;
+	runtime->load = get_runtime(&start, &end);
+}
+
+snappy_status dpu_context_run(struct dpu_context *ctx, const struct dpu_job_ops *ops, void *job, struct program_runtime *runtime)
+{
+	struct timeval start;
+	struct timeval end;
+	struct dpu_set_t dpu_rank;
+	uint32_t rank_idx;
+
+	// Find the first DPU of each rank
+	uint32_t nr_ranks;
+	DPU_ASSERT(dpu_get_nr_ranks(ctx->dpus, &nr_ranks));
+	uint32_t *first_dpu = malloc(sizeof(uint32_t) * (nr_ranks + 1));
+	first_dpu[0] = 0;
+	DPU_RANK_FOREACH(ctx->dpus, dpu_rank, rank_idx) {
+		uint32_t nr_dpus;
+		DPU_ASSERT(dpu_get_nr_dpus(dpu_rank, &nr_dpus));
+		first_dpu[rank_idx + 1] = first_dpu[rank_idx] + nr_dpus;
+	}
+
+	// Split the ranks into waves of whole ranks
+	uint32_t ranks_per_wave = (nr_ranks + ctx->nr_waves - 1) / ctx->nr_waves;
+	uint32_t nr_waves = (nr_ranks + ranks_per_wave - 1) / ranks_per_wave;
+
+	snappy_status status = SNAPPY_OK;
+	bool launched = true;
+	runtime->copy_in = 0;
+	runtime->copy_in_bytes = 0;
+	runtime->run = 0;
+	for (uint32_t wave = 0; launched && (wave <= nr_waves); wave++) {
+		// Copy the input of this wave in and launch it
+		if (wave < nr_waves) {
+			gettimeofday(&start, NULL);
+			DPU_RANK_FOREACH(ctx->dpus, dpu_rank, rank_idx) {
+				if ((rank_idx / ranks_per_wave) == wave) {
+					ops->copy_in(dpu_rank, first_dpu[rank_idx], job);
+				}
+			}
+			gettimeofday(&end, NULL);
+			runtime->copy_in += get_runtime(&start, &end);
+
+			DPU_RANK_FOREACH(ctx->dpus, dpu_rank, rank_idx) {
+				if (((rank_idx / ranks_per_wave) == wave) && (dpu_launch(dpu_rank, DPU_ASYNCHRONOUS) != 0))
+					launched = false;
+			}
+
+			if ((wave == 0) && (ops->overlap != NULL))
+				ops->overlap(job);
+		}
+
+		// While it runs, wait for the previous wave and copy its results out
+		if (launched && (wave > 0)) {
+			DPU_RANK_FOREACH(ctx->dpus, dpu_rank, rank_idx) {
+				if ((rank_idx / ranks_per_wave) != (wave - 1))
+					continue;
+
+				gettimeofday(&start, NULL);
+				int ret = dpu_sync(dpu_rank);
+				gettimeofday(&end, NULL);
+				runtime->run += get_runtime(&start, &end);
+
+				if (ret != 0) {
+					launched = false;
+					break;
+				}
+
+				snappy_status rank_status = ops->copy_out(dpu_rank, first_dpu[rank_idx], job);
+				if (rank_status != SNAPPY_OK)
+					status = rank_status;
+			}
+		}
+	}
+
+	// Let any wave still running finish before the DPUs are used again
+	if (!launched) {
+		dpu_sync(ctx->dpus);
+		status = SNAPPY_INVALID_INPUT;
+	}
+
+	free(first_dpu);
+	return status;
+}
+
+void dpu_context_release(struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	if (!ctx->keep_allocated)
+		dpu_context_free(ctx, runtime);
+}
+
+void dpu_context_free(struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	struct timeval start;
+	struct timeval end;
+
+	runtime->d_free = 0;
+	if (!ctx->allocated)
+		return;
+
+	gettimeofday(&start, NULL);
+	DPU_ASSERT(dpu_free(ctx->dpus));
+	gettimeofday(&end, NULL);
+
+	ctx->allocated = false;
+	ctx->program = NULL;
+	runtime->d_free = get_runtime(&start, &end);
+}
+
+void dpu_batch_init(struct dpu_batch *batch, const struct dpu_context *ctx, uint64_t total_length, uint64_t total_work, uint32_t output_align, uint32_t output_slack)
+{
+	memset(batch, 0, sizeof(struct dpu_batch));
+	batch->total_length = total_length;
+	batch->total_work = total_work;
+	batch->output_align = output_align;
+	batch->output_slack = output_slack;
+	batch->nr_dpus = ctx->nr_dpus;
+	batch->nr_tasklets = ctx->nr_tasklets;
+	batch->claim_jobs = ctx->claim_jobs;
+	batch->first_job = calloc(batch->nr_dpus + 1, sizeof(uint32_t));
+	batch->params = calloc(batch->nr_dpus, sizeof(struct dpu_params));
+	for (uint32_t i = 0; i < batch->nr_dpus; i++) {
+		batch->params[i].active_tasklets = batch->nr_tasklets;
+		batch->params[i].claim_jobs = batch->claim_jobs;
+	}
+	batch->input_length = calloc(batch->nr_dpus, sizeof(uint32_t));
+	batch->output_length = calloc(batch->nr_dpus, sizeof(uint32_t));
+	batch->crc_fold = malloc(sizeof(uint32_t) * batch->nr_dpus * batch->nr_tasklets);
+	for (uint32_t i = 0; i < (batch->nr_dpus * batch->nr_tasklets); i++)
+		batch->crc_fold[i] = CRC32C_INIT;
+	batch->task_work = calloc(batch->nr_dpus * batch->nr_tasklets, sizeof(uint64_t));
+	batch->length_task_work = calloc(batch->nr_dpus * batch->nr_tasklets, sizeof(uint64_t));
+}
+
+/**
+ * Move on to the next tasklet of a batch, or to the first tasklet of the
+ * next DPU. When the tasklets claim jobs, all of them go to the first tasklet.
+ *
+ * @param batch: batch being packed
+ * @param next_dpu: leave the rest of the tasklets of the DPU without jobs
+ */
+static void next_tasklet(struct dpu_batch *batch, bool next_dpu)
+{
+	if (next_dpu || batch->claim_jobs || (++batch->tasklet == batch->nr_tasklets)) {
+		batch->tasklet = 0;
+		if (++batch->dpu < batch->nr_dpus)
+			batch->first_job[batch->dpu] = batch->nr_jobs;
+	}
+}
+
+/**
+ * Follow the tasklet a group would go to if the groups were split by length,
+ * each tasklet taking groups until it has its share of the total length.
+ *
+ * @param batch: batch being packed
+ * @param length: length of the group
+ * @param work: work of the group
+ */
+static void add_length_split(struct dpu_batch *batch, uint32_t length, uint32_t work)
+{
+	uint64_t nr_tasks = (uint64_t)batch->nr_dpus * batch->nr_tasklets;
+	bool task_full = (batch->packed_length * nr_tasks) >= (batch->total_length * (batch->length_task + 1));
+	if (task_full && (batch->length_task_work[batch->length_task] != 0) && ((batch->length_task + 1) < nr_tasks))
+		batch->length_task++;
+
+	batch->length_task_work[batch->length_task] += work;
+	batch->packed_length += length;
+}
+
+bool dpu_batch_add(struct dpu_batch *batch, const struct dpu_job *group, size_t input_start, size_t output_start, uint32_t length, uint32_t work)
+{
+	struct dpu_job *last = (batch->nr_jobs != 0) ? &batch->jobs[batch->nr_jobs - 1] : NULL;
+	struct dpu_job_source *last_source = (batch->nr_jobs != 0) ? &batch->sources[batch->nr_jobs - 1] : NULL;
+
+	// Move on to the next tasklet once most of this group's work would be past
+	// this one's share, so each tasklet ends on the group boundary nearest it.
+	// When the tasklets claim jobs, only the DPUs are given a share.
+	uint64_t nr_tasks = batch->claim_jobs ? batch->nr_dpus : ((uint64_t)batch->nr_dpus * batch->nr_tasklets);
+	uint64_t task = batch->claim_jobs ? batch->dpu : ((uint64_t)batch->dpu * batch->nr_tasklets + batch->tasklet);
+	bool task_used = (last_source != NULL) && (last_source->dpu == batch->dpu) && (last_source->tasklet == batch->tasklet);
+	if (task_used && (((2 * batch->packed_work + work) * nr_tasks) >= (2 * batch->total_work * (task + 1))))
+		next_tasklet(batch, false);
+
+	while (batch->dpu < batch->nr_dpus) {
+		uint32_t dpu = batch->dpu;
+		bool same_file = (last_source != NULL) && (last_source->dpu == dpu) && (last->file == group->file);
+		bool extend = same_file && (last_source->tasklet == batch->tasklet) && ((last_source->input_start + last->input_length) == input_start);
+
+		// Jobs that are claimed are kept small, so the tasklets finish together
+		if (extend && batch->claim_jobs && ((last->input_length >= DPU_CLAIM_LENGTH) || (last->output_length >= DPU_CLAIM_LENGTH)))
+			extend = false;
+
+		// The jobs of one file stay next to each other in MRAM, as they are on
+		// the host, so that they can be copied in and out in one piece
+		uint32_t input_offset = same_file ? batch->input_length[dpu] : ALIGN(batch->input_length[dpu], 8);
+		uint32_t output_align = (!same_file && (batch->output_align < 8)) ? 8 : batch->output_align;
+		uint32_t output_offset = ALIGN(batch->output_length[dpu], output_align);
+
+		uint64_t input_end;
+		uint64_t output_end;
+		if (extend) {
+			input_end = (uint64_t)batch->input_length[dpu] + group->input_length;
+			output_end = (uint64_t)batch->output_length[dpu] + group->output_length;
+		}
+		else {
+			input_end = (uint64_t)input_offset + group->input_length;
+			output_end = (uint64_t)output_offset + group->output_length + batch->output_slack;
+		}
+
+		// Leave a DPU early once its buffers or its job table are full
+		uint32_t dpu_jobs = batch->nr_jobs - batch->first_job[dpu];
+		if ((input_end > MAX_FILE_LENGTH) || (output_end > MAX_FILE_LENGTH) || (!extend && (dpu_jobs == MAX_DPU_JOBS))) {
+			if (dpu_jobs == 0)
+				return false;
+			next_tasklet(batch, true);
+			continue;
+		}
+
+		if (extend) {
+			last->input_length += group->input_length;
+			last->output_length += group->output_length;
+		}
+		else {
+			if (batch->nr_jobs == batch->max_jobs) {
+				batch->max_jobs = (batch->max_jobs == 0) ? 64 : (batch->max_jobs * 2);
+				batch->jobs = realloc(batch->jobs, sizeof(struct dpu_job) * batch->max_jobs);
+				batch->sources = realloc(batch->sources, sizeof(struct dpu_job_source) * batch->max_jobs);
+			}
+
+			struct dpu_job *job = &batch->jobs[batch->nr_jobs];
+			*job = *group;
+			job->input_offset = input_offset;
+			job->output_offset = output_offset;
+
+			struct dpu_job_source *source = &batch->sources[batch->nr_jobs];
+			source->dpu = dpu;
+			source->tasklet = batch->tasklet;
+			source->input_start = input_start;
+			source->output_start = output_start;
+			source->crc_fold = CRC32C_INIT;
+			batch->nr_jobs++;
+		}
+
+		batch->input_length[dpu] = input_end;
+		batch->output_length[dpu] = output_end;
+		batch->task_work[dpu * batch->nr_tasklets + batch->tasklet] += work;
+		batch->packed_work += work;
+		batch->flags |= group->flags;
+		add_length_split(batch, length, work);
+		return true;
+	}
+
+	return false;
+}
+
+void dpu_batch_finish(struct dpu_batch *batch)
+{
+	uint32_t max_dpu_jobs = 0;
+	uint32_t job = 0;
+	for (uint32_t dpu = 0; dpu < batch->nr_dpus; dpu++) {
+		uint32_t *task_jobs = DPU_BATCH_TASK_JOBS(batch, dpu);
+		batch->first_job[dpu] = job;
+		for (uint32_t task = 0; task < batch->nr_tasklets; task++) {
+			task_jobs[task] = job - batch->first_job[dpu];
+			while ((job < batch->nr_jobs) && (batch->sources[job].dpu == dpu) && (batch->sources[job].tasklet == task))
+				job++;
+		}
+
+		uint32_t dpu_jobs = job - batch->first_job[dpu];
+		task_jobs[batch->nr_tasklets] = dpu_jobs;
+		if (max_dpu_jobs < dpu_jobs)
+			max_dpu_jobs = dpu_jobs;
+	}
+	batch->first_job[batch->nr_dpus] = job;
+
+	// Every DPU of a rank may be sent as many jobs as the DPU with the most,
+	// so the table has that many more after the last DPU's jobs
+	batch->jobs = realloc(batch->jobs, sizeof(struct dpu_job) * (batch->nr_jobs + max_dpu_jobs));
+	memset(&batch->jobs[batch->nr_jobs], 0, sizeof(struct dpu_job) * max_dpu_jobs);
+}
+
+bool dpu_batch_align_tasks(struct dpu_batch *batch)
+{
+	if (batch->claim_jobs)
+		return false;
+
+	// Each tasklet's output starts where the longest output of the tasklet
+	// before it ends, on any of the DPUs
+	uint32_t *task_offset = malloc(sizeof(uint32_t) * (batch->nr_tasklets + 1));
+	uint64_t offset = 0;
+	for (uint32_t task = 0; task < batch->nr_tasklets; task++) {
+		uint32_t longest = 0;
+		for (uint32_t dpu = 0; dpu < batch->nr_dpus; dpu++) {
+			const uint32_t *task_jobs = DPU_BATCH_TASK_JOBS(batch, dpu);
+			const struct dpu_job *jobs = &batch->jobs[batch->first_job[dpu]];
+			if (task_jobs[task] == task_jobs[task + 1])
+				continue;
+
+			uint32_t start = jobs[task_jobs[task]].output_offset;
+			uint32_t end = (task_jobs[task + 1] != task_jobs[batch->nr_tasklets]) ? jobs[task_jobs[task + 1]].output_offset : batch->output_length[dpu];
+			if (longest < (end - start))
+				longest = end - start;
+		}
+
+		task_offset[task] = offset;
+		offset = ALIGN(offset + longest, batch->output_align);
+	}
+	if (offset > MAX_FILE_LENGTH) {
+		free(task_offset);
+		return false;
+	}
+	task_offset[batch->nr_tasklets] = offset;
+
+	for (uint32_t dpu = 0; dpu < batch->nr_dpus; dpu++) {
+		const uint32_t *task_jobs = DPU_BATCH_TASK_JOBS(batch, dpu);
+		struct dpu_job *jobs = &batch->jobs[batch->first_job[dpu]];
+		for (uint32_t task = 0; task < batch->nr_tasklets; task++) {
+			if (task_jobs[task] == task_jobs[task + 1])
+				continue;
+
+			uint32_t start = jobs[task_jobs[task]].output_offset;
+			uint32_t end = (task_jobs[task + 1] != task_jobs[batch->nr_tasklets]) ? jobs[task_jobs[task + 1]].output_offset : batch->output_length[dpu];
+			for (uint32_t i = task_jobs[task]; i < task_jobs[task + 1]; i++)
+				jobs[i].output_offset += task_offset[task] - start;
+			batch->output_length[dpu] = task_offset[task] + (end - start);
+		}
+	}
+
+	batch->task_offset = task_offset;
+	return true;
+}
+
+void dpu_batch_report(const struct dpu_batch *batch)
+{
+	// Tasklets that claim jobs balance their work themselves
+	uint32_t nr_tasks = batch->nr_dpus * batch->nr_tasklets;
+	if (batch->claim_jobs || (batch->packed_work == 0))
+		return;
+
+	uint64_t most_work = 0;
+	uint64_t most_length_work = 0;
+	for (uint32_t i = 0; i < nr_tasks; i++) {
+		if (most_work < batch->task_work[i])
+			most_work = batch->task_work[i];
+		if (most_length_work < batch->length_task_work[i])
+			most_length_work = batch->length_task_work[i];
+	}
+
+	// Tasklets left without work count towards the mean
+	double mean_work = (double)batch->packed_work / nr_tasks;
+	printf("Tasklet imbalance (most / mean estimated work): %f split by length, %f split by work\n",
+		   most_length_work / mean_work, most_work / mean_work);
+}
+
+/**
+ * Check whether all the jobs of a DPU are from one file.
+ *
+ * @param batch: finished batch
+ * @param dpu: index of the DPU
+ * @return true if the DPU has jobs, all from the same file
+ */
+static bool dpu_batch_one_file(const struct dpu_batch *batch, uint32_t dpu)
+{
+	uint32_t first = batch->first_job[dpu];
+	uint32_t last = batch->first_job[dpu + 1];
+	if (first == last)
+		return false;
+
+	for (uint32_t i = first + 1; i < last; i++) {
+		if (batch->jobs[i].file != batch->jobs[first].file)
+			return false;
+	}
+	return true;
+}
+
+uint8_t *dpu_batch_input(const struct dpu_batch *batch, uint32_t dpu, const struct host_buffer_context *inputs, uint32_t length, bool *gathered)
+{
+	uint32_t first = batch->first_job[dpu];
+	if (dpu_batch_one_file(batch, dpu)) {
+		const struct host_buffer_context *input = &inputs[batch->jobs[first].file];
+		size_t start = batch->sources[first].input_start;
+		if ((start + length) <= ALIGN(input->length, 8)) {
+			*gathered = false;
+			return input->buffer + start;
+		}
+	}
+
+	uint8_t *buffer = calloc(length, 1);
+	for (uint32_t i = first; i < batch->first_job[dpu + 1]; i++) {
+		const struct dpu_job *job = &batch->jobs[i];
+		memcpy(buffer + job->input_offset, inputs[job->file].buffer + batch->sources[i].input_start, job->input_length);
+	}
+	*gathered = true;
+	return buffer;
+}
+
+uint8_t *dpu_batch_output(const struct dpu_batch *batch, uint32_t dpu, struct host_buffer_context *outputs, uint32_t length, bool *staged)
+{
+	uint32_t first = batch->first_job[dpu];
+	if (dpu_batch_one_file(batch, dpu)) {
+		struct host_buffer_context *output = &outputs[batch->jobs[first].file];
+		size_t start = batch->sources[first].output_start;
+		size_t end = start + batch->output_length[dpu];
+
+		// The padding of the copy may only land after the end of the file
+		bool padded = (length != batch->output_length[dpu]);
+		if ((!padded || (end == output->length)) && ((start + length) <= ALIGN(output->length, 8))) {
+			*staged = false;
+			return output->buffer + start;
+		}
+	}
+
+	*staged = true;
+	return malloc(length);
+}
+
+void dpu_batch_scatter(const struct dpu_batch *batch, uint32_t dpu, struct host_buffer_context *outputs, uint8_t *buffer)
+{
+	for (uint32_t i = batch->first_job[dpu]; i < batch->first_job[dpu + 1]; i++) {
+		const struct dpu_job *job = &batch->jobs[i];
+		memcpy(outputs[job->file].buffer + batch->sources[i].output_start, buffer + job->output_offset, job->output_length);
+	}
+	free(buffer);
+}
+
+bool dpu_batch_check_crcs(const struct dpu_batch *batch, uint32_t dpu, const uint32_t *crcs)
+{
+	// Any tasklet may have run any job, so only the folds of all of them
+	// together can be checked
+	if (batch->claim_jobs) {
+		uint32_t expected = 0;
+		uint32_t reported = 0;
+		for (uint32_t i = batch->first_job[dpu]; i < batch->first_job[dpu + 1]; i++)
+			expected ^= ~batch->sources[i].crc_fold;
+		for (uint32_t task = 0; task < batch->nr_tasklets; task++)
+			reported ^= crcs[task];
+
+		if (reported != expected) {
+			fprintf(stderr, "DPU %u failed its checksum\n", dpu);
+			return false;
+		}
+		return true;
+	}
+
+	const uint32_t *task_jobs = DPU_BATCH_TASK_JOBS(batch, dpu);
+	bool ok = true;
+	for (uint32_t task = 0; task < batch->nr_tasklets; task++) {
+		// Tasklets without any jobs report zero
+		bool has_jobs = (task_jobs[task] != task_jobs[task + 1]);
+		uint32_t expected = has_jobs ? ~DPU_BATCH_CRC_FOLD(batch, dpu, task) : 0;
+		if (crcs[task] != expected) {
+			fprintf(stderr, "DPU %u tasklet %u failed its checksum\n", dpu, task);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+void dpu_batch_free(struct dpu_batch *batch)
+{
+	free(batch->jobs);
+	free(batch->sources);
+	free(batch->first_job);
+	free(batch->params);
+	free(batch->input_length);
+	free(batch->output_length);
+	free(batch->crc_fold);
+	free(batch->task_work);
+	free(batch->length_task_work);
+	free(batch->task_offset);
+	batch->jobs = NULL;
+	batch->task_offset = NULL;
+	batch->sources = NULL;
+}
+
+uint64_t dpu_context_xfer(struct dpu_set_t dpu_rank, dpu_xfer_t direction, const char *symbol, uint8_t **buffers, const uint32_t *lengths)
+{
+	return dpu_context_xfer_at(dpu_rank, direction, symbol, 0, buffers, lengths);
+}
+
+uint64_t dpu_context_xfer_at(struct dpu_set_t dpu_rank, dpu_xfer_t direction, const char *symbol, uint32_t offset, uint8_t **buffers, const uint32_t *lengths)
+{
+	struct dpu_set_t dpu;
+	uint32_t i = 0;
+	uint64_t bytes = 0;
+
+#ifdef BULK_XFER
+	uint32_t largest_length = 0;
+	uint32_t nr_prepared = 0;
+	DPU_FOREACH(dpu_rank, dpu) {
+		if (lengths[i] != 0) {
+			DPU_ASSERT(dpu_prepare_xfer(dpu, buffers[i]));
+			if (largest_length < lengths[i])
+				largest_length = lengths[i];
+			nr_prepared++;
+		}
+		i++;
+	}
+	if (largest_length != 0)
+		DPU_ASSERT(dpu_push_xfer(dpu_rank, direction, symbol, offset, largest_length, DPU_XFER_DEFAULT));
+	bytes = (uint64_t)largest_length * nr_prepared;
+#else
+	DPU_FOREACH(dpu_rank, dpu) {
+		if (lengths[i] != 0) {
+			if (direction == DPU_XFER_TO_DPU)
+				DPU_ASSERT(dpu_copy_to(dpu, symbol, offset, buffers[i], lengths[i]));
+			else
+				DPU_ASSERT(dpu_copy_from(dpu, symbol, offset, buffers[i], lengths[i]));
+			bytes += lengths[i];
+		}
+		i++;
+	}
+#endif
+
+	return bytes;
+}
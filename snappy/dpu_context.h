@@ -0,0 +1,390 @@
+/**
+ * A set of DPUs that stays allocated across any number of compression and
+ * decompression jobs.
+ *
+ * Allocating the DPUs and loading a program take longer than running a job on
+ * inputs below tens of MB, so a context pays for them once. A program is only
+ * loaded again when a job needs the other one, and every job writes all the
+ * __host variables its program reads before launching it.
+ *
+ * The ranks of the context may be split into waves, so that the host does not
+ * sit idle while the DPUs run. Each wave is launched as soon as its input is
+ * copied in, and the input of the next wave is copied in while it runs. The
+ * results of a wave are copied out while the wave after it runs.
+ *
+ * A launch may run any number of files at once. Their blocks are packed into
+ * a batch of jobs, each a range of whole groups of blocks of one file that one
+ * tasklet runs by itself. The DPU programs read the table of jobs from MRAM,
+ * so a tasklet may run the tail of one file and several small files after it.
+ *
+ * The number of DPUs and of tasklets is picked when the context is set up.
+ * NR_DPUS and NR_TASKLETS are only the defaults, and the DPU programs are
+ * built with NR_TASKLETS tasklets, the most a context may run.
+ *
+ * The tasklets of a DPU may instead claim its jobs one at a time from a
+ * shared counter, so a tasklet that finishes early takes more jobs rather
+ * than waiting for the others. The host then only splits the work between
+ * the DPUs, and keeps the jobs small so there are many to claim.
+ */
+
+#ifndef _DPU_CONTEXT_H_
+#define _DPU_CONTEXT_H_
+
+#include <dpu.h>
+#include <stdbool.h>
+
+#include "dpu_snappy.h"
+
+// Most jobs one DPU runs in a launch, must match the one in the DPU programs
+#define MAX_DPU_JOBS 4096
+
+// Length a job grows to when the tasklets claim jobs, enough for MAX_DPU_JOBS
+// jobs to fill the DPU's buffers
+#define DPU_CLAIM_LENGTH KILOBYTE(8)
+
+/**
+ * A range of whole groups of blocks of one file that a tasklet runs on its
+ * own. Must match the one in the DPU programs.
+ */
+struct dpu_job {
+	uint32_t input_offset;	// Offset of the input in the DPU's input_buffer
+	uint32_t input_length;	// Length of the input
+	uint32_t output_offset;	// Offset of the output in the DPU's output_buffer
+	uint32_t output_length;	// Length of the output, written back by the DPU when compressing
+	uint32_t block_size;	// Decompressed size of every block but the last of the file
+	uint32_t flags;			// Format flags of the file
+	uint32_t group_blocks;	// Blocks in each group, 1 if blocks are not chained
+	uint32_t file;			// Index of the file in the batch
+};
+
+/**
+ * Where a job runs, and where its input and output are on the host.
+ */
+struct dpu_job_source {
+	uint32_t dpu;			// DPU running the job
+	uint32_t tasklet;		// Tasklet of the DPU running the job
+	size_t input_start;		// Offset of the input in its file's input buffer
+	size_t output_start;	// Offset of the output in its file's output buffer
+	uint32_t crc_fold;		// Running fold of the job's own block checksums, when the tasklets claim jobs
+};
+
+// Entries of task_jobs in dpu_params, NR_TASKLETS + 1 rounded up so the
+// parameters are a whole number of 8-byte words
+#define DPU_PARAMS_TASK_JOBS (((NR_TASKLETS) + 2) & ~1)
+
+// Entries of the checksum folds the tasklets report, NR_TASKLETS rounded up
+// to a whole number of 8-byte words
+#define DPU_TASKLET_CRCS (((NR_TASKLETS) + 1) & ~1)
+
+/**
+ * Parameters of a launch, written to each DPU in one transfer before every
+ * launch. Must match the one in the DPU programs.
+ */
+struct dpu_params {
+	uint32_t active_tasklets;	// Number of tasklets that run jobs
+	uint32_t claim_jobs;		// Whether the tasklets claim the jobs one at a time
+	uint32_t next_job;			// Next job the tasklets claim, 0 at launch
+	uint32_t dictionary_length;	// Length of the preset dictionary, for the jobs with SNAPPY_FLAG_DICT
+	uint32_t task_jobs[DPU_PARAMS_TASK_JOBS];	// Index in the DPU's jobs of each tasklet's first job, then the number of jobs
+};
+
+/**
+ * The jobs of one launch, packed in order into the tasklets of every DPU.
+ * Each tasklet is given its share of the total work, and a file is only split
+ * where a tasklet has its share, so small files are run whole.
+ *
+ * The work of a group is an estimate of the cycles it takes, from what the
+ * host knows of its blocks. The batch also follows how the groups would have
+ * been split by length alone, to report how much the estimate evens out.
+ *
+ * When the tasklets claim jobs, every job of a DPU is packed into its first
+ * tasklet and run by whichever tasklet takes it. The checksums of each job's
+ * blocks are then folded on their own, and a DPU reports the exclusive or of
+ * the folds of all its jobs, which does not depend on the order they ran in.
+ */
+struct dpu_batch {
+	struct dpu_job *jobs;				// Jobs of every DPU, those of each tasklet in order
+	struct dpu_job_source *sources;		// Where each job runs and its data is
+	uint32_t nr_jobs;					// Number of jobs
+	uint32_t max_jobs;					// Number of jobs allocated
+	uint32_t flags;						// Format flags of any of the jobs
+	uint64_t total_work;				// Work of the whole batch
+	uint64_t packed_work;				// Work packed so far
+	uint64_t total_length;				// Length of the whole batch
+	uint64_t packed_length;				// Length packed so far
+	uint64_t length_task;				// Tasklet the next group would go to if split by length
+	uint32_t output_align;				// Alignment of each job's output in MRAM
+	uint32_t output_slack;				// Room left after each job's output in MRAM
+	uint32_t nr_dpus;					// Number of DPUs the jobs are packed into
+	uint32_t nr_tasklets;				// Number of tasklets of each DPU that run jobs
+	bool claim_jobs;					// The tasklets of each DPU claim its jobs one at a time
+	uint32_t dpu;						// DPU being packed
+	uint32_t tasklet;					// Tasklet being packed
+	uint32_t *first_job;				// Index of each DPU's first job, then the number of jobs
+	struct dpu_params *params;			// Parameters of each DPU's launch, with the index of each tasklet's first job
+	uint32_t *input_length;				// Length of each DPU's input
+	uint32_t *output_length;			// Length of each DPU's output, slack included
+	uint32_t *crc_fold;					// Running fold of the block checksums each tasklet should report, see DPU_BATCH_CRC_FOLD
+	uint64_t *task_work;				// Work of each tasklet, by DPU then tasklet
+	uint64_t *length_task_work;			// Work each tasklet would have if split by length
+	uint32_t *task_offset;				// Offset of each tasklet's output on every DPU, then the end, or NULL, see dpu_batch_align_tasks
+};
+
+// Index of each tasklet's first job of a DPU of a batch, nr_tasklets + 1 entries
+#define DPU_BATCH_TASK_JOBS(batch, dpu) ((batch)->params[(dpu)].task_jobs)
+
+// Number of jobs of a DPU of a finished batch
+#define DPU_BATCH_NR_JOBS(batch, dpu) ((batch)->first_job[(dpu) + 1] - (batch)->first_job[(dpu)])
+
+// Checksum fold a tasklet of a DPU of a batch should report
+#define DPU_BATCH_CRC_FOLD(batch, dpu, tasklet) ((batch)->crc_fold[(dpu) * (batch)->nr_tasklets + (tasklet)])
+
+// Pointer to the checksum fold the blocks of a job of a batch are folded into
+#define DPU_BATCH_JOB_CRC_FOLD(batch, job) ((batch)->claim_jobs ? &(batch)->sources[(job)].crc_fold : \
+	&DPU_BATCH_CRC_FOLD((batch), (batch)->sources[(job)].dpu, (batch)->sources[(job)].tasklet))
+
+struct dpu_context {
+	struct dpu_set_t dpus;	// The allocated DPUs
+	bool allocated;			// Whether dpus is allocated yet
+	bool keep_allocated;	// Keep the DPUs after each job, until dpu_context_free
+	const char *program;	// Path of the program loaded on the DPUs, or NULL
+	uint32_t nr_dpus;		// Number of DPUs allocated
+	uint32_t nr_tasklets;	// Number of tasklets of each DPU that run jobs
+	uint32_t nr_waves;		// Number of waves the ranks are split into
+	bool claim_jobs;		// The tasklets of each DPU claim its jobs one at a time, false by default
+};
+
+/**
+ * Steps of a job that are run on each rank, in the order of the ranks.
+ */
+struct dpu_job_ops {
+	/**
+	 * Copy the input of the DPUs of a rank in.
+	 *
+	 * @param dpu_rank: the rank
+	 * @param dpu_idx: index of the first DPU of the rank
+	 * @param job: the job
+	 */
+	void (*copy_in)(struct dpu_set_t dpu_rank, uint32_t dpu_idx, void *job);
+
+	/**
+	 * Work done on the host while the first wave runs, or NULL.
+	 *
+	 * @param job: the job
+	 */
+	void (*overlap)(void *job);
+
+	/**
+	 * Copy the results of the DPUs of a rank out, once they have finished.
+	 *
+	 * @param dpu_rank: the rank
+	 * @param dpu_idx: index of the first DPU of the rank
+	 * @param job: the job
+	 * @return SNAPPY_OK if the results are good, error code otherwise
+	 */
+	snappy_status (*copy_out)(struct dpu_set_t dpu_rank, uint32_t dpu_idx, void *job);
+};
+
+/**
+ * Set up a context. The DPUs are only allocated when the first job loads
+ * its program. The tasklets run fixed ranges of jobs unless claim_jobs is
+ * set afterwards.
+ *
+ * @param ctx: context to set up
+ * @param nr_dpus: number of DPUs to allocate, 0 for NR_DPUS
+ * @param nr_tasklets: number of tasklets of each DPU that run jobs, 0 for
+ *                     NR_TASKLETS, and at most NR_TASKLETS
+ * @param nr_waves: number of waves the ranks are split into, 1 to run each
+ *                  job's steps one after the other on all the DPUs
+ * @param keep_allocated: keep the DPUs across jobs, otherwise each job frees them
+ */
+void dpu_context_init(struct dpu_context *ctx, uint32_t nr_dpus, uint32_t nr_tasklets, uint32_t nr_waves, bool keep_allocated);
+
+/**
+ * Load a program on the DPUs of a context, allocating them first if needed,
+ * unless it is loaded already.
+ *
+ * @param ctx: context set up by dpu_context_init
+ * @param program: path of the DPU program
+ * @param runtime: d_alloc and load are set to the time spent allocating and
+ *                 loading, 0 if the DPUs were allocated or the program loaded already
+ */
+void dpu_context_load(struct dpu_context *ctx, const char *program, struct program_runtime *runtime);
+
+/**
+ * Copy the input of a job in, run it, and copy its results out, one wave of
+ * ranks at a time. The number of tasklets is written to every DPU before
+ * the job's own input.
+ *
+ * @param ctx: context with the job's program loaded
+ * @param ops: steps of the job
+ * @param job: passed to each step
+ * @param runtime: copy_in is set to the time spent copying in, and run to
+ *                 the time spent waiting for the DPUs to finish. copy_out
+ *                 is left to ops->copy_out.
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+snappy_status dpu_context_run(struct dpu_context *ctx, const struct dpu_job_ops *ops, void *job, struct program_runtime *runtime);
+
+/**
+ * Free the DPUs of a context at the end of a job, unless they are kept
+ * across jobs.
+ *
+ * @param ctx: context set up by dpu_context_init
+ * @param runtime: d_free is set to the time spent freeing, if they are freed
+ */
+void dpu_context_release(struct dpu_context *ctx, struct program_runtime *runtime);
+
+/**
+ * Free the DPUs of a context, if they are allocated.
+ *
+ * @param ctx: context set up by dpu_context_init
+ * @param runtime: d_free is set to the time spent freeing, 0 if they were not allocated
+ */
+void dpu_context_free(struct dpu_context *ctx, struct program_runtime *runtime);
+
+/**
+ * Set up an empty batch.
+ *
+ * @param batch: batch to set up
+ * @param ctx: context the batch will run on, which gives the number of DPUs and tasklets
+ * @param total_length: length of all the groups that will be added
+ * @param total_work: work of all the groups that will be added
+ * @param output_align: alignment of the output of each job in MRAM, the
+ *                      jobs of a new file are always aligned to 8 bytes
+ * @param output_slack: room the DPU may write to after the output of each job
+ */
+void dpu_batch_init(struct dpu_batch *batch, const struct dpu_context *ctx, uint64_t total_length, uint64_t total_work, uint32_t output_align, uint32_t output_slack);
+
+/**
+ * Add a group of blocks to a batch, after the previous one. It goes to the
+ * tasklet being packed unless most of its work is past that tasklet's share
+ * of the total, and then to the next one. A DPU is left early if its buffers
+ * are full.
+ *
+ * @param batch: batch set up by dpu_batch_init
+ * @param group: the group as a job, only the lengths, format and file are used
+ * @param input_start: offset of the group's input in its file's input buffer
+ * @param output_start: offset of the group's output in its file's output buffer
+ * @param length: length of the group, the input when compressing and the
+ *                output when decompressing
+ * @param work: estimated cycles the group takes to run
+ * @return false if the group does not fit in the DPUs
+ */
+bool dpu_batch_add(struct dpu_batch *batch, const struct dpu_job *group, size_t input_start, size_t output_start, uint32_t length, uint32_t work);
+
+/**
+ * Index the jobs of a batch by DPU and tasklet, once every group is added.
+ *
+ * @param batch: batch set up by dpu_batch_init
+ */
+void dpu_batch_finish(struct dpu_batch *batch);
+
+/**
+ * Move the output of each tasklet of a finished batch to the same offset in
+ * MRAM on every DPU, so that the output of one tasklet of all the DPUs of a
+ * rank can be copied out in one transfer. Does nothing when the tasklets
+ * claim jobs, or when the outputs would no longer fit.
+ *
+ * @param batch: finished batch, whose jobs are not yet copied in
+ * @return true if task_offset was set
+ */
+bool dpu_batch_align_tasks(struct dpu_batch *batch);
+
+/**
+ * Print how unevenly the work of a finished batch is spread over the
+ * tasklets, as the ratio of the most work a tasklet has to the mean, both
+ * when split by length and by estimated work.
+ *
+ * @param batch: finished batch
+ */
+void dpu_batch_report(const struct dpu_batch *batch);
+
+/**
+ * Find the input of a DPU on the host. The input of a DPU that only runs
+ * one file is sent from where it is, otherwise its jobs are gathered into a
+ * new buffer.
+ *
+ * @param batch: finished batch
+ * @param dpu: index of the DPU
+ * @param inputs: input of each file
+ * @param length: length that will be sent, at least the DPU's input length
+ * @param gathered[out]: set if a new buffer was returned, for the caller to free
+ * @return Buffer holding the DPU's input, and at least length bytes
+ */
+uint8_t *dpu_batch_input(const struct dpu_batch *batch, uint32_t dpu, const struct host_buffer_context *inputs, uint32_t length, bool *gathered);
+
+/**
+ * Find where to copy the output of a DPU to on the host. The output of a
+ * DPU that only runs one file is copied straight to its place, unless the
+ * length copied would spill over the output of another DPU. Otherwise it
+ * goes to a new buffer, to be scattered with dpu_batch_scatter.
+ *
+ * @param batch: finished batch
+ * @param dpu: index of the DPU
+ * @param outputs: output of each file
+ * @param length: length that will be copied, at least the DPU's output length
+ * @param staged[out]: set if a new buffer was returned
+ * @return Buffer the output goes to, at least length bytes long
+ */
+uint8_t *dpu_batch_output(const struct dpu_batch *batch, uint32_t dpu, struct host_buffer_context *outputs, uint32_t length, bool *staged);
+
+/**
+ * Copy the output of each job of a DPU from a buffer returned by
+ * dpu_batch_output to its place in its file's output, and free the buffer.
+ *
+ * @param batch: finished batch
+ * @param dpu: index of the DPU
+ * @param outputs: output of each file
+ * @param buffer: the DPU's output
+ */
+void dpu_batch_scatter(const struct dpu_batch *batch, uint32_t dpu, struct host_buffer_context *outputs, uint8_t *buffer);
+
+/**
+ * Check the checksum folds reported by the tasklets of a DPU against the
+ * ones the host calculated in crc_fold, or against the folds of its jobs when
+ * the tasklets claim jobs.
+ *
+ * @param batch: finished batch
+ * @param dpu: index of the DPU
+ * @param crcs: fold reported by each tasklet, 0 for tasklets without jobs
+ * @return true if every tasklet reported the fold expected
+ */
+bool dpu_batch_check_crcs(const struct dpu_batch *batch, uint32_t dpu, const uint32_t *crcs);
+
+/**
+ * Free the jobs and tables of a batch.
+ *
+ * @param batch: batch set up by dpu_batch_init
+ */
+void dpu_batch_free(struct dpu_batch *batch);
+
+/**
+ * Copy a buffer of its own length to or from the same symbol of each DPU of
+ * a rank. With BULK_XFER, every DPU is sent the longest length in one
+ * transfer, so each buffer must hold that many bytes. Callers pad the
+ * buffers of a rank to one length, so a rank always takes one transfer.
+ *
+ * @param dpu_rank: the rank
+ * @param direction: DPU_XFER_TO_DPU or DPU_XFER_FROM_DPU
+ * @param symbol: name of the symbol
+ * @param buffers: buffer of each DPU of the rank
+ * @param lengths: length of each DPU's transfer, a multiple of 8 for MRAM, 0 to skip the DPU
+ * @return Number of bytes copied
+ */
+uint64_t dpu_context_xfer(struct dpu_set_t dpu_rank, dpu_xfer_t direction, const char *symbol, uint8_t **buffers, const uint32_t *lengths);
+
+/**
+ * Same as dpu_context_xfer, starting at an offset into the symbol.
+ *
+ * @param dpu_rank: the rank
+ * @param direction: DPU_XFER_TO_DPU or DPU_XFER_FROM_DPU
+ * @param symbol: name of the symbol
+ * @param offset: offset into the symbol, a multiple of 8 for MRAM
+ * @param buffers: buffer of each DPU of the rank
+ * @param lengths: length of each DPU's transfer, a multiple of 8 for MRAM, 0 to skip the DPU
+ * @return Number of bytes copied
+ */
+uint64_t dpu_context_xfer_at(struct dpu_set_t dpu_rank, dpu_xfer_t direction, const char *symbol, uint32_t offset, uint8_t **buffers, const uint32_t *lengths);
+
+#endif	/* _DPU_CONTEXT_H_ */
@@ -4,12 +4,45 @@
 #include <string.h>
 #include <limits.h>
 #include <getopt.h>
+#include <pthread.h>
 
 #include "dpu_snappy.h"
 #include "snappy_compress.h"
 #include "snappy_decompress.h"
+#include "crc32c.h"
 
-const char options[]="dcb:i:o:";
+const char options[]="dcvksexpqa:b:g:i:l:m:n:o:r:t:w:D:";
+
+// Length of the chunks read and written when streaming
+#define STREAM_CHUNK_LENGTH (64 * 1024)
+
+// Most input (or output, when decompressing) packed into one launch for each
+// DPU, leaving room in the DPU buffers for files that do not split evenly
+#define BATCH_DPU_LENGTH (MAX_FILE_LENGTH / 2)
+
+// Most files packed into one launch for each DPU, leaving room in the job
+// tables for files that are split between tasklets
+#define BATCH_DPU_FILES (MAX_DPU_JOBS / 2)
+
+/**
+ * What to do with each input file, as given on the command line.
+ */
+struct run_config {
+	int use_dpu;				// Use the DPUs instead of the host
+	int compress;				// Compress, decompress otherwise
+	int validate;				// Validate the compressed input first
+	int estimate;				// Only estimate the compression ratio
+	int auto_block_size;		// Choose the block size by sampling the input
+	int pack;					// Pack many files into each launch of the DPUs
+	int claim_jobs;				// The DPU tasklets claim jobs one at a time
+	unsigned long dpu_length;	// Most input or output of a file each DPU takes in one launch
+	double min_ratio;			// Smallest ratio accepted when choosing the block size
+	uint32_t nr_threads;		// Number of host threads
+	uint32_t nr_dpus;			// Number of DPUs allocated
+	uint32_t nr_tasklets;		// Number of tasklets of each DPU that run jobs
+	uint32_t nr_waves;			// Number of waves the DPU ranks are split into
+	struct compress_options opts;	// Compression options
+};
 
 /**
  * Read the contents of a file into an in-memory buffer. Upon success,
@@ -49,6 +82,30 @@ static int read_input_host(char *in_file, struct host_buffer_context *input)
    return (n != input->length);
 }
 
+/**
+ * Read a preset dictionary from a file and compute its ID.
+ *
+ * @param dict_file: dictionary file name
+ * @param dict_buffer: holds the dictionary's buffer information
+ * @param dict[out]: the dictionary
+ * @return 1 if the file could not be read or is empty or too long, 0 otherwise
+ */
+static int read_dictionary(char *dict_file, struct host_buffer_context *dict_buffer, struct snappy_dictionary *dict)
+{
+	dict_buffer->max = SNAPPY_MAX_DICT_LENGTH;
+	if (read_input_host(dict_file, dict_buffer))
+		return 1;
+	if (dict_buffer->length == 0) {
+		fprintf(stderr, "Empty dictionary: %s\n", dict_file);
+		return 1;
+	}
+
+	dict->data = dict_buffer->buffer;
+	dict->length = dict_buffer->length;
+	dict->id = crc32c_mask(crc32c_host(CRC32C_INIT, dict->data, dict->length));
+	return 0;
+}
+
 /**
  * Write the contents of the output buffer to a file.
  *
@@ -62,6 +119,113 @@ static void write_output_host(char *out_file, struct host_buffer_context *output
 	fclose(fout);
 }
 
+/**
+ * Compress or decompress a file one chunk at a time with the streaming API,
+ * so memory use stays at a few blocks whatever the length of the file.
+ *
+ * @param in_file: input file name, or NULL to read stdin
+ * @param out_file: output file name, or NULL to write stdout
+ * @param compress: compress if set, decompress otherwise
+ * @param opts: compression options, opts->dict is also used to decompress
+ * @return 0 if successful, -1 otherwise
+ */
+static int stream_host(const char *in_file, const char *out_file, int compress, const struct compress_options *opts)
+{
+	FILE *fin = (in_file != NULL) ? fopen(in_file, "r") : stdin;
+	if (fin == NULL) {
+		fprintf(stderr, "Invalid input file: %s\n", in_file);
+		return -1;
+	}
+	FILE *fout = (out_file != NULL) ? fopen(out_file, "w") : stdout;
+	if (fout == NULL) {
+		fprintf(stderr, "Invalid output file: %s\n", out_file);
+		return -1;
+	}
+
+	struct snappy_compress_stream *cstream = NULL;
+	struct snappy_decompress_stream *dstream = NULL;
+	if (compress)
+		cstream = snappy_compress_stream_init(opts);
+	else
+		dstream = snappy_decompress_stream_init(opts->dict);
+	if ((cstream == NULL) && (dstream == NULL)) {
+		fprintf(stderr, "Invalid block size %u\n", opts->block_size);
+		return -1;
+	}
+
+	uint8_t *in = malloc(STREAM_CHUNK_LENGTH);
+	uint8_t *out = malloc(STREAM_CHUNK_LENGTH);
+	size_t in_total = 0;
+	size_t out_total = 0;
+	snappy_status status = SNAPPY_OK;
+
+	struct timeval start;
+	struct timeval end;
+	gettimeofday(&start, NULL);
+
+	size_t n;
+	while ((status == SNAPPY_OK) && ((n = fread(in, 1, STREAM_CHUNK_LENGTH, fin)) > 0)) {
+		in_total += n;
+		for (size_t offset = 0; (status == SNAPPY_OK) && (offset < n);) {
+			size_t consumed;
+			size_t produced;
+			if (compress)
+				status = snappy_compress_stream_feed(cstream, in + offset, n - offset, &consumed, out, STREAM_CHUNK_LENGTH, &produced);
+			else
+				status = snappy_decompress_stream_feed(dstream, in + offset, n - offset, &consumed, out, STREAM_CHUNK_LENGTH, &produced);
+
+			if ((consumed == 0) && (produced == 0) && (status == SNAPPY_OK)) {
+				fprintf(stderr, "Unexpected data after the end of the compressed stream\n");
+				status = SNAPPY_INVALID_INPUT;
+			}
+			if (fwrite(out, 1, produced, fout) != produced)
+				status = SNAPPY_BUFFER_TOO_SMALL;
+			out_total += produced;
+			offset += consumed;
+		}
+	}
+	if (ferror(fin))
+		status = SNAPPY_INVALID_INPUT;
+
+	// Hand out the last block and check that the stream is complete
+	if (status == SNAPPY_OK) {
+		do {
+			size_t produced;
+			if (compress)
+				status = snappy_compress_stream_finish(cstream, out, STREAM_CHUNK_LENGTH, &produced);
+			else
+				status = snappy_decompress_stream_finish(dstream, out, STREAM_CHUNK_LENGTH, &produced);
+
+			if (fwrite(out, 1, produced, fout) != produced) {
+				status = SNAPPY_BUFFER_TOO_SMALL;
+				break;
+			}
+			out_total += produced;
+		} while (status == SNAPPY_BUFFER_TOO_SMALL);
+	}
+
+	gettimeofday(&end, NULL);
+
+	if (fin != stdin)
+		fclose(fin);
+	if ((fout != stdout) ? fclose(fout) : fflush(fout))
+		status = SNAPPY_BUFFER_TOO_SMALL;
+	snappy_compress_stream_free(cstream);
+	snappy_decompress_stream_free(dstream);
+	free(in);
+	free(out);
+
+	if (status != SNAPPY_OK) {
+		fprintf(stderr, "Encountered Snappy error %u\n", status);
+		return -1;
+	}
+
+	// The output may be stdout, so report on stderr
+	fprintf(stderr, "%s %zu bytes to %zu bytes\n", compress ? "Compressed" : "Decompressed", in_total, out_total);
+	fprintf(stderr, "Stream time: %f\n", get_runtime(&start, &end));
+	return 0;
+}
+
 /**
  * Print out application usage.
  *
@@ -73,12 +237,45 @@ static void usage(const char *exe_name)
 	fprintf(stderr, "**DEBUG BUILD**\n");
 #endif //DEBUG
 	fprintf(stderr, "Compress or decompress a file with Snappy\nCan use either the host CPU or UPMEM DPU\n");
-	fprintf(stderr, "usage: %s [-d] [-c] [-b <block_size>] -i <input_file> [-o <output_file>]\n", exe_name);
+	fprintf(stderr, "usage: %s [-d] [-c] [-v] [-k] [-s] [-e] [-x] [-p] [-q] [-b <block_size>|auto] [-g <group_blocks>] [-l <level>] [-m <bytes>] [-r <min_ratio>] [-t <threads>] [-n <dpus>] [-a <tasklets>] [-w <waves>] [-D <dict_file>] [-i <input_file>] [-o <output_file>] [<input_file>...]\n", exe_name);
 	fprintf(stderr, "d: use DPU, by default host is used\n");
 	fprintf(stderr, "c: perform compression, by default performs decompression\n");
-	fprintf(stderr, "b: block size used for compression, default is 32KB, ignored for decompression\n");
-	fprintf(stderr, "i: input file\n");
+	fprintf(stderr, "v: validate the compressed input and report its length without decompressing it,\n"
+			"   with -d the DPU work is then partitioned using the validated block lengths\n");
+	fprintf(stderr, "k: store a CRC32C checksum of each block when compressing, checksums are always verified\n"
+			"   when decompressing if the input has them\n");
+	fprintf(stderr, "s: compress or decompress one block at a time on host, reading stdin and writing stdout\n"
+			"   unless -i or -o are given\n");
+	fprintf(stderr, "e: estimate how well the input compresses with the block size from samples of it, without\n"
+			"   compressing it\n");
+	fprintf(stderr, "x: store blocks predicted not to compress raw without compressing them, with -d an input\n"
+			"   predicted not to compress is stored raw on host without using the DPUs\n");
+	fprintf(stderr, "p: with -d and a list of input files, pack as many files as fit into each launch of the DPUs\n"
+			"   instead of launching them once per file\n");
+	fprintf(stderr, "q: with -d, the tasklets of each DPU claim small jobs one at a time from a shared counter\n"
+			"   instead of each running a fixed range of blocks\n");
+	fprintf(stderr, "b: block size used for compression, default is 32KB, ignored for decompression,\n"
+			"   auto picks one by sampling the input\n");
+	fprintf(stderr, "g: chain blocks in groups of this many blocks when compressing, so each block may refer back\n"
+			"   into the previous block of its group\n");
+	fprintf(stderr, "l: compression level from %d (fastest, default) to %d (smallest output), used for host compression\n",
+			SNAPPY_MIN_LEVEL, SNAPPY_MAX_LEVEL);
+	fprintf(stderr, "r: smallest compression ratio accepted by -b auto, default is 90%% of the best predicted ratio\n");
+	fprintf(stderr, "t: number of host threads used for compression, decompression and validation, default is 1\n");
+	fprintf(stderr, "n: number of DPUs used with -d, default is %d\n", NR_DPUS);
+	fprintf(stderr, "a: number of tasklets of each DPU used with -d, from 1 to %d (default), the DPU programs\n"
+			"   are built with that many\n", NR_TASKLETS);
+	fprintf(stderr, "m: most input (or output, when decompressing) of a file each DPU takes with -d, default\n"
+			"   and largest is %uMB, longer files are run in rounds of half as much\n", MAX_FILE_LENGTH >> 20);
+	fprintf(stderr, "w: number of waves the DPU ranks are split into, so the copies to and from one wave overlap\n"
+			"   the run of another, default is 1\n");
+	fprintf(stderr, "D: preset dictionary that blocks may refer back into, needed again to decompress,\n"
+			"   compression with a dictionary is only supported on host\n");
+	fprintf(stderr, "i: input file, required unless streaming or given a list of input files\n");
 	fprintf(stderr, "o: output file\n");
+	fprintf(stderr, "A list of input files is run one file after the other, with -d on DPUs that are allocated\n"
+			"and loaded once. Each output is written next to its input, with .snappy appended when\n"
+			"compressing or .out appended when decompressing\n");
 }
 
 /**
@@ -90,85 +287,614 @@ double get_runtime(struct timeval *start, struct timeval *end) {
 	return (end_time - start_time);
 }
 
-int main(int argc, char **argv)
+int run_host_threads(uint32_t nr_threads, void *(*fn)(void *), void *args, size_t arg_size)
 {
-	int opt;
-	snappy_status status;
-	
-	int use_dpu = 0;
-	int compress = 0;
-	int block_size = 32 * 1024; // Default is 32KB
-	char *input_file = NULL;
-	char *output_file = NULL;
-	struct host_buffer_context input;
-	struct host_buffer_context output;
+	pthread_t *threads = malloc(sizeof(pthread_t) * nr_threads);
+	uint8_t *arg = args;
+	int ret = 0;
 
-	input.buffer = NULL;
-	input.length = 0;
-	input.max = ULONG_MAX;
+	uint32_t created;
+	for (created = 1; created < nr_threads; created++) {
+		if (pthread_create(&threads[created], NULL, fn, arg + created * arg_size)) {
+			ret = -1;
+			break;
+		}
+	}
 
-	output.buffer = NULL;
-	output.length = 0;
-	output.max = ULONG_MAX;
+	fn(arg);
 
-	while ((opt = getopt(argc, argv, options)) != -1)
-	{
-		switch(opt)
-		{
-		case 'd':
-			use_dpu = 1;
-			input.max = NR_DPUS * (unsigned long)MAX_FILE_LENGTH;
-			output.max = NR_DPUS * (unsigned long)MAX_FILE_LENGTH;
-			break;
+	for (uint32_t i = 1; i < created; i++)
+		pthread_join(threads[i], NULL);
 
-		case 'c':
-			compress = 1;
-			break;
-		
-		case 'b':
-			block_size = atoi(optarg);
-			break;
+	free(threads);
+	return ret;
+}
 
-		case 'i':
-			input_file = optarg;
-			break;
+/**
+ * Print the rates the copies to and from the DPUs reached, and how they
+ * compare to the peak rates.
+ *
+ * @param runtime: time spent on each part, and bytes copied
+ */
+static void print_copy_rates(const struct program_runtime *runtime)
+{
+	if ((runtime->copy_in_bytes != 0) && (runtime->copy_in > 0)) {
+		double rate = runtime->copy_in_bytes / runtime->copy_in / 1e9;
+		printf("Copy in rate: %f GB/s, %f%% of peak\n", rate, 100 * rate / DPU_COPY_IN_PEAK);
+	}
+	if ((runtime->copy_out_bytes != 0) && (runtime->copy_out > 0)) {
+		double rate = runtime->copy_out_bytes / runtime->copy_out / 1e9;
+		printf("Copy out rate: %f GB/s, %f%% of peak\n", rate, 100 * rate / DPU_COPY_OUT_PEAK);
+	}
+}
 
-		case 'o':
-			output_file = optarg;
+/**
+ * Reads the input of the next round of a file too long for the DPUs on a
+ * thread of its own, while the DPUs run the current round.
+ */
+struct round_reader {
+	pthread_t thread;
+	FILE *file;
+	uint8_t *buffer;	// Where the input is read to
+	size_t length;		// Bytes to read
+	size_t read;		// Bytes that were read
+	bool running;		// The thread was started and not joined yet
+};
+
+static void *read_round_fn(void *arg)
+{
+	struct round_reader *reader = arg;
+	reader->read = fread(reader->buffer, 1, reader->length, reader->file);
+	return NULL;
+}
+
+/**
+ * Start reading the input of the next round, on the calling thread if
+ * another one cannot be started.
+ *
+ * @param reader: reader of the file
+ * @param buffer: where the input is read to
+ * @param length: bytes to read
+ */
+static void start_round_read(struct round_reader *reader, uint8_t *buffer, size_t length)
+{
+	reader->buffer = buffer;
+	reader->length = length;
+	reader->read = 0;
+	reader->running = (length != 0) && (pthread_create(&reader->thread, NULL, read_round_fn, reader) == 0);
+	if (!reader->running)
+		read_round_fn(reader);
+}
+
+/**
+ * Wait for the input of the next round to be read.
+ *
+ * @param reader: reader of the file
+ * @return Bytes that were read
+ */
+static size_t wait_round_read(struct round_reader *reader)
+{
+	if (reader->running)
+		pthread_join(reader->thread, NULL);
+	reader->running = false;
+	return reader->read;
+}
+
+/**
+ * Add the time spent on each part of one round to the total of a file.
+ *
+ * @param total: time spent on each part of the file
+ * @param round: time spent on each part of the round
+ */
+static void add_runtime(struct program_runtime *total, const struct program_runtime *round)
+{
+	total->pre += round->pre;
+	total->d_alloc += round->d_alloc;
+	total->load += round->load;
+	total->copy_in += round->copy_in;
+	total->run += round->run;
+	total->copy_out += round->copy_out;
+	total->copy_in_bytes += round->copy_in_bytes;
+	total->copy_out_bytes += round->copy_out_bytes;
+}
+
+/**
+ * Check whether a file is longer than the DPUs take in one launch, or
+ * decompresses to more than that, so that it has to be run in rounds.
+ *
+ * @param input_file: input file name
+ * @param cfg: what to do with the file, as given on the command line
+ * @param max: most input or output the DPUs take in one launch
+ * @return True if the file has to be run in rounds
+ */
+static bool needs_rounds(const char *input_file, const struct run_config *cfg, unsigned long max)
+{
+	FILE *fin = fopen(input_file, "r");
+	if (fin == NULL)
+		return false;
+
+	fseek(fin, 0, SEEK_END);
+	unsigned long length = ftell(fin);
+	fseek(fin, 0, SEEK_SET);
+
+	// Read the decompressed length from the header, the longest header fits
+	// in the buffer and the zeros after a shorter file end its varints
+	uint8_t header[32] = {0};
+	bool too_long = (length > max);
+	if (!too_long && !cfg->compress && (fread(header, 1, sizeof(header), fin) != 0)) {
+		struct host_buffer_context input = {
+			.buffer = header,
+			.curr = header,
+			.length = sizeof(header),
+			.max = sizeof(header)
+		};
+		struct snappy_stream_format format;
+		too_long = (snappy_read_stream_format(&input, cfg->opts.dict, &format) == SNAPPY_OK) && (format.dlength > max);
+	}
+
+	fclose(fin);
+	return too_long;
+}
+
+/**
+ * Compress one round on the DPUs. A round that does not fit in them is
+ * compressed in two halves of whole groups of blocks instead.
+ *
+ * @param input: holds the buffer information of the round
+ * @param output: holds output buffer information, the blocks are appended
+ * @param opts: compression options
+ * @param group_length: input length of each group of blocks
+ * @param ctx: DPUs kept allocated across rounds
+ * @param total[out]: time spent on each part is added to it
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status compress_round(struct host_buffer_context *input, struct host_buffer_context *output, const struct compress_options *opts,
+									size_t group_length, struct dpu_context *ctx, struct program_runtime *total)
+{
+	uint8_t *output_start = output->curr;
+	struct program_runtime runtime = {0};
+	snappy_status status = snappy_compress_dpu_blocks(input, output, opts, ctx, &runtime);
+	add_runtime(total, &runtime);
+	if ((status != SNAPPY_BUFFER_TOO_SMALL) || (input->length <= group_length))
+		return status;
+
+	output->curr = output_start;
+	struct host_buffer_context half = *input;
+	half.length = (input->length / group_length / 2) * group_length;
+	if (half.length == 0)
+		half.length = group_length;
+	status = compress_round(&half, output, opts, group_length, ctx, total);
+	if (status == SNAPPY_OK) {
+		half.buffer += half.length;
+		half.curr = half.buffer;
+		half.length = input->length - half.length;
+		status = compress_round(&half, output, opts, group_length, ctx, total);
+	}
+	return status;
+}
+
+/**
+ * Decompress one round on the DPUs. A round that does not fit in them is
+ * decompressed in two halves of whole groups of blocks instead.
+ *
+ * @param format: format of the stream
+ * @param blocks: the blocks of the round
+ * @param length: compressed length of the round
+ * @param first_block: index of the first block of the round in the stream
+ * @param dlength: decompressed length of the round
+ * @param out: where the round is decompressed to
+ * @param dict: preset dictionary, or NULL if there is none
+ * @param ctx: DPUs kept allocated across rounds
+ * @param total[out]: time spent on each part is added to it
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status decompress_round(const struct snappy_stream_format *format, uint8_t *blocks, size_t length, uint32_t first_block, uint32_t dlength,
+									  uint8_t *out, const struct snappy_dictionary *dict, struct dpu_context *ctx, struct program_runtime *total)
+{
+	struct host_buffer_context input = {
+		.buffer = blocks,
+		.curr = blocks,
+		.length = length,
+		.max = length
+	};
+	struct host_buffer_context output = {
+		.buffer = out,
+		.curr = out,
+		.length = dlength,
+		.max = dlength
+	};
+	struct program_runtime runtime = {0};
+	snappy_status status = snappy_decompress_dpu_blocks(&input, &output, format, dict, ctx, &runtime);
+	add_runtime(total, &runtime);
+	if (status != SNAPPY_BUFFER_TOO_SMALL)
+		return status;
+
+	uint32_t nr_blocks;
+	uint32_t half_dlength;
+	size_t half = snappy_next_dpu_round(format, blocks, length, first_block, dlength / 2, &nr_blocks, &half_dlength);
+	if ((half == 0) || (half == length))
+		return status;
+
+	status = decompress_round(format, blocks, half, first_block, half_dlength, out, dict, ctx, total);
+	if (status == SNAPPY_OK)
+		status = decompress_round(format, blocks + half, length - half, first_block + nr_blocks, dlength - half_dlength, out + half_dlength, dict, ctx, total);
+	return status;
+}
+
+/**
+ * Compress a file in rounds of whole groups of blocks, which together are
+ * the same stream as the file compressed at once.
+ *
+ * @param reader: reader of the input file, just after the first round was read
+ * @param fout: output file
+ * @param length: length of the input file
+ * @param buffers: two buffers of round_length bytes, the first holding the first round
+ * @param round_length: most input of a round
+ * @param cfg: what to do with the file, as given on the command line
+ * @param ctx: DPUs kept allocated across rounds
+ * @param runtime[out]: time spent on each part
+ * @param nr_rounds[out]: number of rounds
+ * @param out_length[out]: length of the output
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status compress_rounds(struct round_reader *reader, FILE *fout, size_t length, uint8_t **buffers, size_t round_length, const struct run_config *cfg,
+									 struct dpu_context *ctx, struct program_runtime *runtime, uint32_t *nr_rounds, size_t *out_length)
+{
+	const struct compress_options *opts = &cfg->opts;
+	size_t group_length = (size_t)opts->block_size * ((opts->flags & SNAPPY_FLAG_CHAINED) ? opts->group_blocks : 1);
+	if (length > UINT32_MAX) {
+		fprintf(stderr, "Input is too long for the stream header (%zu > %u)\n", length, UINT32_MAX);
+		return SNAPPY_INVALID_INPUT;
+	}
+
+	struct host_buffer_context input = {
+		.buffer = buffers[0],
+		.curr = buffers[0],
+		.length = reader->read,
+		.max = round_length
+	};
+	struct host_buffer_context output;
+	struct program_runtime setup = {0};
+	setup_compression(&input, &output, opts, &setup);
+	add_runtime(runtime, &setup);
+	snappy_compress_header(&output, length, opts);
+
+	snappy_status status = SNAPPY_OK;
+	size_t offset = 0;
+	uint32_t cur = 0;
+	while ((status == SNAPPY_OK) && (offset < length)) {
+		if (input.length != MIN(length - offset, round_length)) {
+			fprintf(stderr, "Failed to read round %u of the input\n", *nr_rounds);
+			status = SNAPPY_INVALID_INPUT;
 			break;
+		}
 
-		default:
-			usage(argv[0]);
-			return -2;
+		// Read the next round while this one runs and is written out
+		size_t next_offset = offset + input.length;
+		start_round_read(reader, buffers[!cur], MIN(length - next_offset, round_length));
+
+		status = compress_round(&input, &output, opts, group_length, ctx, runtime);
+		if ((status == SNAPPY_OK) && (fwrite(output.buffer, 1, output.length, fout) != output.length))
+			status = SNAPPY_BUFFER_TOO_SMALL;
+		printf("Round %u: compressed %zu bytes to %ld\n", *nr_rounds, input.length, output.length);
+		*out_length += output.length;
+		(*nr_rounds)++;
+
+		output.curr = output.buffer;
+		output.length = 0;
+		offset = next_offset;
+		cur = !cur;
+		input.buffer = buffers[cur];
+		input.curr = input.buffer;
+		input.length = wait_round_read(reader);
+	}
+
+	free(output.buffer);
+	return status;
+}
+
+/**
+ * Decompress a file in rounds of whole groups of blocks. The blocks of a
+ * group that was only partly read are carried over to the next round.
+ *
+ * @param reader: reader of the input file, just after the first round was read
+ * @param fout: output file
+ * @param length: length of the input file
+ * @param buffers: two buffers of round_length bytes, the first holding the first round
+ * @param round_length: most input and output of a round
+ * @param cfg: what to do with the file, as given on the command line
+ * @param ctx: DPUs kept allocated across rounds
+ * @param runtime[out]: time spent on each part
+ * @param nr_rounds[out]: number of rounds
+ * @param out_length[out]: length of the output
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status decompress_rounds(struct round_reader *reader, FILE *fout, size_t length, uint8_t **buffers, size_t round_length, const struct run_config *cfg,
+									   struct dpu_context *ctx, struct program_runtime *runtime, uint32_t *nr_rounds, size_t *out_length)
+{
+	struct host_buffer_context input = {
+		.buffer = buffers[0],
+		.curr = buffers[0],
+		.length = reader->read,
+		.max = round_length
+	};
+	struct snappy_stream_format format;
+	snappy_status status = snappy_read_stream_format(&input, cfg->opts.dict, &format);
+	if (status != SNAPPY_OK)
+		return status;
+	if (format.flags & SNAPPY_FLAG_STREAM) {
+		fprintf(stderr, "A stream without its length in the header cannot be run in rounds, decompress it with -s\n");
+		return SNAPPY_INVALID_INPUT;
+	}
+
+	uint8_t *out = malloc(ALIGN_LONG(round_length, 8) + sizeof(uint64_t));
+	uint32_t num_blocks = (format.dlength + format.dblock_size - 1) / format.dblock_size;
+	uint32_t block = 0;
+	size_t offset = input.length;	// Bytes of the file read so far
+	size_t start = input.curr - input.buffer;
+	size_t filled = input.length;
+	uint32_t cur = 0;
+	while ((status == SNAPPY_OK) && (block < num_blocks)) {
+		uint8_t *blocks = buffers[cur] + start;
+		uint32_t nr_blocks;
+		uint32_t dlength;
+		size_t used = snappy_next_dpu_round(&format, blocks, filled - start, block, round_length, &nr_blocks, &dlength);
+		if (used == 0) {
+			if (offset == length)
+				fprintf(stderr, "The input ends in the middle of block %u\n", block);
+			else
+				fprintf(stderr, "A group of blocks does not fit in a round of %zu bytes\n", round_length);
+			status = SNAPPY_INVALID_INPUT;
+			break;
 		}
+
+		// Carry the blocks that were read past the round over to the next
+		// one, and read the rest of it while this one runs and is written out
+		size_t carry = filled - start - used;
+		memcpy(buffers[!cur], blocks + used, carry);
+		start_round_read(reader, buffers[!cur] + carry, MIN(length - offset, round_length - carry));
+
+		status = decompress_round(&format, blocks, used, block, dlength, out, cfg->opts.dict, ctx, runtime);
+		if ((status == SNAPPY_OK) && (fwrite(out, 1, dlength, fout) != dlength))
+			status = SNAPPY_BUFFER_TOO_SMALL;
+		printf("Round %u: decompressed %zu bytes to %u\n", *nr_rounds, used, dlength);
+		*out_length += dlength;
+		(*nr_rounds)++;
+
+		block += nr_blocks;
+		cur = !cur;
+		start = 0;
+		filled = carry + wait_round_read(reader);
+		offset += filled - carry;
 	}
 
-	if (!input_file)
-	{
-		usage(argv[0]);
+	free(out);
+	return status;
+}
+
+/**
+ * Compress or decompress a file too long for the DPUs in rounds that each
+ * fit in them, with the DPUs allocated and loaded once for all the rounds.
+ * The input of the next round is read while the DPUs run the current one,
+ * and the output of each round is written out as soon as it is done, so
+ * memory use stays at two rounds of input and one of output.
+ *
+ * @param input_file: input file name
+ * @param output_file: output file name
+ * @param cfg: what to do with the file, as given on the command line
+ * @param ctx: DPUs kept allocated across files
+ * @param runtime[out]: time spent on each part
+ * @return 0 if successful, -1 otherwise
+ */
+static int run_rounds(char *input_file, char *output_file, const struct run_config *cfg, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	FILE *fin = fopen(input_file, "r");
+	if (fin == NULL) {
+		fprintf(stderr, "Invalid input file: %s\n", input_file);
+		return -1;
+	}
+	FILE *fout = fopen(output_file, "w");
+	if (fout == NULL) {
+		fprintf(stderr, "Invalid output file: %s\n", output_file);
+		fclose(fin);
 		return -1;
 	}
-	input.file_name = input_file;
-	printf("Using input file %s\n", input_file);
 
-	// If no output file was provided, use a default file
-	if (output_file == NULL) {
-		output_file = "output.txt";
+	fseek(fin, 0, SEEK_END);
+	size_t length = ftell(fin);
+	fseek(fin, 0, SEEK_SET);
+
+	// Each DPU takes half of what it could, leaving room for rounds that do not split evenly
+	size_t round_length = ctx->nr_dpus * (cfg->dpu_length / 2);
+	if (cfg->compress) {
+		size_t group_length = (size_t)cfg->opts.block_size * ((cfg->opts.flags & SNAPPY_FLAG_CHAINED) ? cfg->opts.group_blocks : 1);
+		round_length -= round_length % group_length;
+		if (cfg->auto_block_size)
+			fprintf(stderr, "Cannot choose a block size for a file run in rounds, using %u\n", cfg->opts.block_size);
+	}
+	printf("Running %zu bytes in rounds of at most %zu bytes\n", length, round_length);
+
+	// Room is left after each buffer for the padding of the copies to the DPUs
+	uint8_t *buffers[2];
+	buffers[0] = malloc(ALIGN_LONG(round_length, 8) + sizeof(uint64_t));
+	buffers[1] = malloc(ALIGN_LONG(round_length, 8) + sizeof(uint64_t));
+	struct round_reader reader = {
+		.file = fin,
+		.running = false
+	};
+	start_round_read(&reader, buffers[0], MIN(length, round_length));
+	wait_round_read(&reader);
+
+	// The DPUs stay allocated and loaded from one round to the next
+	bool keep_allocated = ctx->keep_allocated;
+	ctx->keep_allocated = true;
+
+	struct timeval start;
+	struct timeval end;
+	gettimeofday(&start, NULL);
+
+	snappy_status status;
+	uint32_t nr_rounds = 0;
+	size_t out_length = 0;
+	if ((round_length == 0) || (round_length > UINT32_MAX)) {
+		fprintf(stderr, "Invalid round length %zu\n", round_length);
+		status = SNAPPY_INVALID_INPUT;
+	}
+	else if (cfg->compress)
+		status = compress_rounds(&reader, fout, length, buffers, round_length, cfg, ctx, runtime, &nr_rounds, &out_length);
+	else
+		status = decompress_rounds(&reader, fout, length, buffers, round_length, cfg, ctx, runtime, &nr_rounds, &out_length);
+	wait_round_read(&reader);
+
+	gettimeofday(&end, NULL);
+
+	ctx->keep_allocated = keep_allocated;
+	dpu_context_release(ctx, runtime);
+
+	fclose(fin);
+	fclose(fout);
+	free(buffers[0]);
+	free(buffers[1]);
+
+	if (status != SNAPPY_OK) {
+		fprintf(stderr, "Encountered Snappy error %u\n", status);
+		return -1;
 	}
+
+	if (cfg->compress) {
+		printf("Compressed %zu bytes to: %s\n", out_length, output_file);
+		printf("Compression ratio: %f\n", 1 - (double)out_length / (double)length);
+	}
+	else {
+		printf("Decompressed %zu bytes to: %s\n", out_length, output_file);
+		printf("Compression ratio: %f\n", 1 - (double)length / (double)out_length);
+	}
+
+	printf("Rounds: %u\n", nr_rounds);
+	printf("Pre-processing time: %f\n", runtime->pre);
+	printf("Alloc time: %f\n", runtime->d_alloc);
+	printf("Load time: %f\n", runtime->load);
+	printf("Copy in time: %f\n", runtime->copy_in);
+	printf("Host time: %f\n", runtime->run);
+	printf("Copy out time: %f\n", runtime->copy_out);
+	printf("Free time: %f\n", runtime->d_free);
+	printf("Total time: %f\n", get_runtime(&start, &end));
+	print_copy_rates(runtime);
+	return 0;
+}
+
+/**
+ * Compress, decompress, validate or estimate one file, and print the time
+ * spent on each part.
+ *
+ * @param input_file: input file name
+ * @param output_file: output file name
+ * @param cfg: what to do with the file, as given on the command line
+ * @param ctx: DPUs kept allocated across files, or NULL to allocate them for this file only
+ * @param runtime[out]: time spent on each part
+ * @return 0 if successful, -1 otherwise
+ */
+static int run_file(char *input_file, char *output_file, const struct run_config *cfg, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	snappy_status status;
+	struct compress_options opts = cfg->opts;
+	struct host_buffer_context input;
+	struct host_buffer_context output;
+
+	input.buffer = NULL;
+	input.length = 0;
+	input.max = cfg->use_dpu ? (cfg->nr_dpus * cfg->dpu_length) : ULONG_MAX;
+
+	output.buffer = NULL;
+	output.length = 0;
+	output.max = input.max;
+
+	input.file_name = input_file;
+	printf("Using input file %s\n", input_file);
 	output.file_name = output_file;
 	printf("Using output file %s\n", output_file);
 
+	// A file too long for the DPUs is run in rounds, without ever being all in main memory
+	if (cfg->use_dpu && !cfg->validate && !cfg->estimate && needs_rounds(input_file, cfg, input.max))
+		return run_rounds(input_file, output_file, cfg, ctx, runtime);
+
 	// Read the input file into main memory
 	if (read_input_host(input_file, &input))
 		return -1;
 
-	struct program_runtime runtime;
-	if (compress) {
-		setup_compression(&input, &output, &runtime);
+	// Check the compressed input and find its block lengths without decompressing it
+	uint32_t *block_lengths = NULL;
+	if (cfg->validate && !cfg->compress) {
+		struct timeval start;
+		struct timeval end;
+		uint32_t num_blocks;
+		uint32_t type_blocks[NR_BLOCK_TYPES];
+		uint32_t dlength;
+
+		gettimeofday(&start, NULL);
+		status = snappy_validate_host(&input, cfg->nr_threads, opts.dict, &block_lengths, &num_blocks, type_blocks, &dlength);
+		gettimeofday(&end, NULL);
 
-		if (use_dpu)
+		if (status != SNAPPY_OK) {
+			fprintf(stderr, "Encountered Snappy error %u\n", status);
+			free(input.buffer);
+			return -1;
+		}
+
+		printf("Validated %u blocks, decompressed length %u\n", num_blocks, dlength);
+		printf("Block types: %u snappy, %u raw, %u run\n", type_blocks[BLOCK_TYPE_SNAPPY], type_blocks[BLOCK_TYPE_RAW], type_blocks[BLOCK_TYPE_RUN]);
+#ifdef DEBUG
+		for (uint32_t i = 0; i < num_blocks; i++)
+			printf("Block %u: %u bytes\n", i, block_lengths[i]);
+#endif
+		printf("Validation time: %f\n", get_runtime(&start, &end));
+
+		if (!cfg->use_dpu) {
+			free(block_lengths);
+			free(input.buffer);
+			return 0;
+		}
+	}
+
+	double predicted_ratio = 0;
+	if (cfg->compress && cfg->auto_block_size) {
+		struct timeval start;
+		struct timeval end;
+		uint32_t nr_units = cfg->use_dpu ? (cfg->nr_dpus * cfg->nr_tasklets) : cfg->nr_threads;
+
+		gettimeofday(&start, NULL);
+		opts.block_size = snappy_choose_block_size(&input, &opts, nr_units, cfg->min_ratio, &predicted_ratio);
+		gettimeofday(&end, NULL);
+
+		printf("Chose block size %u, predicted compression ratio %f\n", opts.block_size, predicted_ratio);
+		printf("Block size selection time: %f\n", get_runtime(&start, &end));
+	}
+
+	// Predict the compression ratio from samples of the input, and stop there
+	if (cfg->estimate) {
+		struct timeval start;
+		struct timeval end;
+		struct snappy_estimate est;
+
+		gettimeofday(&start, NULL);
+		snappy_estimate_ratio(&input, &opts, &est);
+		gettimeofday(&end, NULL);
+
+		printf("Sampled %zu bytes with block size %u\n", est.sampled, opts.block_size);
+		printf("Byte entropy: %f bits per byte\n", est.entropy);
+		printf("Bytes covered by copies: %f\n", est.match_fraction);
+		printf("Predicted compression ratio: %f\n", est.ratio);
+		printf("Estimation time: %f\n", get_runtime(&start, &end));
+		free(input.buffer);
+		return 0;
+	}
+
+	if (cfg->compress) {
+		setup_compression(&input, &output, &opts, runtime);
+
+		if (cfg->use_dpu)
 		{
-			status = snappy_compress_dpu(&input, &output, block_size, &runtime);
+			status = snappy_compress_dpu(&input, &output, &opts, ctx, runtime);
 		}
 		else
 		{
@@ -176,19 +902,23 @@ int main(int argc, char **argv)
 			struct timeval end;
 
 			gettimeofday(&start, NULL);	
-			status = snappy_compress_host(&input, &output, block_size);
+			status = snappy_compress_host(&input, &output, &opts);
 			gettimeofday(&end, NULL);
 
-			runtime.run = get_runtime(&start, &end);
+			runtime->run = get_runtime(&start, &end);
 		}
 	}
 	else {
-		if (setup_decompression(&input, &output, &runtime))
+		if (setup_decompression(&input, &output, runtime)) {
+			free(block_lengths);
+			free(input.buffer);
+			free(output.buffer);
 			return -1;
+		}
 
-		if (use_dpu)
+		if (cfg->use_dpu)
 		{
-			status = snappy_decompress_dpu(&input, &output, &runtime);
+			status = snappy_decompress_dpu(&input, &output, opts.dict, block_lengths, ctx, runtime);
 		}
 		else
 		{
@@ -196,42 +926,472 @@ int main(int argc, char **argv)
 			struct timeval end;
 
 			gettimeofday(&start, NULL);
-			status = snappy_decompress_host(&input, &output);
+			status = snappy_decompress_host(&input, &output, cfg->nr_threads, opts.dict);
 			gettimeofday(&end, NULL);
 
-			runtime.run = get_runtime(&start, &end);
+			runtime->run = get_runtime(&start, &end);
 		}
 	}
 	
 	if (status == SNAPPY_OK)
 	{
 		// Write the output buffer from main memory to a file
-		if (!(compress && use_dpu))
-			write_output_host(output_file, &output);
+		write_output_host(output_file, &output);
 
-		if (compress) {
+		if (cfg->compress) {
 			printf("Compressed %ld bytes to: %s\n", output.length, output_file);
 			printf("Compression ratio: %f\n", 1 - (double)output.length / (double)input.length);
+			if (cfg->auto_block_size)
+				printf("Predicted compression ratio: %f\n", predicted_ratio);
 		}
 		else {
 			printf("Decompressed %ld bytes to: %s\n", output.length, output_file);
 			printf("Compression ratio: %f\n", 1 - (double)input.length / (double)output.length);
 		}
 	
-		printf("Pre-processing time: %f\n", runtime.pre);
-		printf("Alloc time: %f\n", runtime.d_alloc);
-		printf("Load time: %f\n", runtime.load);
-		printf("Copy in time: %f\n", runtime.copy_in);
-		printf("Host time: %f\n", runtime.run);
-		printf("Copy out time: %f\n", runtime.copy_out);
-		printf("Free time: %f\n", runtime.d_free);
+		printf("Pre-processing time: %f\n", runtime->pre);
+		printf("Alloc time: %f\n", runtime->d_alloc);
+		printf("Load time: %f\n", runtime->load);
+		printf("Copy in time: %f\n", runtime->copy_in);
+		printf("Host time: %f\n", runtime->run);
+		printf("Copy out time: %f\n", runtime->copy_out);
+		printf("Free time: %f\n", runtime->d_free);
+		print_copy_rates(runtime);
 	}
 	else
 	{
 		fprintf(stderr, "Encountered Snappy error %u\n", status);
+	}
+
+	free(block_lengths);
+	free(input.buffer);
+	free(output.buffer);
+	return (status == SNAPPY_OK) ? 0 : -1;
+}
+
+/**
+ * Name the output of a file in a list of files, next to its input.
+ *
+ * @param input_file: input file name
+ * @param compress: whether the file is compressed or decompressed
+ * @return Output file name, to be freed by the caller
+ */
+static char *list_output_file(const char *input_file, int compress)
+{
+	const char *suffix = compress ? ".snappy" : ".out";
+	char *output_file = malloc(strlen(input_file) + strlen(suffix) + 1);
+	strcpy(output_file, input_file);
+	strcat(output_file, suffix);
+	return output_file;
+}
+
+/**
+ * Run every file given on the command line, one after the other. With the
+ * DPUs, they are allocated once and the program is loaded once, and the time
+ * this takes is reported per file.
+ *
+ * @param files: input file names
+ * @param num_files: number of input files
+ * @param cfg: what to do with each file, as given on the command line
+ * @return 0 if every file was successful, -1 otherwise
+ */
+static int run_files(char **files, uint32_t num_files, const struct run_config *cfg)
+{
+	struct program_runtime setup = {0};
+	struct dpu_context ctx;
+	double job_time = 0;
+	int ret = 0;
+
+	dpu_context_init(&ctx, cfg->nr_dpus, cfg->nr_tasklets, cfg->nr_waves, true);
+	ctx.claim_jobs = cfg->claim_jobs;
+
+	for (uint32_t i = 0; i < num_files; i++) {
+		// Write each output next to its input
+		char *output_file = list_output_file(files[i], cfg->compress);
+
+		struct program_runtime runtime = {0};
+		if (run_file(files[i], output_file, cfg, &ctx, &runtime))
+			ret = -1;
+		free(output_file);
+
+		setup.d_alloc += runtime.d_alloc;
+		setup.load += runtime.load;
+		job_time += runtime.pre + runtime.copy_in + runtime.run + runtime.copy_out;
+	}
+
+	dpu_context_free(&ctx, &setup);
+
+	printf("Ran %u files\n", num_files);
+	printf("Alloc time: %f\n", setup.d_alloc);
+	printf("Load time: %f\n", setup.load);
+	printf("Free time: %f\n", setup.d_free);
+	printf("Alloc, load and free time per file: %f\n", (setup.d_alloc + setup.load + setup.d_free) / num_files);
+	printf("Job time per file: %f\n", job_time / num_files);
+	return ret;
+}
+
+/**
+ * Run a batch of files in one launch of the DPUs, and write each output. A
+ * batch that does not fit in the DPUs is split in two.
+ *
+ * @param inputs: input of each file, read into memory
+ * @param outputs: output of each file, set up for compression or decompression
+ * @param nr_files: number of files
+ * @param cfg: what to do with each file, as given on the command line
+ * @param ctx: DPUs kept allocated across batches
+ * @param total[out]: time spent on each part is added to it
+ * @param launches[out]: number of launches is added to it
+ * @return 0 if every file was successful, -1 otherwise
+ */
+static int run_batch(struct host_buffer_context *inputs, struct host_buffer_context *outputs, uint32_t nr_files, const struct run_config *cfg,
+					 struct dpu_context *ctx, struct program_runtime *total, uint32_t *launches)
+{
+	struct program_runtime runtime = {0};
+	snappy_status status;
+	if (cfg->compress)
+		status = snappy_compress_dpu_batch(inputs, outputs, nr_files, &cfg->opts, ctx, &runtime);
+	else
+		status = snappy_decompress_dpu_batch(inputs, outputs, nr_files, cfg->opts.dict, NULL, ctx, &runtime);
+
+	add_runtime(total, &runtime);
+
+	if ((status == SNAPPY_BUFFER_TOO_SMALL) && (nr_files > 1)) {
+		// Start the outputs over, and run each half on its own
+		for (uint32_t i = 0; i < nr_files; i++) {
+			if (cfg->compress)
+				outputs[i].curr = outputs[i].buffer;
+		}
+
+		uint32_t half = nr_files / 2;
+		int ret = run_batch(inputs, outputs, half, cfg, ctx, total, launches);
+		if (run_batch(&inputs[half], &outputs[half], nr_files - half, cfg, ctx, total, launches))
+			ret = -1;
+		return ret;
+	}
+
+	(*launches)++;
+	if (status != SNAPPY_OK) {
+		fprintf(stderr, "Encountered Snappy error %u in a batch of %u files\n", status, nr_files);
 		return -1;
 	}
 
+	unsigned long input_length = 0;
+	unsigned long output_length = 0;
+	for (uint32_t i = 0; i < nr_files; i++) {
+		write_output_host((char *)outputs[i].file_name, &outputs[i]);
+		input_length += inputs[i].length;
+		output_length += outputs[i].length;
+	}
+	printf("%s %u files in one launch: %lu bytes to %lu bytes\n", cfg->compress ? "Compressed" : "Decompressed",
+		   nr_files, input_length, output_length);
 	return 0;
 }
 
+/**
+ * Run every file given on the command line on the DPUs, packing as many
+ * files as fit into each launch. Files are read in order until the next one
+ * would not fit, then the batch is run and its outputs are written.
+ *
+ * @param files: input file names
+ * @param num_files: number of input files
+ * @param cfg: what to do with each file, as given on the command line
+ * @return 0 if every file was successful, -1 otherwise
+ */
+static int run_batches(char **files, uint32_t num_files, const struct run_config *cfg)
+{
+	struct host_buffer_context *inputs = calloc(num_files, sizeof(struct host_buffer_context));
+	struct host_buffer_context *outputs = calloc(num_files, sizeof(struct host_buffer_context));
+	struct program_runtime total = {0};
+	struct dpu_context ctx;
+	uint32_t launches = 0;
+	uint32_t nr_files = 0;
+	unsigned long batch_length = 0;
+	int ret = 0;
+
+	dpu_context_init(&ctx, cfg->nr_dpus, cfg->nr_tasklets, cfg->nr_waves, true);
+	ctx.claim_jobs = cfg->claim_jobs;
+
+	for (uint32_t i = 0; i <= num_files; i++) {
+		struct host_buffer_context *input = &inputs[nr_files];
+		struct host_buffer_context *output = &outputs[nr_files];
+		unsigned long length = 0;
+
+		if (i < num_files) {
+			input->file_name = files[i];
+			input->max = cfg->nr_dpus * (unsigned long)BATCH_DPU_LENGTH;
+			output->file_name = list_output_file(files[i], cfg->compress);
+			output->max = input->max;
+
+			struct program_runtime setup = {0};
+			int failed = read_input_host(files[i], input);
+			if (!failed && cfg->compress)
+				setup_compression(input, output, &cfg->opts, &setup);
+			else if (!failed)
+				failed = (setup_decompression(input, output, &setup) != SNAPPY_OK);
+			total.pre += setup.pre;
+
+			if (failed) {
+				fprintf(stderr, "Skipping %s\n", files[i]);
+				free(input->buffer);
+				free(output->buffer);
+				free((char *)output->file_name);
+				memset(input, 0, sizeof(struct host_buffer_context));
+				memset(output, 0, sizeof(struct host_buffer_context));
+				ret = -1;
+				continue;
+			}
+			length = cfg->compress ? input->length : output->length;
+		}
+
+		// Run the files read so far once this one would not fit with them
+		bool full = (batch_length + length > cfg->nr_dpus * (unsigned long)BATCH_DPU_LENGTH) || (nr_files == cfg->nr_dpus * BATCH_DPU_FILES);
+		if ((nr_files != 0) && (full || (i == num_files))) {
+			if (run_batch(inputs, outputs, nr_files, cfg, &ctx, &total, &launches))
+				ret = -1;
+
+			for (uint32_t j = 0; j < nr_files; j++) {
+				free(inputs[j].buffer);
+				free(outputs[j].buffer);
+				free((char *)outputs[j].file_name);
+			}
+			if (i < num_files) {
+				inputs[0] = *input;
+				outputs[0] = *output;
+			}
+			nr_files = 0;
+			batch_length = 0;
+		}
+
+		nr_files++;
+		batch_length += length;
+	}
+
+	dpu_context_free(&ctx, &total);
+	free(inputs);
+	free(outputs);
+
+	printf("Ran %u files in %u launches\n", num_files, launches);
+	printf("Pre-processing time: %f\n", total.pre);
+	printf("Alloc time: %f\n", total.d_alloc);
+	printf("Load time: %f\n", total.load);
+	printf("Copy in time: %f\n", total.copy_in);
+	printf("Host time: %f\n", total.run);
+	printf("Copy out time: %f\n", total.copy_out);
+	printf("Free time: %f\n", total.d_free);
+	print_copy_rates(&total);
+	printf("Time per file: %f\n", (total.pre + total.copy_in + total.run + total.copy_out) / num_files);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	int stream = 0;
+	struct run_config cfg = {
+		.use_dpu = 0,
+		.compress = 0,
+		.validate = 0,
+		.estimate = 0,
+		.auto_block_size = 0,
+		.pack = 0,
+		.claim_jobs = 0,
+		.dpu_length = MAX_FILE_LENGTH,
+		.min_ratio = -1,
+		.nr_threads = 1,
+		.nr_dpus = NR_DPUS,
+		.nr_tasklets = NR_TASKLETS,
+		.nr_waves = 1,
+		.opts = {
+			.block_size = 32 * 1024, // Default is 32KB
+			.flags = 0,
+			.nr_threads = 1,
+			.level = SNAPPY_MIN_LEVEL,
+			.group_blocks = 0,
+			.skip_incompressible = false
+		}
+	};
+	char *input_file = NULL;
+	char *output_file = NULL;
+	char *dict_file = NULL;
+	struct host_buffer_context dict_buffer;
+	struct snappy_dictionary dict;
+
+	while ((opt = getopt(argc, argv, options)) != -1)
+	{
+		switch(opt)
+		{
+		case 'd':
+			cfg.use_dpu = 1;
+			break;
+
+		case 'c':
+			cfg.compress = 1;
+			break;
+		
+		case 'v':
+			cfg.validate = 1;
+			break;
+
+		case 'k':
+			cfg.opts.flags |= SNAPPY_FLAG_CRC32C;
+			break;
+
+		case 's':
+			stream = 1;
+			break;
+
+		case 'e':
+			cfg.estimate = 1;
+			break;
+
+		case 'x':
+			cfg.opts.skip_incompressible = true;
+			break;
+
+		case 'p':
+			cfg.pack = 1;
+			break;
+
+		case 'q':
+			cfg.claim_jobs = 1;
+			break;
+
+		case 'b':
+			if (strcmp(optarg, "auto") == 0)
+				cfg.auto_block_size = 1;
+			else
+				cfg.opts.block_size = atoi(optarg);
+			break;
+
+		case 'g':
+			cfg.opts.group_blocks = atoi(optarg);
+			if (cfg.opts.group_blocks == 0) {
+				usage(argv[0]);
+				return -2;
+			}
+			cfg.opts.flags |= SNAPPY_FLAG_CHAINED;
+			break;
+
+		case 'l':
+			cfg.opts.level = atoi(optarg);
+			if ((cfg.opts.level < SNAPPY_MIN_LEVEL) || (cfg.opts.level > SNAPPY_MAX_LEVEL)) {
+				usage(argv[0]);
+				return -2;
+			}
+			break;
+
+		case 'm':
+			cfg.dpu_length = strtoul(optarg, NULL, 0);
+			if ((cfg.dpu_length < 2) || (cfg.dpu_length > MAX_FILE_LENGTH)) {
+				usage(argv[0]);
+				return -2;
+			}
+			break;
+
+		case 'r':
+			cfg.min_ratio = atof(optarg);
+			break;
+
+		case 't':
+			cfg.nr_threads = atoi(optarg);
+			if (cfg.nr_threads == 0) {
+				usage(argv[0]);
+				return -2;
+			}
+			cfg.opts.nr_threads = cfg.nr_threads;
+			break;
+
+		case 'n':
+			cfg.nr_dpus = atoi(optarg);
+			if (cfg.nr_dpus == 0) {
+				usage(argv[0]);
+				return -2;
+			}
+			break;
+
+		case 'a':
+			cfg.nr_tasklets = atoi(optarg);
+			if ((cfg.nr_tasklets == 0) || (cfg.nr_tasklets > NR_TASKLETS)) {
+				usage(argv[0]);
+				return -2;
+			}
+			break;
+
+		case 'w':
+			cfg.nr_waves = atoi(optarg);
+			if (cfg.nr_waves == 0) {
+				usage(argv[0]);
+				return -2;
+			}
+			break;
+
+		case 'i':
+			input_file = optarg;
+			break;
+
+		case 'o':
+			output_file = optarg;
+			break;
+
+		case 'D':
+			dict_file = optarg;
+			break;
+
+		default:
+			usage(argv[0]);
+			return -2;
+		}
+	}
+
+	if (dict_file != NULL) {
+		if (read_dictionary(dict_file, &dict_buffer, &dict))
+			return -1;
+		cfg.opts.dict = &dict;
+	}
+
+	if (stream) {
+		if (cfg.use_dpu || cfg.validate || cfg.estimate || (optind < argc)) {
+			usage(argv[0]);
+			return -2;
+		}
+		if (cfg.auto_block_size)
+			fprintf(stderr, "Cannot choose a block size when streaming, using %u\n", cfg.opts.block_size);
+		return stream_host(input_file, output_file, cfg.compress, &cfg.opts);
+	}
+
+	// Packing needs a list of files, and the same options for all of them
+	if (cfg.pack && (!cfg.use_dpu || (optind == argc) || cfg.validate || cfg.estimate || cfg.auto_block_size)) {
+		usage(argv[0]);
+		return -2;
+	}
+
+	// A list of files is run with one set of DPUs, each output is written next to its input
+	if (optind < argc) {
+		if ((input_file != NULL) || (output_file != NULL)) {
+			usage(argv[0]);
+			return -2;
+		}
+		if (cfg.pack)
+			return run_batches(&argv[optind], argc - optind, &cfg);
+		return run_files(&argv[optind], argc - optind, &cfg);
+	}
+
+	if (!input_file)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	// If no output file was provided, use a default file
+	if (output_file == NULL) {
+		output_file = "output.txt";
+	}
+
+	// The DPUs are freed at the end of the job
+	struct program_runtime runtime = {0};
+	struct dpu_context ctx;
+	dpu_context_init(&ctx, cfg.nr_dpus, cfg.nr_tasklets, cfg.nr_waves, false);
+	ctx.claim_jobs = cfg.claim_jobs;
+	return run_file(input_file, output_file, &cfg, &ctx, &runtime);
+}
+
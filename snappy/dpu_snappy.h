@@ -17,6 +17,40 @@
 // Max length of the input and output files
 #define MAX_FILE_LENGTH MEGABYTE(30)
 
+// Format flags, stored in the extended stream header
+#define SNAPPY_FLAG_CRC32C (1 << 0)	// Each block header carries a masked CRC32C of the block's decompressed data
+#define SNAPPY_FLAG_STREAM (1 << 1)	// The decompressed length is not known up front, see below
+#define SNAPPY_FLAG_DICT (1 << 2)	// Copies may reach back into a preset dictionary, whose ID follows the block size
+#define SNAPPY_FLAG_CHAINED (1 << 3)	// Copies may reach back into the previous block of the same group, see below
+
+// A stream with SNAPPY_FLAG_STREAM has a decompressed length of 0 in its header.
+// Its blocks are followed by a block size of 0 (never a valid block header)
+// and the real decompressed length as a 64-bit varint.
+#define STREAM_END_MARKER 0
+
+// A stream with SNAPPY_FLAG_CHAINED has the number of blocks in each group
+// after the block size (and dictionary ID). Blocks are grouped from the first
+// one, and every block but the first of a group may copy from the previous
+// block, so a group has to be decoded in order by one thread or tasklet.
+// Work is only ever split on group boundaries.
+
+// Length of the header in front of each compressed block
+#define BLOCK_HEADER_LENGTH(_flags) (sizeof(uint32_t) + (((_flags) & SNAPPY_FLAG_CRC32C) ? sizeof(uint32_t) : 0))
+
+// Encoding of a block, stored in the top bits of the compressed size in its header
+#define BLOCK_TYPE_SNAPPY 0U		// Snappy compressed data
+#define BLOCK_TYPE_RAW 1U		// The decompressed data, stored as is
+#define BLOCK_TYPE_RUN 2U		// One byte, repeated for the whole decompressed block
+#define NR_BLOCK_TYPES 3
+#define BLOCK_TYPE_SHIFT 30
+#define GET_BLOCK_TYPE(_size) ((_size) >> BLOCK_TYPE_SHIFT)
+#define GET_BLOCK_SIZE(_size) ((_size) & BITMASK(BLOCK_TYPE_SHIFT))
+
+// Longest preset dictionary. The dictionary and a block together must fit in
+// SNAPPY_MAX_DICT_WINDOW, so that copies out of the dictionary have 2-byte offsets.
+#define SNAPPY_MAX_DICT_LENGTH KILOBYTE(32)
+#define SNAPPY_MAX_DICT_WINDOW KILOBYTE(64)
+
 // Return values
 typedef enum {
 	SNAPPY_OK = 0,				// Success code
@@ -43,7 +77,15 @@ typedef struct host_buffer_context
 	unsigned long max;		// Maximum allowed lenght of buffer
 } host_buffer_context;
 
-// Breakdown of time spent doing each action
+// Preset dictionary that copies at the start of every block may refer to
+struct snappy_dictionary {
+	const uint8_t *data;	// Contents of the dictionary
+	uint32_t length;		// Length of the dictionary, at most SNAPPY_MAX_DICT_LENGTH
+	uint32_t id;			// Masked CRC32C of the contents, stored in the stream header
+};
+
+// Breakdown of time spent doing each action, and of the bytes copied to and
+// from the DPUs
 struct program_runtime {
 	double pre;
 	double d_alloc;
@@ -52,12 +94,48 @@ struct program_runtime {
 	double run;
 	double copy_out;
 	double d_free;
+	uint64_t copy_in_bytes;
+	uint64_t copy_out_bytes;
 };
 
+// Peak rate in GB/s of the copies to and from the DPUs, as measured with
+// parallel transfers on a whole system of 2,556 DPUs, which the rates reached
+// by a job are compared to. Can be set for other systems when building.
+#ifndef DPU_COPY_IN_PEAK
+#define DPU_COPY_IN_PEAK 6.68
+#endif
+#ifndef DPU_COPY_OUT_PEAK
+#define DPU_COPY_OUT_PEAK 4.74
+#endif
+
 /**
  * Calculate the difference between two timeval structs.
  */
 double get_runtime(struct timeval *start, struct timeval *end);
 
+/**
+ * Add bytes to a running CRC32C checksum (see crc32c.h), using the SSE4.2
+ * crc32 instruction when the CPU supports it.
+ *
+ * @param crc: running checksum, starting at CRC32C_INIT
+ * @param buf: data to add
+ * @param len: length of data
+ * @return Updated running checksum
+ */
+uint32_t crc32c_host(uint32_t crc, const uint8_t *buf, size_t len);
+
+/**
+ * Run a function on a set of host threads and wait for all of them to
+ * finish. Thread i is passed a pointer to the i-th element of args. The
+ * calling thread runs the first element itself.
+ *
+ * @param nr_threads: number of threads to run
+ * @param fn: function each thread runs
+ * @param args: array of nr_threads arguments
+ * @param arg_size: size of one element of args
+ * @return 0 if successful, -1 if a thread could not be created
+ */
+int run_host_threads(uint32_t nr_threads, void *(*fn)(void *), void *args, size_t arg_size);
+
 #endif	/* _DPU_SNAPPY_H_ */
 
@@ -9,6 +9,11 @@ MAX_DPUS = 640
 MAX_TASKLETS = 24
 
 
+def build():
+        # One build runs any number of DPUs and up to MAX_TASKLETS tasklets, picked with -n and -a
+        os.system('make clean')
+        os.system(f'make NR_TASKLETS={MAX_TASKLETS}')
+
 def get_optimal_tasklets(file_path, block_size, num_dpus):
         size = os.path.getsize(file_path)
         num_blocks = ceil(size / block_size)
@@ -19,19 +24,16 @@ def get_optimal_tasklets(file_path, block_size, num_dpus):
         return num_tasklets
 
 def run_tasklet_test(files, min_tasklet, max_tasklet, incr, num_dpu):
+        build()
         for testfile in files:
-                os.system('make clean')
-                os.system('make')
                 os.system(f'./dpu_snappy -i ../test/{testfile}.snappy > results/decompression/{testfile}_host.txt')
                 os.system(f'./dpu_snappy -c -i ../test/{testfile}.txt > results/compression/{testfile}_host.txt')
 
                 for i in [min_tasklet] + list(range(min_tasklet + 1, max_tasklet + 1, incr)):
-                        os.system('make clean')
-                        os.system(f'make NR_DPUS={num_dpu} NR_TASKLETS={i}')
-                        print(f'./dpu_snappy -d -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={num_dpu}_tasklets={i}.txt')
-                        os.system(f'./dpu_snappy -d -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={num_dpu}_tasklets={i}.txt')
-                        print(f'./dpu_snappy -d -c -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={num_dpu}_tasklets={i}.txt')
-                        os.system(f'./dpu_snappy -d -c -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={num_dpu}_tasklets={i}.txt')
+                        print(f'./dpu_snappy -d -n {num_dpu} -a {i} -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={num_dpu}_tasklets={i}.txt')
+                        os.system(f'./dpu_snappy -d -n {num_dpu} -a {i} -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={num_dpu}_tasklets={i}.txt')
+                        print(f'./dpu_snappy -d -c -n {num_dpu} -a {i} -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={num_dpu}_tasklets={i}.txt')
+                        os.system(f'./dpu_snappy -d -c -n {num_dpu} -a {i} -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={num_dpu}_tasklets={i}.txt')
 
         # Write compression results csv
         with open('results/compression_speedup_tasklet.csv', 'w', newline='') as csvfile:
@@ -67,21 +69,18 @@ def run_tasklet_test(files, min_tasklet, max_tasklet, incr, num_dpu):
         
 
 def run_dpu_test(files, min_dpu, max_dpu, incr):
+        build()
         for testfile in files:
-                os.system('make clean')
-                os.system('make')
                 os.system(f'./dpu_snappy -i ../test/{testfile}.snappy > results/decompression/{testfile}_host.txt')
                 os.system(f'./dpu_snappy -c -i ../test/{testfile}.txt > results/compression/{testfile}_host.txt')
 
                 for i in [min_dpu] + list(range(min_dpu - 1 + incr, max_dpu + 1, incr)):
                         tasklets = get_optimal_tasklets(f"../test/{testfile}.txt", 32768, i)
 
-                        os.system('make clean')
-                        os.system(f'make NR_DPUS={i} NR_TASKLETS={tasklets}')
-                        print(f'./dpu_snappy -d -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
-                        os.system(f'./dpu_snappy -d -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
-                        print(f'./dpu_snappy -d -c -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
-                        os.system(f'./dpu_snappy -d -c -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
+                        print(f'./dpu_snappy -d -n {i} -a {tasklets} -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
+                        os.system(f'./dpu_snappy -d -n {i} -a {tasklets} -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
+                        print(f'./dpu_snappy -d -c -n {i} -a {tasklets} -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
+                        os.system(f'./dpu_snappy -d -c -n {i} -a {tasklets} -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
 
         # Write compression results csv
         with open('results/compression_speedup_dpu.csv', 'w', newline='') as csvfile:
@@ -121,13 +120,12 @@ def run_dpu_test(files, min_dpu, max_dpu, incr):
                                     writer.writerow([testfile, std_dpu, i])
        
 def run_breakdown_test(testfile, min_dpu, max_dpu, incr, tasklets):
+    build()
     for i in [min_dpu] + list(range(min_dpu - 1 + incr, max_dpu + 1, incr)):
-        os.system('make clean')
-        os.system(f'make NR_DPUS={i} NR_TASKLETS={tasklets}')
-        print(f'./dpu_snappy -d -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
-        os.system(f'./dpu_snappy -d -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
-        print(f'./dpu_snappy -d -c -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
-        os.system(f'./dpu_snappy -d -c -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
+        print(f'./dpu_snappy -d -n {i} -a {tasklets} -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
+        os.system(f'./dpu_snappy -d -n {i} -a {tasklets} -i ../test/{testfile}.snappy > results/decompression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
+        print(f'./dpu_snappy -d -c -n {i} -a {tasklets} -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
+        os.system(f'./dpu_snappy -d -c -n {i} -a {tasklets} -i ../test/{testfile}.txt > results/compression/{testfile}_dpus={i}_tasklets={tasklets}.txt')
 
     with open(f'results/{testfile}_compression_breakdown.csv', 'w', newline='') as csvfile:
             writer = csv.writer(csvfile, delimiter=',')
@@ -1,13 +1,17 @@
 #include <dpu.h>
 #include <dpu_memory.h>
 #include <dpu_log.h>
+#include <math.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "snappy_compress.h"
+#include "crc32c.h"
 
 #define DPU_COMPRESS_PROGRAM "dpu-compress/compress.dpu"
-#define TOTAL_NR_TASKLETS (NR_DPUS * NR_TASKLETS)
 
 /**
  * This value could be halfed or quartered to save memory
@@ -16,6 +20,74 @@
 #define MAX_HASH_TABLE_BITS 14
 #define MAX_HASH_TABLE_SIZE (1U << MAX_HASH_TABLE_BITS)
 
+/**
+ * Positions in blocks of up to 64KB fit in the 16-bit entries of the hash
+ * table, which keeps the table in the L1 cache. Larger blocks use 32-bit
+ * entries, and a larger table since they have more positions to remember.
+ */
+#define MAX_NARROW_BLOCK_SIZE KILOBYTE(64)
+#define IS_WIDE_BLOCK(_size) ((_size) > MAX_NARROW_BLOCK_SIZE)
+#define MAX_WIDE_HASH_TABLE_BITS 16
+#define MAX_WIDE_HASH_TABLE_SIZE (1U << MAX_WIDE_HASH_TABLE_BITS)
+
+// Copies with larger offsets need the 4-byte offset of EL_TYPE_COPY_4
+#define MAX_COPY_2_OFFSET BITMASK(16)
+
+// Short literals are copied with one 16-byte store, which may write up to
+// this many bytes past the end of the compressed data
+#define COMPRESS_OUTPUT_SLOP 16
+
+// Longest stream header: the decompressed length, a zero, the flags, the block size,
+// the dictionary ID and the group size
+#define STREAM_HEADER_LENGTH 30
+
+// Longest end of a stream with SNAPPY_FLAG_STREAM: the end marker and a 64-bit varint
+#define STREAM_TRAILER_LENGTH (sizeof(uint32_t) + 10)
+
+// Block sizes tried by snappy_choose_block_size
+#define AUTO_MIN_BLOCK_SIZE KILOBYTE(1)
+#define AUTO_MAX_BLOCK_SIZE KILOBYTE(64)
+
+// Windows of the input compressed by snappy_choose_block_size to predict the
+// ratio of each block size. The window length is a multiple of every block size.
+#define AUTO_SAMPLE_WINDOWS 8
+#define AUTO_SAMPLE_LENGTH AUTO_MAX_BLOCK_SIZE
+
+// Without a minimum ratio, snappy_choose_block_size accepts block sizes that
+// keep this fraction of the best predicted ratio
+#define AUTO_DEFAULT_RATIO_FRACTION 0.9
+
+// Block sizes whose busiest thread or tasklet gets at most this much more
+// input than with the best balanced block size are treated as just as fast
+#define AUTO_BALANCE_SLACK 1.03
+
+// Bytes sampled by snappy_estimate_ratio, in windows of at most one block
+// spread evenly over the input, and the fewest windows sampled with large blocks
+#define ESTIMATE_SAMPLE_LENGTH MEGABYTE(1)
+#define ESTIMATE_MAX_WINDOW_LENGTH KILOBYTE(256)
+#define ESTIMATE_MIN_WINDOWS 8
+
+// Blocks predicted to save less than this fraction of their size are stored
+// raw when skipping incompressible blocks
+#define ESTIMATE_MIN_RATIO 0.03
+
+// Bytes of a block counted to find its entropy before looking for matches,
+// and the entropy in bits per byte below which the block is compressed
+// without looking. Data with fewer distinct bytes than that nearly always
+// repeats 4-byte strings often enough to compress.
+#define ESTIMATE_BLOCK_SAMPLE_LENGTH KILOBYTE(1)
+#define ESTIMATE_RANDOM_ENTROPY 7.0
+
+// Estimated DPU cycles to compress each byte of a block that has matches to
+// look for, of one that looks random, which the compressor skips through
+// faster and faster as it misses, and of one that is one byte repeated, plus
+// the cycles to start each block. Only their ratios matter, they split the
+// work between tasklets and can be tuned from the cycles the tasklets print.
+#define DPU_COMPRESS_BYTE_CYCLES 4
+#define DPU_COMPRESS_RANDOM_BYTE_CYCLES 2
+#define DPU_COMPRESS_RUN_BYTE_CYCLES 1
+#define DPU_COMPRESS_BLOCK_CYCLES 512
+
 /**
  * Calculate the rounded down log base 2 of an unsigned integer.
  *
@@ -97,6 +169,111 @@ static inline void write_varint32(struct host_buffer_context *output, uint32_t v
 	}
 }
 
+/**
+ * Write a 64-bit varint to the output buffer, in the same format as
+ * write_varint32.
+ *
+ * @param output: holds output buffer information
+ * @param val: value to write
+ */
+static inline void write_varint64(struct host_buffer_context *output, uint64_t val)
+{
+	while (val >= (1 << 7)) {
+		*(output->curr++) = val | (1 << 7);
+		val >>= 7;
+	}
+	*(output->curr++) = val;
+}
+
+/**
+ * Write the stream header: the decompressed length, followed by the block
+ * size. If any format flags are set, the block size is preceded by a zero
+ * (never a valid block size) and the flags. With a preset dictionary, the
+ * block size is followed by the dictionary ID, and with chained blocks by
+ * the number of blocks in each group.
+ *
+ * @param output: holds output buffer information
+ * @param length: decompressed length of the stream
+ * @param opts: compression options
+ */
+static void write_stream_header(struct host_buffer_context *output, uint32_t length, const struct compress_options *opts)
+{
+	uint32_t flags = opts->flags | ((opts->dict != NULL) ? SNAPPY_FLAG_DICT : 0);
+
+	write_varint32(output, length);
+	if (flags) {
+		write_varint32(output, 0);
+		write_varint32(output, flags);
+	}
+	write_varint32(output, opts->block_size);
+	if (flags & SNAPPY_FLAG_DICT)
+		write_varint32(output, opts->dict->id);
+	if (flags & SNAPPY_FLAG_CHAINED)
+		write_varint32(output, opts->group_blocks);
+}
+
+/**
+ * Check that the preset dictionary of the options, if any, fits next to a
+ * block, and that chained blocks have a valid group size.
+ *
+ * @param opts: compression options
+ * @return True if the options can be used
+ */
+static bool check_options(const struct compress_options *opts)
+{
+	if ((opts->dict != NULL) && ((opts->dict->length > SNAPPY_MAX_DICT_LENGTH) ||
+				((opts->dict->length + opts->block_size) > SNAPPY_MAX_DICT_WINDOW))) {
+		fprintf(stderr, "The dictionary must be at most %u bytes, and fit in %u bytes with a block\n",
+				SNAPPY_MAX_DICT_LENGTH, SNAPPY_MAX_DICT_WINDOW);
+		return false;
+	}
+	if ((opts->flags & SNAPPY_FLAG_CHAINED) && ((opts->group_blocks == 0) || (opts->dict != NULL))) {
+		fprintf(stderr, "Chained blocks need a group size, and cannot be used with a dictionary\n");
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Get the number of blocks in each group, which work is split on.
+ *
+ * @param opts: compression options
+ * @return Blocks in each group, 1 if blocks are not chained
+ */
+static inline uint32_t get_group_blocks(const struct compress_options *opts)
+{
+	return (opts->flags & SNAPPY_FLAG_CHAINED) ? opts->group_blocks : 1;
+}
+
+/**
+ * Get the length of the history a block may copy from, which is the
+ * previous block unless the block starts a group.
+ *
+ * @param opts: compression options
+ * @param block: index of the block, counted from the start of a group
+ * @return Length of the history right before the block
+ */
+static inline uint32_t get_chain_history(const struct compress_options *opts, size_t block)
+{
+	return ((block % get_group_blocks(opts)) != 0) ? opts->block_size : 0;
+}
+
+/**
+ * Calculate the maximum expected length of a compressed stream, including
+ * the stream header and the header of every block. Every block is bounded
+ * separately, since the tag bytes of each block add up for small blocks.
+ *
+ * @param input_length: decompressed length of the stream
+ * @param opts: compression options
+ * @return Maximum length of the compressed stream
+ */
+static inline size_t max_compressed_stream_length(uint32_t input_length, const struct compress_options *opts)
+{
+	size_t num_blocks = (input_length + opts->block_size - 1) / opts->block_size;
+	size_t max_block_length = snappy_max_compressed_length(MIN(input_length, opts->block_size)) + BLOCK_HEADER_LENGTH(opts->flags);
+	return STREAM_HEADER_LENGTH + num_blocks * max_block_length + COMPRESS_OUTPUT_SLOP;
+}
+
 /**
  * Write an unsigned integer to the output buffer.
  *
@@ -112,19 +289,30 @@ static inline void write_uint32(uint8_t *ptr, uint32_t val)
 }
 
 /**
- * Read an unsigned integer from the input buffer.
+ * Read an unsigned integer from the input buffer. The pointer does
+ * not need to be aligned.
  *
  * @param ptr: where to read the integer from
  * @return Value read
  */
-static inline uint32_t read_uint32(uint8_t *ptr)
+static inline uint32_t read_uint32(const uint8_t *ptr)
 {
-	uint32_t val = 0;
-	
-	val |= *ptr++ & 0xFF;
-	val |= (*ptr++ & 0xFF) << 8;
-	val |= (*ptr++ & 0xFF) << 16;
-	val |= (*ptr++ & 0xFF) << 24;
+	uint32_t val;
+	memcpy(&val, ptr, sizeof(val));
+	return val;
+}
+
+/**
+ * Read an unsigned 64-bit integer from the input buffer. The pointer does
+ * not need to be aligned.
+ *
+ * @param ptr: where to read the integer from
+ * @return Value read
+ */
+static inline uint64_t read_uint64(const uint8_t *ptr)
+{
+	uint64_t val;
+	memcpy(&val, ptr, sizeof(val));
 	return val;
 }
 
@@ -132,17 +320,62 @@ static inline uint32_t read_uint32(uint8_t *ptr)
  * Get the size of the hash table needed for the size we are
  * compressing, and reset the values in the table.
  *
- * @param table: pointer to the start of the hash table
+ * @param table: pointer to the start of the hash table, with 32-bit entries
+ *               if IS_WIDE_BLOCK(size_to_compress) and 16-bit ones otherwise
  * @param size_to_compress: size we are compressing
  * @param table_size[out]: size of the table needed to compress size_to_compress
  */
-static inline void get_hash_table(uint16_t *table, uint32_t size_to_compress, uint32_t *table_size)
+static inline void get_hash_table(void *table, uint32_t size_to_compress, uint32_t *table_size)
 {
+	bool wide = IS_WIDE_BLOCK(size_to_compress);
+	uint32_t max_table_size = wide ? MAX_WIDE_HASH_TABLE_SIZE : MAX_HASH_TABLE_SIZE;
+
 	*table_size = 256;
-	while ((*table_size < MAX_HASH_TABLE_SIZE) && (*table_size < size_to_compress))
+	while ((*table_size < max_table_size) && (*table_size < size_to_compress))
 		*table_size <<= 1;
 
-	memset(table, 0, *table_size * sizeof(*table));
+	memset(table, 0, *table_size * (wide ? sizeof(uint32_t) : sizeof(uint16_t)));
+}
+
+/**
+ * Read a position from the hash table.
+ *
+ * @param table: hash table
+ * @param wide: the table has 32-bit entries
+ * @param hval: hash of the entry
+ * @return Position stored in the entry
+ */
+static inline uint32_t hash_table_get(const void *table, bool wide, uint32_t hval)
+{
+	return wide ? ((const uint32_t *)table)[hval] : ((const uint16_t *)table)[hval];
+}
+
+/**
+ * Store a position in the hash table.
+ *
+ * @param table: hash table
+ * @param wide: the table has 32-bit entries
+ * @param hval: hash of the entry
+ * @param pos: position to store
+ */
+static inline void hash_table_set(void *table, bool wide, uint32_t hval, uint32_t pos)
+{
+	if (wide)
+		((uint32_t *)table)[hval] = pos;
+	else
+		((uint16_t *)table)[hval] = pos;
+}
+
+/**
+ * Shortest match worth a copy at an offset. Copies that need a 4-byte offset
+ * take 5 bytes, so matching only 4 bytes would make the data bigger.
+ *
+ * @param offset: offset of the copy
+ * @return Shortest match length
+ */
+static inline uint32_t min_match_length(uint32_t offset)
+{
+	return (offset > MAX_COPY_2_OFFSET) ? 5 : 4;
 }
 
 /**
@@ -154,15 +387,26 @@ static inline void get_hash_table(uint16_t *table, uint32_t size_to_compress, ui
  * input. Of course, it doesn't hurt if the hash function is reasonably fast
  * either, as it gets called a lot.
  *
+ * @param bytes: four bytes to hash
+ * @param shift: adjusts hash to be within table size
+ * @return Hash of bytes
+ */
+static inline uint32_t hash_bytes(uint32_t bytes, int shift)
+{
+	uint32_t kmul = 0x1e35a7bd;
+	return (bytes * kmul) >> shift;
+}
+
+/**
+ * Hash the four bytes stored at ptr.
+ *
  * @param ptr: pointer to the value we want to hash
  * @param shift: adjusts hash to be within table size
  * @return Hash of four bytes stored at ptr
  */
 static inline uint32_t hash(uint8_t *ptr, int shift)
 {
-	uint32_t kmul = 0x1e35a7bd;
-	uint32_t bytes = read_uint32(ptr);
-	return (bytes * kmul) >> shift;
+	return hash_bytes(read_uint32(ptr), shift);
 }
 
 /**
@@ -177,10 +421,14 @@ static inline int32_t find_match_length(uint8_t *s1, uint8_t *s2, uint8_t *s2_li
 {
 	int32_t matched = 0;
 	
-	// Check by increments of 4 first
-	while ((s2 <= (s2_limit - 4)) && (read_uint32(s2) == read_uint32(s1 + matched))) {
-		s2 += 4;
-		matched += 4;
+	// Check by increments of 8 first, the lowest set bit of the XOR
+	// of the first mismatching words is the first byte that differs
+	while (s2 <= (s2_limit - 8)) {
+		uint64_t x = read_uint64(s2) ^ read_uint64(s1 + matched);
+		if (x != 0)
+			return matched + (__builtin_ctzll(x) >> 3);
+		s2 += 8;
+		matched += 8;
 	}
 
 	// Remaining bytes
@@ -198,11 +446,20 @@ static inline int32_t find_match_length(uint8_t *s1, uint8_t *s2, uint8_t *s2_li
  * @param output: holds output buffer information
  * @param literal: buffer storing the literal data
  * @param len: length of the literal
+ * @param allow_fast_path: true if 16 bytes can be read from literal, even when len is less
  */
-static void emit_literal(struct host_buffer_context *output, uint8_t *literal, uint32_t len)
+static inline void emit_literal(struct host_buffer_context *output, uint8_t *literal, uint32_t len, bool allow_fast_path)
 {
 	//printf("emit_literal %d %d\n", len, output->curr-output->buffer);
 	uint32_t n = len - 1; // Zero-length literals are disallowed
+
+	// Copy short literals with one 16-byte store into the output slop
+	if (allow_fast_path && (len <= 16)) {
+		*output->curr++ = EL_TYPE_LITERAL | (n << 2);
+		memcpy(output->curr, literal, 16);
+		output->curr += len;
+		return;
+	}
 	
 	if (n < 60) {
 		*output->curr++ = EL_TYPE_LITERAL | (n << 2);
@@ -237,6 +494,11 @@ static void emit_copy_less_than64(struct host_buffer_context *output, uint32_t o
 		*output->curr++ = EL_TYPE_COPY_1 + ((len - 4) << 2) + ((offset >> 8) << 5);
 		*output->curr++ = offset & 0xFF;
 	}
+	else if (offset > MAX_COPY_2_OFFSET) {
+		*output->curr++ = EL_TYPE_COPY_4 + ((len - 1) << 2);
+		write_uint32(output->curr, offset);
+		output->curr += sizeof(uint32_t);
+	}
 	else {
 		*output->curr++ = EL_TYPE_COPY_2 + ((len - 1) << 2);
 		*output->curr++ = offset & 0xFF;
@@ -271,6 +533,68 @@ static void emit_copy(struct host_buffer_context *output, uint32_t offset, uint3
 	emit_copy_less_than64(output, offset, len);
 }
 
+/**
+ * Write the header of a block whose data has been written after it. If the
+ * compressed data is not smaller than the input, it is replaced by the input
+ * and the block is stored raw.
+ *
+ * @param output: holds output buffer information, curr is the end of the block
+ * @param header: start of the block header
+ * @param block: decompressed data of the block
+ * @param block_size: decompressed size of the block
+ * @param flags: format flags of the stream
+ */
+static void finish_block(struct host_buffer_context *output, uint8_t *header, const uint8_t *block, uint32_t block_size, uint32_t flags)
+{
+	uint8_t *output_start = header + BLOCK_HEADER_LENGTH(flags);
+	uint32_t compressed_size = output->curr - output_start;
+	uint32_t type = BLOCK_TYPE_SNAPPY;
+
+	if (compressed_size >= block_size) {
+		memcpy(output_start, block, block_size);
+		output->curr = output_start + block_size;
+		compressed_size = block_size;
+		type = BLOCK_TYPE_RAW;
+	}
+
+	write_uint32(header, compressed_size | (type << BLOCK_TYPE_SHIFT));
+	if (flags & SNAPPY_FLAG_CRC32C)
+		write_uint32(header + 4, crc32c_mask(crc32c_host(CRC32C_INIT, block, block_size)));
+}
+
+/**
+ * Check if a block is one byte repeated. Usually stops at the first bytes.
+ *
+ * @param block: decompressed data of the block
+ * @param block_size: decompressed size of the block
+ * @return True if every byte of the block is the same
+ */
+static inline bool is_run_block(const uint8_t *block, uint32_t block_size)
+{
+	return (block_size > 0) && (memcmp(block, block + 1, block_size - 1) == 0);
+}
+
+/**
+ * Store a block that is one byte repeated as a run block, which holds just
+ * that byte.
+ *
+ * @param input: holds input buffer information
+ * @param output: holds output buffer information
+ * @param input_size: size of the block
+ * @param flags: format flags of the stream
+ */
+static void compress_run_block(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t input_size, uint32_t flags)
+{
+	uint8_t *header = output->curr;
+	output->curr += BLOCK_HEADER_LENGTH(flags);
+	*output->curr++ = *input->curr;
+
+	write_uint32(header, 1 | (BLOCK_TYPE_RUN << BLOCK_TYPE_SHIFT));
+	if (flags & SNAPPY_FLAG_CRC32C)
+		write_uint32(header + 4, crc32c_mask(crc32c_host(CRC32C_INIT, input->curr, input_size)));
+	input->curr += input_size;
+}
+
 /**
  * Perform Snappy compression on a block of input data, and save the compressed
  * data to the output buffer.
@@ -278,18 +602,25 @@ static void emit_copy(struct host_buffer_context *output, uint32_t offset, uint3
  * @param input: holds input buffer information
  * @param output: holds output buffer information
  * @param input_size: size of the input to compress
- * @param table: pointer to allocated hash table
+ * @param table: pointer to allocated hash table, positions in it are relative
+ *               to the start of the history. Its entries are 32-bit if
+ *               IS_WIDE_BLOCK(history_length + input_size) and 16-bit otherwise.
  * @param table_size: size of the hash table
+ * @param history_length: length of the dictionary right before the block,
+ *                        which copies may reach back into
+ * @param flags: format flags of the stream
  */
-static void compress_block(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t input_size, uint16_t *table, uint32_t table_size)
+static void compress_block(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t input_size, void *table, uint32_t table_size, uint32_t history_length, uint32_t flags)
 {
 	uint8_t *base_input = input->curr;
+	uint8_t *table_base = input->curr - history_length;
 	uint8_t *input_end = input->curr + input_size;
 	const int32_t shift = 32 - log2_floor(table_size);
+	const bool wide = IS_WIDE_BLOCK(history_length + input_size);
 
-	// Make space for compressed length
-	output->curr += 4;
-	uint8_t *output_start = output->curr;
+	// Make space for the block header
+	uint8_t *header = output->curr;
+	output->curr += BLOCK_HEADER_LENGTH(flags);
 
 	/*
 	 * Bytes in [next_emit, input->curr) will be emitted as literal bytes.
@@ -343,16 +674,17 @@ static void compress_block(struct host_buffer_context *input, struct host_buffer
 					goto emit_remainder;
 
 				next_hash = hash(next_input, shift);
-				candidate = base_input + table[hval];
-				table[hval] = input->curr - base_input;
-			} while (read_uint32(input->curr) != read_uint32(candidate));
+				candidate = table_base + hash_table_get(table, wide, hval);
+				hash_table_set(table, wide, hval, input->curr - table_base);
+			} while ((read_uint32(input->curr) != read_uint32(candidate)) ||
+					(wide && (min_match_length(input->curr - candidate) > 4) && (input->curr[4] != candidate[4])));
 			
 			/*
 			 * Step 2: A 4-byte match has been found.  We'll later see if more
 			 * than 4 bytes match.	But, prior to the match, input bytes
 			 * [next_emit, input->curr) are unmatched.	Emit them as "literal bytes."
 			 */
-			emit_literal(output, next_emit, input->curr - next_emit);
+			emit_literal(output, next_emit, input->curr - next_emit, true);
 
 			/*
 			 * Step 3: Call EmitCopy, and then see if another EmitCopy could
@@ -365,6 +697,7 @@ static void compress_block(struct host_buffer_context *input, struct host_buffer
 			 * this loop via goto if we get close to exhausting the input.
 			 */
 			uint8_t *insert_tail;
+			uint64_t tail_bytes;
 			uint32_t candidate_bytes = 0;
 
 			do {
@@ -388,16 +721,20 @@ static void compress_block(struct host_buffer_context *input, struct host_buffer
 				if (input->curr >= input_limit)
 					goto emit_remainder;
 
-				uint32_t prev_hash = hash(insert_tail, shift);
-				table[prev_hash] = input->curr - base_input - 1;
+				// One 8-byte load covers the four bytes at insert_tail,
+				// insert_tail + 1 and insert_tail + 2
+				tail_bytes = read_uint64(insert_tail);
+				uint32_t prev_hash = hash_bytes((uint32_t)tail_bytes, shift);
+				hash_table_set(table, wide, prev_hash, input->curr - table_base - 1);
 
-				uint32_t curr_hash = hash(insert_tail + 1, shift);
-				candidate = base_input + table[curr_hash];
+				uint32_t curr_hash = hash_bytes((uint32_t)(tail_bytes >> 8), shift);
+				candidate = table_base + hash_table_get(table, wide, curr_hash);
 				candidate_bytes = read_uint32(candidate);
-				table[curr_hash] = input->curr - base_input;
-			} while(read_uint32(insert_tail + 1) == candidate_bytes);
+				hash_table_set(table, wide, curr_hash, input->curr - table_base);
+			} while (((uint32_t)(tail_bytes >> 8) == candidate_bytes) &&
+					(!wide || (min_match_length(input->curr - candidate) == 4) || (input->curr[4] == candidate[4])));
 
-			next_hash = hash(insert_tail + 2, shift);
+			next_hash = hash_bytes((uint32_t)(tail_bytes >> 16), shift);
 			input->curr++;
 		}
 	}
@@ -405,310 +742,1633 @@ static void compress_block(struct host_buffer_context *input, struct host_buffer
 emit_remainder:
 	/* Emit the remaining bytes as literal */
 	if (next_emit < input_end) {
-		emit_literal(output, next_emit, input_end - next_emit);
+		emit_literal(output, next_emit, input_end - next_emit, false);
 		input->curr = input_end;
 	}
 
-	write_uint32(output_start - 4, output->curr - output_start);
+	finish_block(output, header, base_input, input_size, flags);
 }
 
+/**
+ * Matches found by the compressibility estimator, and what they compress to.
+ */
+struct estimate_counts {
+	size_t sampled;			// Bytes looked at
+	size_t matched;			// Bytes covered by copies
+	size_t compressed;		// Length of the literals and copies, without block headers
+};
 
-/*************** Public Functions *******************/
-
-void setup_compression(struct host_buffer_context *input, struct host_buffer_context *output, struct program_runtime *runtime) 
+/**
+ * Length of the copy elements emit_copy writes for a match.
+ *
+ * @param offset: offset of the copy
+ * @param len: length of the match
+ * @return Length of the copy elements
+ */
+static inline uint32_t copy_cost(uint32_t offset, uint32_t len)
 {
-	struct timeval start;
-	struct timeval end;
-	gettimeofday(&start, NULL);
-
-	/*
-	 * Compressed data can be defined as:
-	 *	  compressed := item* literal*
-	 *	  item		 := literal* copy
-	 *
-	 * The trailing literal sequence has a space blowup of at most 62/60
-	 * since a literal of length 60 needs one tag byte + one extra byte
-	 * for length information.
-	 *
-	 * Item blowup is trickier to measure.	Suppose the "copy" op copies
-	 * 4 bytes of data.  Because of a special check in the encoding code,
-	 * we produce a 4-byte copy only if the offset is < 65536.	Therefore
-	 * the copy op takes 3 bytes to encode, and this type of item leads
-	 * to at most the 62/60 blowup for representing literals.
-	 *
-	 * Suppose the "copy" op copies 5 bytes of data.  If the offset is big
-	 * enough, it will take 5 bytes to encode the copy op.	Therefore the
-	 * worst case here is a one-byte literal followed by a five-byte copy.
-	 * I.e., 6 bytes of input turn into 7 bytes of "compressed" data.
-	 *
-	 * This last factor dominates the blowup, so the final estimate is:
-	 */
-	uint32_t max_compressed_length = snappy_max_compressed_length(input->length);
-	output->buffer = malloc(sizeof(uint8_t) * max_compressed_length);
-	output->curr = output->buffer;
-	output->length = 0;
-
-	gettimeofday(&end, NULL);
-	runtime->pre = get_runtime(&start, &end);
+	uint32_t element = (offset > MAX_COPY_2_OFFSET) ? 5 : 3;
+	uint32_t cost = 0;
+	while (len >= 68) {
+		cost += element;
+		len -= 64;
+	}
+	if (len > 64) {
+		cost += element;
+		len -= 60;
+	}
+	return cost + (((len < 12) && (offset < 2048)) ? 2 : element);
 }
 
-snappy_status snappy_compress_host(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t block_size)
+/**
+ * Length of a literal element.
+ *
+ * @param len: number of literal bytes
+ * @return Length of the tag and the bytes
+ */
+static inline uint32_t literal_cost(uint32_t len)
 {
-	// Allocate the hash table for compression
-	uint16_t *table = malloc(sizeof(uint16_t) * MAX_HASH_TABLE_SIZE);
-
-	// Write the decompressed length
-	uint32_t length_remain = input->length;
-	write_varint32(output, length_remain);
+	if (len == 0)
+		return 0;
+	return len + 1 + (len > 60) + (len > 256) + (len > 65536) + (len > 16777216);
+}
 
-	// Write the decompressed block size
-	write_varint32(output, block_size);
+/**
+ * Find the matches compress_block would in a block, and add up the length of
+ * the elements it would write for them, without writing anything. Positions
+ * are hashed and looked up the same way, including skipping ahead faster the
+ * longer no match is found, so incompressible data is passed over quickly.
+ *
+ * @param block: data of the block
+ * @param length: length of the block
+ * @param table: hash table, with 32-bit entries if IS_WIDE_BLOCK(length) and
+ *               16-bit ones otherwise
+ * @param counts[in,out]: counts the block is added to
+ */
+static void estimate_block(uint8_t *block, uint32_t length, void *table, struct estimate_counts *counts)
+{
+	uint32_t table_size;
+	get_hash_table(table, length, &table_size);
+	const int32_t shift = 32 - log2_floor(table_size);
+	const bool wide = IS_WIDE_BLOCK(length);
+	const uint32_t input_margin_bytes = 15;
+	uint8_t *block_end = block + length;
+	uint8_t *next_emit = block;
+	size_t compressed = 0;
+	size_t matched = 0;
+
+	if (length >= input_margin_bytes) {
+		uint8_t *input_limit = block_end - input_margin_bytes;
+		uint8_t *ip = block + 1;
+		uint32_t skip_bytes = 32;
+		while (ip <= input_limit) {
+			uint32_t hval = hash(ip, shift);
+			uint8_t *candidate = block + hash_table_get(table, wide, hval);
+			hash_table_set(table, wide, hval, ip - block);
+
+			uint32_t offset = ip - candidate;
+			if ((read_uint32(ip) != read_uint32(candidate)) || ((min_match_length(offset) > 4) && (ip[4] != candidate[4]))) {
+				ip += skip_bytes++ >> 5;
+				continue;
+			}
 
-	while (input->curr < (input->buffer + input->length)) {
-		// Get the next block size ot compress
-		uint32_t to_compress = MIN(length_remain, block_size);
+			uint32_t len = 4 + find_match_length(candidate + 4, ip + 4, block_end);
+			compressed += literal_cost(ip - next_emit) + copy_cost(offset, len);
+			matched += len;
+			ip += len;
+			next_emit = ip;
+			skip_bytes = 32;
 
-		// Get the size of the hash table used for this block
-		uint32_t table_size;
-		get_hash_table(table, to_compress, &table_size);
-		
-		// Compress the current block
-		compress_block(input, output, to_compress, table, table_size);
-		
-		length_remain -= to_compress;
+			// Remember the last position of the match, as compress_block does
+			if (ip <= input_limit)
+				hash_table_set(table, wide, hash(ip - 1, shift), ip - 1 - block);
+		}
 	}
 
-	// Update output length
-	output->length = (output->curr - output->buffer);
+	// Blocks that do not get smaller are stored raw
+	compressed += literal_cost(block_end - next_emit);
+	if (compressed >= length) {
+		compressed = length;
+		matched = 0;
+	}
 
-	return SNAPPY_OK;
+	counts->sampled += length;
+	counts->matched += matched;
+	counts->compressed += compressed;
 }
 
-snappy_status snappy_compress_dpu(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t block_size, struct program_runtime *runtime)
+/**
+ * Add the bytes of a buffer to a histogram of byte values.
+ *
+ * @param data: bytes to count
+ * @param length: length of data
+ * @param histogram[in,out]: number of times each byte value was seen
+ */
+static void count_bytes(const uint8_t *data, size_t length, uint32_t *histogram)
 {
-	struct timeval start;
-	struct timeval end;
-	gettimeofday(&start, NULL);
-
-	// Calculate the workload of each task
-	uint32_t num_blocks = (input->length + block_size - 1) / block_size;
-	uint32_t input_blocks_per_dpu = (num_blocks + NR_DPUS - 1) / NR_DPUS;
-	uint32_t input_blocks_per_task = (num_blocks + TOTAL_NR_TASKLETS - 1) / TOTAL_NR_TASKLETS;
+	for (size_t i = 0; i < length; i++)
+		histogram[data[i]]++;
+}
 
-	uint32_t input_block_offset[NR_DPUS][NR_TASKLETS] = {0};
-	uint32_t output_offset[NR_DPUS][NR_TASKLETS] = {0};
-	
-	uint32_t dpu_idx = 0;
-	uint32_t task_idx = 0;
-	uint32_t dpu_blocks = 0;
-	for (uint32_t i = 0; i < num_blocks; i++) {
-		// If we have reached the next DPU's boundary, update the index
-		if (dpu_blocks == input_blocks_per_dpu) {
-			dpu_idx++;
-			task_idx = 0;
-			dpu_blocks = 0;
-		}
-		
-		// If we have reached the next tasks's boundary, log the offset
-		if (dpu_blocks == (input_blocks_per_task * task_idx)) {
-			input_block_offset[dpu_idx][task_idx] = i;
-			output_offset[dpu_idx][task_idx] = ALIGN(snappy_max_compressed_length(block_size * dpu_blocks), 64);
-			task_idx++;
+/**
+ * Calculate the entropy of a histogram of byte values.
+ *
+ * @param histogram: number of times each byte value was seen
+ * @param total: sum of the histogram
+ * @return Entropy in bits per byte
+ */
+static double byte_entropy(const uint32_t *histogram, size_t total)
+{
+	double entropy = 0;
+	for (uint32_t i = 0; i < 256; i++) {
+		if (histogram[i] != 0) {
+			double p = (double)histogram[i] / (double)total;
+			entropy -= p * log2(p);
 		}
+	}
+	return entropy;
+}
 
-		dpu_blocks++;
+/**
+ * Check whether a block looks random, from the entropy of a few evenly
+ * spaced bytes of it.
+ *
+ * @param block: data of the block
+ * @param length: length of the block
+ * @return True if the bytes sampled are close to random
+ */
+static bool looks_random(const uint8_t *block, uint32_t length)
+{
+	uint32_t histogram[256] = {0};
+	uint32_t stride = (length + ESTIMATE_BLOCK_SAMPLE_LENGTH - 1) / ESTIMATE_BLOCK_SAMPLE_LENGTH;
+	uint32_t sampled = 0;
+	for (uint32_t i = 0; i < length; i += stride) {
+		histogram[block[i]]++;
+		sampled++;
 	}
+	return byte_entropy(histogram, sampled) >= ESTIMATE_RANDOM_ENTROPY;
+}
 
-	// Write the decompressed block size and length
-	write_varint32(output, input->length);
-	write_varint32(output, block_size);
-	output->length = output->curr - output->buffer;
-	
-	gettimeofday(&end, NULL);
-	runtime->pre += get_runtime(&start, &end);
+/**
+ * Predict whether a block is not worth compressing. The entropy of a few
+ * evenly spaced bytes of the block is checked first, and only blocks that
+ * look random are searched for matches.
+ *
+ * @param block: data of the block
+ * @param length: length of the block
+ * @param table: hash table, with 32-bit entries if IS_WIDE_BLOCK(length)
+ * @return True if the block is predicted to save less than ESTIMATE_MIN_RATIO
+ */
+static bool is_incompressible_block(uint8_t *block, uint32_t length, void *table)
+{
+	if (!looks_random(block, length))
+		return false;
 
-	// Allocate DPUs
-	gettimeofday(&start, NULL);
-	struct dpu_set_t dpus;
-	struct dpu_set_t dpu_rank;
-	struct dpu_set_t dpu;
-	DPU_ASSERT(dpu_alloc(NR_DPUS, NULL, &dpus));
-	gettimeofday(&end, NULL);
-	runtime->d_alloc = get_runtime(&start, &end);
+	struct estimate_counts counts = {0};
+	estimate_block(block, length, table, &counts);
+	return counts.compressed > ((1 - ESTIMATE_MIN_RATIO) * length);
+}
 
-	// Load program
-	gettimeofday(&start, NULL);
-	DPU_ASSERT(dpu_load(dpus, DPU_COMPRESS_PROGRAM, NULL));
-	gettimeofday(&end, NULL);
-	runtime->load = get_runtime(&start, &end);
+/**
+ * Store a block raw, without trying to compress it.
+ *
+ * @param input: holds input buffer information
+ * @param output: holds output buffer information
+ * @param input_size: size of the block
+ * @param flags: format flags of the stream
+ */
+static void store_raw_block(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t input_size, uint32_t flags)
+{
+	uint8_t *header = output->curr;
+	output->curr += BLOCK_HEADER_LENGTH(flags);
+	memcpy(output->curr, input->curr, input_size);
+	output->curr += input_size;
+
+	write_uint32(header, input_size | (BLOCK_TYPE_RAW << BLOCK_TYPE_SHIFT));
+	if (flags & SNAPPY_FLAG_CRC32C)
+		write_uint32(header + 4, crc32c_mask(crc32c_host(CRC32C_INIT, input->curr, input_size)));
+	input->curr += input_size;
+}
 
-	// Copy variables common to all DPUs
-	gettimeofday(&start, NULL);
-#ifdef BULK_XFER
-	DPU_ASSERT(dpu_prepare_xfer(dpus, &block_size));
-       	DPU_ASSERT(dpu_push_xfer(dpus, DPU_XFER_TO_DPU, "block_size", 0, sizeof(uint32_t), DPU_XFER_DEFAULT));
-#else
-	DPU_ASSERT(dpu_copy_to(dpus, "block_size", 0, &block_size, sizeof(uint32_t)));
-#endif
-
-	dpu_idx = 0;
-	DPU_RANK_FOREACH(dpus, dpu_rank) {
-#ifdef BULK_XFER
-		uint32_t largest_input_length = 0;
-		uint32_t starting_dpu_idx = dpu_idx;
-#endif
-		DPU_FOREACH(dpu_rank, dpu) {
-			// Add check to get rid of array out of bounds compiler warning
-			if (dpu_idx >= NR_DPUS)
-				break; 
-
-			uint32_t input_length = 0;
-			if ((dpu_idx != (NR_DPUS - 1)) && (input_block_offset[dpu_idx + 1][0] != 0)) {
-				uint32_t blocks = (input_block_offset[dpu_idx + 1][0] - input_block_offset[dpu_idx][0]);
-				input_length = blocks * block_size;
-			}
-			else if ((dpu_idx == 0) || (input_block_offset[dpu_idx][0] != 0)) {
-				input_length = input->length - (input_block_offset[dpu_idx][0] * block_size);
-			} 
-			DPU_ASSERT(dpu_copy_to(dpu, "input_length", 0, &input_length, sizeof(uint32_t)));
-
-#ifdef BULK_XFER		
-			if (largest_input_length < input_length)
-				largest_input_length = input_length;
-		
-			// If all prepared transfers have a larger transfer length, push them first
-			// and then set up the next transfer
-			if (input_length < largest_input_length) {
-				DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_TO_DPU, "input_buffer", 0, ALIGN(largest_input_length, 8), DPU_XFER_DEFAULT));
-				largest_input_length = input_length;
-			}
+/**
+ * Settings of a high compression level.
+ */
+struct compress_level {
+	uint32_t max_chain;		// Most earlier positions compared for each position
+	uint32_t nice_length;	// Match length that stops the search
+	bool lazy;				// Check if the next position has a longer match before emitting a copy
+};
+
+// Settings of levels 2 to SNAPPY_MAX_LEVEL, level 1 uses compress_block
+static const struct compress_level compress_levels[SNAPPY_MAX_LEVEL - SNAPPY_MIN_LEVEL] = {
+	{ 4,	16,		false },
+	{ 8,	32,		false },
+	{ 8,	32,		true },
+	{ 16,	64,		true },
+	{ 32,	128,	true },
+	{ 64,	256,	true },
+	{ 256,	1024,	true },
+	{ 4096,	65536,	true },
+};
 
-			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)(input->curr + (input_block_offset[dpu_idx][0] * block_size))));	
-#else
-			DPU_ASSERT(dpu_copy_to(dpu, "input_block_offset", 0, input_block_offset[dpu_idx], sizeof(uint32_t) * NR_TASKLETS));
-			DPU_ASSERT(dpu_copy_to(dpu, "output_offset", 0, output_offset[dpu_idx], sizeof(uint32_t) * NR_TASKLETS));
-			DPU_ASSERT(dpu_copy_to(dpu, "input_buffer", 0, input->curr + (input_block_offset[dpu_idx][0] * block_size), ALIGN(input_length, 8)));
-#endif
-			dpu_idx++;
-		}
+/**
+ * Hash chains of the positions in a block. head holds the most recent
+ * position with each hash, and prev links each position to the previous
+ * one with the same hash. Positions are stored plus one so that 0 ends
+ * a chain.
+ */
+struct hash_chains {
+	uint32_t *head;		// Most recent position of each hash
+	uint32_t *prev;		// Previous position with the same hash, for every position
+	int32_t shift;		// Adjusts hashes to be within the size of head
+};
 
-#ifdef BULK_XFER
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_TO_DPU, "input_buffer", 0, ALIGN(largest_input_length, 8), DPU_XFER_DEFAULT));
-		
-		dpu_idx = starting_dpu_idx;
-		DPU_FOREACH(dpu_rank, dpu) {
-			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)input_block_offset[dpu_idx]));
-			dpu_idx++;
-		}
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_TO_DPU, "input_block_offset", 0, sizeof(uint32_t) * NR_TASKLETS, DPU_XFER_DEFAULT));
+/**
+ * Size the chain heads for the size we are compressing, and reset them.
+ *
+ * @param chains: hash chains to reset
+ * @param size_to_compress: size we are compressing
+ */
+static inline void get_hash_chains(struct hash_chains *chains, uint32_t size_to_compress)
+{
+	uint32_t table_size = 256;
+	while ((table_size < MAX_HASH_TABLE_SIZE) && (table_size < size_to_compress))
+		table_size <<= 1;
 
-		dpu_idx = starting_dpu_idx;
-		DPU_FOREACH(dpu_rank, dpu) {
-			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)output_offset[dpu_idx]));
-			dpu_idx++;
-		}
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_TO_DPU, "output_offset", 0, sizeof(uint32_t) * NR_TASKLETS, DPU_XFER_DEFAULT));
-#endif
-	}
+	chains->shift = 32 - log2_floor(table_size);
+	memset(chains->head, 0, table_size * sizeof(*chains->head));
+}
 
-	gettimeofday(&end, NULL);
-	runtime->copy_in = get_runtime(&start, &end);
-	
-	// Launch all DPUs
-	int ret = dpu_launch(dpus, DPU_SYNCHRONOUS);
-	if (ret != 0)
-	{
-		DPU_ASSERT(dpu_free(dpus));
-		return SNAPPY_INVALID_INPUT;
-	}
+/**
+ * Add a position of the block to the front of its hash chain.
+ *
+ * @param chains: hash chains of the block
+ * @param base: start of the history before the block
+ * @param pos: position to add
+ */
+static inline void insert_position(struct hash_chains *chains, uint8_t *base, uint32_t pos)
+{
+	uint32_t hval = hash(base + pos, chains->shift);
+	chains->prev[pos] = chains->head[hval];
+	chains->head[hval] = pos + 1;
+}
 
-	// Open the output file and write the header
-	FILE *fout = fopen(output->file_name, "w");
-	fwrite(output->buffer, sizeof(uint8_t), output->length, fout);
-	
-	// Deallocate the DPUs
-	runtime->copy_out = 0.0;
-	uint32_t max_output_length = snappy_max_compressed_length(input_blocks_per_dpu * block_size);
-	dpu_idx = 0;
-	DPU_RANK_FOREACH(dpus, dpu_rank) {
-		uint32_t starting_dpu_idx = dpu_idx;
-		gettimeofday(&start, NULL);
-
-		// Get number of DPUs in this rank
-		uint32_t nr_dpus;
-		DPU_ASSERT(dpu_get_nr_dpus(dpu_rank, &nr_dpus));
-		
-		uint8_t *dpu_bufs[NR_DPUS] = {NULL};
-		uint32_t output_length[NR_DPUS][NR_TASKLETS] = {0};
-
-#ifdef BULK_XFER
-		uint32_t largest_output_length = 0;
-		DPU_FOREACH(dpu_rank, dpu) {
-			DPU_ASSERT(dpu_prepare_xfer(dpu, output_length[dpu_idx]));
-			dpu_idx++;
+/**
+ * Find the longest match for a position by walking its hash chain. The
+ * chain is walked from the most recent position, so of two matches with
+ * the same length the one with the smaller offset is kept.
+ *
+ * @param chains: hash chains of the block
+ * @param level: settings of the compression level
+ * @param base: start of the history before the block
+ * @param pos: position to find a match for
+ * @param input_end: end of the block
+ * @param match_pos[out]: position of the longest match
+ * @return Length of the longest match, less than 4 if there is none
+ */
+static uint32_t find_longest_match(struct hash_chains *chains, const struct compress_level *level, uint8_t *base, uint32_t pos, uint8_t *input_end, uint32_t *match_pos)
+{
+	uint8_t *curr = base + pos;
+	uint32_t bytes = read_uint32(curr);
+	uint32_t max_length = input_end - curr;
+	uint32_t best_length = 0;
+
+	uint32_t next = chains->head[hash_bytes(bytes, chains->shift)];
+	for (uint32_t i = 0; (next != 0) && (i < level->max_chain); i++) {
+		uint8_t *candidate = base + next - 1;
+
+		// Only compare candidates that could be longer than the best match
+		if ((read_uint32(candidate) == bytes) && ((best_length < 4) || (candidate[best_length] == curr[best_length]))) {
+			uint32_t length = 4 + find_match_length(candidate + 4, curr + 4, input_end);
+			if (length > best_length) {
+				best_length = length;
+				*match_pos = next - 1;
+				if ((length >= level->nice_length) || (length == max_length))
+					break;
+			}
 		}
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_FROM_DPU, "output_length", 0, sizeof(uint32_t) * NR_TASKLETS, DPU_XFER_DEFAULT));
-		dpu_idx = starting_dpu_idx;
-#endif
-
-		DPU_FOREACH(dpu_rank, dpu) {
-#ifndef BULK_XFER
-			DPU_ASSERT(dpu_copy_from(dpu, "output_length", 0, output_length[dpu_idx], sizeof(uint32_t) * NR_TASKLETS));
-#endif	
-			// Calculate the total output length
-			uint32_t dpu_output_length = 0;
-			for (uint8_t i = 0; i < NR_TASKLETS; i++) {
-				if (output_length[dpu_idx][i] != 0) {
-					output->length += output_length[dpu_idx][i];
-					dpu_output_length = output_offset[dpu_idx][i] + output_length[dpu_idx][i];
-				}
+
+		next = chains->prev[next - 1];
+	}
+
+	return best_length;
+}
+
+/**
+ * Perform Snappy compression on a block of input data using hash chains,
+ * and save the compressed data to the output buffer. Produces the same
+ * format as compress_block, with longer matches at the cost of speed.
+ *
+ * @param input: holds input buffer information
+ * @param output: holds output buffer information
+ * @param input_size: size of the input to compress
+ * @param chains: hash chains with room for every position of the history and the block
+ * @param level: settings of the compression level
+ * @param history_length: length of the dictionary right before the block,
+ *                        which copies may reach back into
+ * @param flags: format flags of the stream
+ */
+static void compress_block_chains(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t input_size, struct hash_chains *chains, const struct compress_level *level, uint32_t history_length, uint32_t flags)
+{
+	uint8_t *base_input = input->curr;
+	uint8_t *input_end = input->curr + input_size;
+
+	// Positions are counted from the start of the history
+	uint8_t *base = input->curr - history_length;
+	const uint32_t end_pos = history_length + input_size;
+
+	// Make space for the block header
+	uint8_t *header = output->curr;
+	output->curr += BLOCK_HEADER_LENGTH(flags);
+
+	// Bytes in [next_emit, pos) will be emitted as literal bytes
+	uint32_t next_emit = history_length;
+	const uint32_t input_margin_bytes = 15;
+
+	if (input_size >= input_margin_bytes) {
+		const uint32_t pos_limit = end_pos - input_margin_bytes;
+
+		uint32_t pos = history_length;
+		while (pos < pos_limit) {
+			uint32_t match_pos = 0;
+			uint32_t length = find_longest_match(chains, level, base, pos, input_end, &match_pos);
+			insert_position(chains, base, pos);
+			if ((length < 4) || (length < min_match_length(pos - match_pos))) {
+				pos++;
+				continue;
 			}
 
-			// Prepare the transfer
-			dpu_bufs[dpu_idx] = malloc(max_output_length);
-#ifdef BULK_XFER
-			if (largest_output_length < dpu_output_length)
-				largest_output_length = dpu_output_length;
+			// If the next position has a longer match, emit this byte as
+			// a literal and use that match instead
+			while (level->lazy && (length < level->nice_length) && ((pos + 1) < pos_limit)) {
+				uint32_t next_match_pos = 0;
+				uint32_t next_length = find_longest_match(chains, level, base, pos + 1, input_end, &next_match_pos);
+				if (next_length <= length)
+					break;
+
+				insert_position(chains, base, ++pos);
+				length = next_length;
+				match_pos = next_match_pos;
+			}
+
+			if (next_emit < pos)
+				emit_literal(output, base + next_emit, pos - next_emit, true);
+			emit_copy(output, pos - match_pos, length);
 
-			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)dpu_bufs[dpu_idx]));
-#else
-			DPU_ASSERT(dpu_copy_from(dpu, "output_buffer", 0, dpu_bufs[dpu_idx], ALIGN(dpu_output_length, 8)));
-#endif
+			// Add the positions covered by the copy to the chains
+			uint32_t copy_end = pos + length;
+			for (pos++; pos < MIN(copy_end, pos_limit); pos++)
+				insert_position(chains, base, pos);
 
-			dpu_idx++;
+			pos = copy_end;
+			next_emit = pos;
 		}
-		
-#ifdef BULK_XFER
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_FROM_DPU, "output_buffer", 0, ALIGN(largest_output_length, 8), DPU_XFER_DEFAULT));
-#endif
-		// Don't count the time it takes to read the DPU log or write the data to a file, 
-		// since we don't count that for the host
-		gettimeofday(&end, NULL);
-		runtime->copy_out += get_runtime(&start, &end);	
-
-		// Print the logs
-		dpu_idx = starting_dpu_idx;
-		DPU_FOREACH(dpu_rank, dpu) {
-			printf("------DPU %d Logs------\n", dpu_idx);
-			DPU_ASSERT(dpu_log_read(dpu, stdout));
-			dpu_idx++;
+	}
+
+	// Emit the remaining bytes as literal
+	if (next_emit < end_pos)
+		emit_literal(output, base + next_emit, end_pos - next_emit, false);
+	input->curr = input_end;
+
+	finish_block(output, header, base_input, input_size, flags);
+}
+
+
+/**
+ * Hash tables used by one thread to compress blocks.
+ */
+struct block_compressor {
+	uint32_t flags;						// Format flags of the stream
+	const struct compress_level *level;	// Settings of the compression level, NULL for SNAPPY_MIN_LEVEL
+	void *table;						// Hash table used by SNAPPY_MIN_LEVEL, 32-bit entries for wide blocks
+	struct hash_chains chains;			// Hash chains used by the higher levels
+	const struct snappy_dictionary *dict;	// Preset dictionary, or NULL
+	uint8_t *window;					// The dictionary, followed by room for the block
+	uint16_t *dict_table;				// Hash table seeded with the dictionary
+	uint32_t *dict_head;				// Chain heads seeded with the dictionary
+	uint32_t table_size;				// Size of the seeded hash table or chain heads
+	void *estimate_table;				// Hash table used to find incompressible blocks, or NULL to compress every block
+};
+
+/**
+ * Largest history that may come right before a block: the preset dictionary,
+ * or the previous block of the group.
+ *
+ * @param opts: compression options
+ * @return Length of the largest history
+ */
+static inline uint32_t max_history_length(const struct compress_options *opts)
+{
+	if (opts->flags & SNAPPY_FLAG_CHAINED)
+		return opts->block_size;
+	return (opts->dict != NULL) ? opts->dict->length : 0;
+}
+
+/**
+ * Seed the hash table or chains of a block compressor with every position of
+ * its dictionary, and keep a copy to start each block from. The table is
+ * sized for a full block.
+ *
+ * @param compressor: block compressor with a dictionary in its window
+ * @param block_size: size of each block
+ */
+static void seed_block_compressor(struct block_compressor *compressor, uint32_t block_size)
+{
+	uint32_t dict_length = compressor->dict->length;
+	uint32_t seed_end = (dict_length >= sizeof(uint32_t)) ? (dict_length - sizeof(uint32_t) + 1) : 0;
+
+	if (compressor->level != NULL) {
+		get_hash_chains(&compressor->chains, block_size);
+		compressor->table_size = 1U << (32 - compressor->chains.shift);
+		for (uint32_t pos = 0; pos < seed_end; pos++)
+			insert_position(&compressor->chains, compressor->window, pos);
+
+		// The links of the dictionary positions never change, only the heads do
+		compressor->dict_head = malloc(sizeof(uint32_t) * compressor->table_size);
+		memcpy(compressor->dict_head, compressor->chains.head, sizeof(uint32_t) * compressor->table_size);
+	}
+	else {
+		get_hash_table(compressor->table, block_size, &compressor->table_size);
+		int32_t shift = 32 - log2_floor(compressor->table_size);
+		for (uint32_t pos = 0; pos < seed_end; pos++)
+			hash_table_set(compressor->table, false, hash(compressor->window + pos, shift), pos);
+
+		compressor->dict_table = malloc(sizeof(uint16_t) * compressor->table_size);
+		memcpy(compressor->dict_table, compressor->table, sizeof(uint16_t) * compressor->table_size);
+	}
+}
+
+/**
+ * Allocate the hash tables needed to compress blocks with a set of options.
+ *
+ * @param compressor: block compressor to set up
+ * @param opts: compression options
+ */
+static void init_block_compressor(struct block_compressor *compressor, const struct compress_options *opts)
+{
+	compressor->flags = opts->flags;
+	compressor->level = NULL;
+	compressor->table = NULL;
+	compressor->chains.head = NULL;
+	compressor->chains.prev = NULL;
+	compressor->dict = opts->dict;
+	compressor->window = NULL;
+	compressor->dict_table = NULL;
+	compressor->dict_head = NULL;
+	compressor->estimate_table = NULL;
+	uint32_t dict_length = (opts->dict != NULL) ? opts->dict->length : 0;
+	uint32_t history_length = max_history_length(opts);
+
+	// Levels above SNAPPY_MIN_LEVEL chain every position of the history and the block
+	if (opts->level > SNAPPY_MIN_LEVEL) {
+		compressor->level = &compress_levels[opts->level - SNAPPY_MIN_LEVEL - 1];
+		compressor->chains.head = malloc(sizeof(uint32_t) * MAX_HASH_TABLE_SIZE);
+		compressor->chains.prev = malloc(sizeof(uint32_t) * (history_length + opts->block_size));
+	}
+	else {
+		if (IS_WIDE_BLOCK(history_length + opts->block_size))
+			compressor->table = malloc(sizeof(uint32_t) * MAX_WIDE_HASH_TABLE_SIZE);
+		else
+			compressor->table = malloc(sizeof(uint16_t) * MAX_HASH_TABLE_SIZE);
+	}
+
+	// Blocks are copied in after the dictionary, so that matches can run
+	// from the dictionary into the block the same way the decoder sees them
+	if (opts->dict != NULL) {
+		compressor->window = malloc(dict_length + opts->block_size);
+		memcpy(compressor->window, opts->dict->data, dict_length);
+		seed_block_compressor(compressor, opts->block_size);
+	}
+
+	if (opts->skip_incompressible) {
+		if (IS_WIDE_BLOCK(opts->block_size))
+			compressor->estimate_table = malloc(sizeof(uint32_t) * MAX_WIDE_HASH_TABLE_SIZE);
+		else
+			compressor->estimate_table = malloc(sizeof(uint16_t) * MAX_HASH_TABLE_SIZE);
+	}
+}
+
+/**
+ * Free the hash tables of a block compressor.
+ *
+ * @param compressor: block compressor to free
+ */
+static void free_block_compressor(struct block_compressor *compressor)
+{
+	free(compressor->table);
+	free(compressor->chains.head);
+	free(compressor->chains.prev);
+	free(compressor->window);
+	free(compressor->dict_table);
+	free(compressor->dict_head);
+	free(compressor->estimate_table);
+}
+
+/**
+ * Compress a block behind the preset dictionary, starting from the seeded
+ * hash table or chains.
+ *
+ * @param compressor: block compressor with a dictionary
+ * @param input: holds input buffer information
+ * @param output: holds output buffer information
+ * @param to_compress: size of the block, at most the block size of the stream
+ */
+static void compress_dict_block(struct block_compressor *compressor, struct host_buffer_context *input, struct host_buffer_context *output, uint32_t to_compress)
+{
+	uint32_t dict_length = compressor->dict->length;
+	memcpy(compressor->window + dict_length, input->curr, to_compress);
+
+	struct host_buffer_context window = {
+		.buffer = compressor->window,
+		.curr = compressor->window + dict_length,
+		.length = dict_length + to_compress
+	};
+
+	if (compressor->level != NULL) {
+		memcpy(compressor->chains.head, compressor->dict_head, sizeof(uint32_t) * compressor->table_size);
+		compress_block_chains(&window, output, to_compress, &compressor->chains, compressor->level, dict_length, compressor->flags);
+	}
+	else {
+		memcpy(compressor->table, compressor->dict_table, sizeof(uint16_t) * compressor->table_size);
+		compress_block(&window, output, to_compress, compressor->table, compressor->table_size, dict_length, compressor->flags);
+	}
+	input->curr += to_compress;
+}
+
+/**
+ * Compress a block that may copy from the previous block of its group,
+ * which is right before it in memory. The hash table or chains are seeded
+ * with every position of the previous block first.
+ *
+ * @param compressor: block compressor set up for chained blocks
+ * @param input: holds input buffer information
+ * @param output: holds output buffer information
+ * @param to_compress: size of the block, at most the block size of the stream
+ * @param history_length: length of the previous block
+ */
+static void compress_chained_block(struct block_compressor *compressor, struct host_buffer_context *input, struct host_buffer_context *output, uint32_t to_compress, uint32_t history_length)
+{
+	uint8_t *history = input->curr - history_length;
+	uint32_t window_length = history_length + to_compress;
+
+	if (compressor->level != NULL) {
+		get_hash_chains(&compressor->chains, window_length);
+		for (uint32_t pos = 0; pos < history_length; pos++)
+			insert_position(&compressor->chains, history, pos);
+		compress_block_chains(input, output, to_compress, &compressor->chains, compressor->level, history_length, compressor->flags);
+	}
+	else {
+		uint32_t table_size;
+		get_hash_table(compressor->table, window_length, &table_size);
+		bool wide = IS_WIDE_BLOCK(window_length);
+		int32_t shift = 32 - log2_floor(table_size);
+		for (uint32_t pos = 0; pos < history_length; pos++)
+			hash_table_set(compressor->table, wide, hash(history + pos, shift), pos);
+		compress_block(input, output, to_compress, compressor->table, table_size, history_length, compressor->flags);
+	}
+}
+
+/**
+ * Compress the block at input->curr, as a run, Snappy data or raw data,
+ * whichever is smallest, and write it with its header to output->curr.
+ * When skipping incompressible blocks, blocks without a history that are
+ * predicted not to compress are stored raw without compressing them.
+ *
+ * @param compressor: block compressor set up for the stream
+ * @param input: holds input buffer information
+ * @param output: holds output buffer information
+ * @param to_compress: size of the block, at most the block size of the stream
+ * @param history_length: length of the previous block of the group, right
+ *                        before input->curr, or 0 if the block starts a group
+ */
+static void compress_next_block(struct block_compressor *compressor, struct host_buffer_context *input, struct host_buffer_context *output, uint32_t to_compress, uint32_t history_length)
+{
+	if (is_run_block(input->curr, to_compress)) {
+		compress_run_block(input, output, to_compress, compressor->flags);
+	}
+	else if ((compressor->estimate_table != NULL) && (compressor->dict == NULL) && (history_length == 0) &&
+			is_incompressible_block(input->curr, to_compress, compressor->estimate_table)) {
+		store_raw_block(input, output, to_compress, compressor->flags);
+	}
+	else if (compressor->dict != NULL) {
+		compress_dict_block(compressor, input, output, to_compress);
+	}
+	else if (history_length != 0) {
+		compress_chained_block(compressor, input, output, to_compress, history_length);
+	}
+	else if (compressor->level != NULL) {
+		get_hash_chains(&compressor->chains, to_compress);
+		compress_block_chains(input, output, to_compress, &compressor->chains, compressor->level, 0, compressor->flags);
+	}
+	else {
+		// Get the size of the hash table used for this block
+		uint32_t table_size;
+		get_hash_table(compressor->table, to_compress, &table_size);
+
+		// Compress the current block
+		compress_block(input, output, to_compress, compressor->table, table_size, 0, compressor->flags);
+	}
+}
+
+/*************** Public Functions *******************/
+
+void setup_compression(struct host_buffer_context *input, struct host_buffer_context *output, const struct compress_options *opts, struct program_runtime *runtime)
+{
+	struct timeval start;
+	struct timeval end;
+	gettimeofday(&start, NULL);
+
+	/*
+	 * Compressed data can be defined as:
+	 *	  compressed := item* literal*
+	 *	  item		 := literal* copy
+	 *
+	 * The trailing literal sequence has a space blowup of at most 62/60
+	 * since a literal of length 60 needs one tag byte + one extra byte
+	 * for length information.
+	 *
+	 * Item blowup is trickier to measure.	Suppose the "copy" op copies
+	 * 4 bytes of data.  Because of a special check in the encoding code,
+	 * we produce a 4-byte copy only if the offset is < 65536.	Therefore
+	 * the copy op takes 3 bytes to encode, and this type of item leads
+	 * to at most the 62/60 blowup for representing literals.
+	 *
+	 * Suppose the "copy" op copies 5 bytes of data.  If the offset is big
+	 * enough, it will take 5 bytes to encode the copy op.	Therefore the
+	 * worst case here is a one-byte literal followed by a five-byte copy.
+	 * I.e., 6 bytes of input turn into 7 bytes of "compressed" data.
+	 *
+	 * This last factor dominates the blowup, so the final estimate is
+	 * snappy_max_compressed_length, plus the stream and block headers.
+	 */
+	size_t max_compressed_length = max_compressed_stream_length(input->length, opts);
+	output->buffer = malloc(sizeof(uint8_t) * max_compressed_length);
+	output->curr = output->buffer;
+	output->length = 0;
+
+	gettimeofday(&end, NULL);
+	runtime->pre = get_runtime(&start, &end);
+}
+
+/**
+ * Work given to one host compression thread.
+ */
+struct compress_worker {
+	struct host_buffer_context *input;
+	const struct compress_options *opts;
+	uint32_t first_block;		// First block this thread compresses
+	uint32_t last_block;		// One past the last block this thread compresses
+	uint8_t *out;				// Where this thread writes its compressed blocks
+	uint8_t *dest;				// Where the compressed blocks end up in the stream
+	uint32_t *compressed_size;	// Compressed size of each block, including its header
+	size_t length;				// Total length of the compressed blocks of this thread
+};
+
+/**
+ * Compress a contiguous range of blocks with a hash table owned by this
+ * thread, and record the compressed size of each block.
+ *
+ * @param arg: struct compress_worker describing the range
+ * @return NULL
+ */
+static void *compress_worker_fn(void *arg)
+{
+	struct compress_worker *worker = arg;
+	uint32_t block_size = worker->opts->block_size;
+
+	struct host_buffer_context input = *worker->input;
+	input.curr = input.buffer + (size_t)worker->first_block * block_size;
+
+	struct host_buffer_context output;
+	output.buffer = worker->out;
+	output.curr = worker->out;
+
+	struct block_compressor compressor;
+	init_block_compressor(&compressor, worker->opts);
+	for (uint32_t i = worker->first_block; i < worker->last_block; i++) {
+		uint8_t *block_start = output.curr;
+		uint32_t to_compress = MIN(input.length - (size_t)i * block_size, block_size);
+
+		compress_next_block(&compressor, &input, &output, to_compress, get_chain_history(worker->opts, i));
+		worker->compressed_size[i] = output.curr - block_start;
+	}
+	free_block_compressor(&compressor);
+
+	worker->length = output.curr - output.buffer;
+	return NULL;
+}
+
+/**
+ * Move the compressed blocks of one thread from its private output region
+ * to their place in the stream.
+ *
+ * @param arg: struct compress_worker describing the range
+ * @return NULL
+ */
+static void *pack_worker_fn(void *arg)
+{
+	struct compress_worker *worker = arg;
+	if (worker->out != worker->dest)
+		memcpy(worker->dest, worker->out, worker->length);
+	return NULL;
+}
+
+snappy_status snappy_compress_host(struct host_buffer_context *input, struct host_buffer_context *output, const struct compress_options *opts)
+{
+	uint32_t block_size = opts->block_size;
+	uint32_t num_blocks = (input->length + block_size - 1) / block_size;
+	snappy_status status = SNAPPY_OK;
+
+	if (!check_options(opts))
+		return SNAPPY_INVALID_INPUT;
+
+	// Write the decompressed length, format flags and block size
+	write_stream_header(output, input->length, opts);
+
+	// Give each thread a contiguous range of whole groups of blocks
+	uint32_t group_blocks = get_group_blocks(opts);
+	uint32_t num_groups = num_blocks / group_blocks + ((num_blocks % group_blocks) != 0);
+	uint32_t nr_threads = opts->nr_threads;
+	if (nr_threads > num_groups)
+		nr_threads = (num_groups == 0) ? 1 : num_groups;
+	else if (nr_threads == 0)
+		nr_threads = 1;
+	uint32_t blocks_per_thread = (num_groups + nr_threads - 1) / nr_threads * group_blocks;
+
+	// The first thread writes straight into the stream, the others write
+	// into a private region that can hold the worst case of their blocks
+	size_t max_block_length = snappy_max_compressed_length(block_size) + BLOCK_HEADER_LENGTH(opts->flags);
+	size_t private_length = 0;
+	if (nr_threads > 1)
+		private_length = (size_t)(nr_threads - 1) * blocks_per_thread * max_block_length + COMPRESS_OUTPUT_SLOP;
+	uint8_t *private_out = malloc(private_length);
+	uint32_t *compressed_size = malloc(sizeof(uint32_t) * (num_blocks + 1));
+
+	struct compress_worker *workers = malloc(sizeof(struct compress_worker) * nr_threads);
+	for (uint32_t i = 0; i < nr_threads; i++) {
+		workers[i].input = input;
+		workers[i].opts = opts;
+		workers[i].first_block = MIN(i * blocks_per_thread, num_blocks);
+		workers[i].last_block = MIN((i + 1) * blocks_per_thread, num_blocks);
+		if (i == 0)
+			workers[i].out = output->curr;
+		else
+			workers[i].out = private_out + (size_t)(i - 1) * blocks_per_thread * max_block_length;
+		workers[i].compressed_size = compressed_size;
+		workers[i].length = 0;
+	}
+
+	if (run_host_threads(nr_threads, compress_worker_fn, workers, sizeof(struct compress_worker)))
+		status = SNAPPY_BUFFER_TOO_SMALL;
+
+	// Prefix sum of the block sizes gives where each thread's blocks go
+	if (status == SNAPPY_OK) {
+		uint8_t *dest = output->curr;
+		uint32_t block = 0;
+		for (uint32_t i = 0; i < nr_threads; i++) {
+			workers[i].dest = dest;
+			for (; block < workers[i].last_block; block++)
+				dest += compressed_size[block];
 		}
 
-		for (uint32_t d = nr_dpus; d > 0; d--) {
-			uint32_t curr_dpu_idx = dpu_idx - d;
-			for (uint8_t i = 0; i < NR_TASKLETS; i++) {
-				fwrite(&dpu_bufs[curr_dpu_idx][output_offset[curr_dpu_idx][i]], sizeof(uint8_t), output_length[curr_dpu_idx][i], fout);
+		if (run_host_threads(nr_threads, pack_worker_fn, workers, sizeof(struct compress_worker)))
+			status = SNAPPY_BUFFER_TOO_SMALL;
+		output->curr = dest;
+	}
+
+	// Update output length
+	input->curr = input->buffer + input->length;
+	output->length = (output->curr - output->buffer);
+
+	free(workers);
+	free(compressed_size);
+	free(private_out);
+	return status;
+}
+
+/**
+ * Predict the compression ratio of a block size by compressing the sample
+ * windows of the input with it.
+ *
+ * @param input: holds input buffer information
+ * @param opts: compression options, with the block size to try
+ * @param window_start: offset of each sample window
+ * @param num_windows: number of sample windows
+ * @param window_length: length of each sample window
+ * @return Predicted compression ratio, including the block headers
+ */
+static double predict_ratio(struct host_buffer_context *input, const struct compress_options *opts, const size_t *window_start, uint32_t num_windows, uint32_t window_length)
+{
+	struct block_compressor compressor;
+	init_block_compressor(&compressor, opts);
+
+	struct host_buffer_context output;
+	output.buffer = malloc(snappy_max_compressed_length(opts->block_size) + BLOCK_HEADER_LENGTH(opts->flags) + COMPRESS_OUTPUT_SLOP);
+
+	size_t sampled = 0;
+	size_t compressed = 0;
+	for (uint32_t i = 0; i < num_windows; i++) {
+		struct host_buffer_context window = *input;
+		window.curr = input->buffer + window_start[i];
+
+		// Each window starts a group of chained blocks
+		uint32_t remain = window_length;
+		for (uint32_t block = 0; remain; block++) {
+			uint32_t to_compress = MIN(remain, opts->block_size);
+			output.curr = output.buffer;
+			compress_next_block(&compressor, &window, &output, to_compress, get_chain_history(opts, block));
+
+			compressed += output.curr - output.buffer;
+			sampled += to_compress;
+			remain -= to_compress;
+		}
+	}
+
+	free(output.buffer);
+	free_block_compressor(&compressor);
+	return 1 - (double)compressed / (double)sampled;
+}
+
+uint32_t snappy_choose_block_size(struct host_buffer_context *input, const struct compress_options *opts, uint32_t nr_units, double min_ratio, double *predicted_ratio)
+{
+	*predicted_ratio = 0;
+	if (input->length == 0)
+		return AUTO_MAX_BLOCK_SIZE;
+	if (nr_units == 0)
+		nr_units = 1;
+
+	// Sample a few windows spread evenly over the input, or all of it if it is small
+	size_t window_start[AUTO_SAMPLE_WINDOWS];
+	uint32_t num_windows;
+	uint32_t window_length;
+	if (input->length <= (AUTO_SAMPLE_WINDOWS * AUTO_SAMPLE_LENGTH)) {
+		num_windows = 1;
+		window_start[0] = 0;
+		window_length = input->length;
+	}
+	else {
+		num_windows = AUTO_SAMPLE_WINDOWS;
+		window_length = AUTO_SAMPLE_LENGTH;
+		for (uint32_t i = 0; i < num_windows; i++)
+			window_start[i] = (input->length - window_length) / (num_windows - 1) * i;
+	}
+
+	// Predict the ratio of every block size, and how much input the busiest
+	// thread or tasklet gets with it
+	uint32_t num_sizes = log2_floor(AUTO_MAX_BLOCK_SIZE / AUTO_MIN_BLOCK_SIZE) + 1;
+
+	// A block must fit next to the preset dictionary
+	while ((num_sizes > 1) && (opts->dict != NULL) &&
+			((opts->dict->length + (AUTO_MIN_BLOCK_SIZE << (num_sizes - 1))) > SNAPPY_MAX_DICT_WINDOW))
+		num_sizes--;
+	double ratio[num_sizes];
+	size_t busiest[num_sizes];
+	double best_ratio = -1;
+	struct compress_options try_opts = *opts;
+	for (uint32_t i = 0; i < num_sizes; i++) {
+		try_opts.block_size = AUTO_MIN_BLOCK_SIZE << i;
+		ratio[i] = predict_ratio(input, &try_opts, window_start, num_windows, window_length);
+		if (ratio[i] > best_ratio)
+			best_ratio = ratio[i];
+
+		size_t num_blocks = (input->length + try_opts.block_size - 1) / try_opts.block_size;
+		size_t num_groups = (num_blocks + get_group_blocks(opts) - 1) / get_group_blocks(opts);
+		size_t blocks_per_unit = (num_groups + nr_units - 1) / nr_units * get_group_blocks(opts);
+		busiest[i] = MIN(blocks_per_unit * try_opts.block_size, input->length);
+	}
+
+	// Incompressible input is stored raw whatever the block size, so then any will do
+	if (min_ratio < 0)
+		min_ratio = (best_ratio > 0) ? (AUTO_DEFAULT_RATIO_FRACTION * best_ratio) : -1;
+
+	// Of the block sizes that reach the minimum ratio, find the best balanced
+	// one. If none of them do, fall back to the one with the best ratio.
+	size_t min_busiest = 0;
+	for (uint32_t i = 0; i < num_sizes; i++) {
+		if ((ratio[i] >= min_ratio) && ((min_busiest == 0) || (busiest[i] < min_busiest)))
+			min_busiest = busiest[i];
+	}
+
+	// Of the block sizes that balance about as well, take the one with the best ratio
+	uint32_t chosen = 0;
+	double chosen_ratio = -1;
+	for (uint32_t i = 0; i < num_sizes; i++) {
+		bool fast_enough = (min_busiest == 0) || ((ratio[i] >= min_ratio) && (busiest[i] <= (AUTO_BALANCE_SLACK * min_busiest)));
+		if (fast_enough && (ratio[i] >= chosen_ratio)) {
+			chosen = i;
+			chosen_ratio = ratio[i];
+		}
+	}
+
+	printf("Block size candidates for %u threads or tasklets, minimum ratio %f:\n", nr_units, min_ratio);
+	for (uint32_t i = 0; i < num_sizes; i++) {
+		printf("  %6u: predicted ratio %f, busiest unit %zu bytes%s\n", AUTO_MIN_BLOCK_SIZE << i,
+				ratio[i], busiest[i], (i == chosen) ? " (chosen)" : "");
+	}
+
+	*predicted_ratio = ratio[chosen];
+	return AUTO_MIN_BLOCK_SIZE << chosen;
+}
+
+void snappy_estimate_ratio(struct host_buffer_context *input, const struct compress_options *opts, struct snappy_estimate *estimate)
+{
+	uint32_t histogram[256] = {0};
+	struct estimate_counts counts = {0};
+
+	// Sample the start of blocks spread evenly over the input, or every block if there are few
+	uint32_t block_size = opts->block_size;
+	uint32_t window_length = MIN(block_size, ESTIMATE_MAX_WINDOW_LENGTH);
+	size_t num_blocks = (input->length + block_size - 1) / block_size;
+	size_t num_windows = ESTIMATE_SAMPLE_LENGTH / window_length;
+	if (num_windows < ESTIMATE_MIN_WINDOWS)
+		num_windows = ESTIMATE_MIN_WINDOWS;
+	if (num_windows > num_blocks)
+		num_windows = num_blocks;
+	void *table = malloc(IS_WIDE_BLOCK(window_length) ? (sizeof(uint32_t) * MAX_WIDE_HASH_TABLE_SIZE) : (sizeof(uint16_t) * MAX_HASH_TABLE_SIZE));
+	for (size_t i = 0; i < num_windows; i++) {
+		size_t start = num_blocks * i / num_windows * block_size;
+		uint32_t to_compress = MIN(input->length - start, block_size);
+		uint32_t length = MIN(window_length, to_compress);
+		count_bytes(input->buffer + start, length, histogram);
+
+		// Runs are stored in one byte
+		if (is_run_block(input->buffer + start, to_compress)) {
+			counts.sampled += length;
+			counts.matched += length;
+			counts.compressed += 1;
+		}
+		else {
+			estimate_block(input->buffer + start, length, table, &counts);
+		}
+	}
+	free(table);
+
+	estimate->sampled = counts.sampled;
+	if (counts.sampled == 0) {
+		estimate->ratio = 0;
+		estimate->entropy = 0;
+		estimate->match_fraction = 0;
+		return;
+	}
+	estimate->ratio = 1 - (double)counts.compressed / (double)counts.sampled - (double)BLOCK_HEADER_LENGTH(opts->flags) / (double)block_size;
+	estimate->entropy = byte_entropy(histogram, counts.sampled);
+	estimate->match_fraction = (double)counts.matched / (double)counts.sampled;
+}
+
+/**
+ * State of an incremental compression. Input is gathered one block at a time
+ * and the compressed output waits in a buffer that holds the stream header,
+ * one compressed block and the end of the stream, until the caller takes it.
+ */
+struct snappy_compress_stream {
+	struct compress_options opts;
+	struct block_compressor compressor;
+	uint8_t *window;			// The previous block of the group with SNAPPY_FLAG_CHAINED, followed by block
+	uint8_t *block;				// Input gathered for the next block
+	uint32_t block_length;		// Length of the input gathered in block
+	uint8_t *pending;			// Compressed output not yet handed to the caller
+	size_t pending_capacity;	// Allocated length of pending
+	size_t pending_start;		// First byte of pending not yet handed to the caller
+	size_t pending_end;			// End of the compressed output in pending
+	uint64_t total_length;		// Decompressed length of the blocks compressed so far
+	bool finished;				// The end of the stream has been written to pending
+};
+
+/**
+ * Hand as much of the pending compressed output as fits to the caller.
+ *
+ * @param stream: compression stream
+ * @param out: caller's output buffer
+ * @param out_length: length of out
+ * @param produced[in,out]: bytes of out already used, updated
+ */
+static void drain_compress_stream(struct snappy_compress_stream *stream, uint8_t *out, size_t out_length, size_t *produced)
+{
+	size_t len = MIN(stream->pending_end - stream->pending_start, out_length - *produced);
+	if (len != 0)
+		memcpy(out + *produced, stream->pending + stream->pending_start, len);
+	stream->pending_start += len;
+	*produced += len;
+
+	if (stream->pending_start == stream->pending_end) {
+		stream->pending_start = 0;
+		stream->pending_end = 0;
+	}
+}
+
+/**
+ * Check if the pending buffer has room for one more compressed block and the
+ * end of the stream.
+ *
+ * @param stream: compression stream
+ * @return True if another block can be compressed
+ */
+static inline bool compress_stream_has_room(struct snappy_compress_stream *stream)
+{
+	size_t max_block_length = snappy_max_compressed_length(stream->opts.block_size) + BLOCK_HEADER_LENGTH(stream->opts.flags) + COMPRESS_OUTPUT_SLOP;
+	return (stream->pending_capacity - stream->pending_end) >= (max_block_length + STREAM_TRAILER_LENGTH);
+}
+
+/**
+ * Compress one block and add it to the pending output.
+ *
+ * @param stream: compression stream, with room for the block
+ * @param block: decompressed data of the block
+ * @param length: length of the block
+ */
+static void compress_stream_block(struct snappy_compress_stream *stream, uint8_t *block, uint32_t length)
+{
+	struct host_buffer_context input = {
+		.buffer = block,
+		.curr = block,
+		.length = length
+	};
+	struct host_buffer_context output = {
+		.buffer = stream->pending,
+		.curr = stream->pending + stream->pending_end
+	};
+
+	uint32_t block_size = stream->opts.block_size;
+	compress_next_block(&stream->compressor, &input, &output, length, get_chain_history(&stream->opts, stream->total_length / block_size));
+	stream->pending_end = output.curr - stream->pending;
+	stream->total_length += length;
+
+	// Keep the block right before the next one, which may copy from it
+	if ((stream->opts.flags & SNAPPY_FLAG_CHAINED) && (length == block_size))
+		memcpy(stream->window, block, block_size);
+}
+
+struct snappy_compress_stream *snappy_compress_stream_init(const struct compress_options *opts)
+{
+	if ((opts->block_size == 0) || !check_options(opts))
+		return NULL;
+
+	struct snappy_compress_stream *stream = malloc(sizeof(struct snappy_compress_stream));
+	stream->opts = *opts;
+	stream->opts.flags |= SNAPPY_FLAG_STREAM;
+	init_block_compressor(&stream->compressor, &stream->opts);
+
+	uint32_t history_length = (opts->flags & SNAPPY_FLAG_CHAINED) ? opts->block_size : 0;
+	stream->window = malloc(history_length + opts->block_size);
+	stream->block = stream->window + history_length;
+	stream->block_length = 0;
+
+	size_t max_block_length = snappy_max_compressed_length(opts->block_size) + BLOCK_HEADER_LENGTH(stream->opts.flags) + COMPRESS_OUTPUT_SLOP;
+	stream->pending_capacity = STREAM_HEADER_LENGTH + max_block_length + STREAM_TRAILER_LENGTH;
+	stream->pending = malloc(stream->pending_capacity);
+	stream->total_length = 0;
+	stream->finished = false;
+
+	// The decompressed length is written at the end of the stream
+	struct host_buffer_context output = {
+		.buffer = stream->pending,
+		.curr = stream->pending
+	};
+	write_stream_header(&output, 0, &stream->opts);
+	stream->pending_start = 0;
+	stream->pending_end = output.curr - output.buffer;
+
+	return stream;
+}
+
+snappy_status snappy_compress_stream_feed(struct snappy_compress_stream *stream, const uint8_t *in, size_t in_length, size_t *consumed, uint8_t *out, size_t out_length, size_t *produced)
+{
+	uint32_t block_size = stream->opts.block_size;
+	*consumed = 0;
+	*produced = 0;
+	if (stream->finished)
+		return SNAPPY_INVALID_INPUT;
+
+	while (true) {
+		drain_compress_stream(stream, out, out_length, produced);
+		if (!compress_stream_has_room(stream))
+			break;
+
+		if (stream->block_length == block_size) {
+			compress_stream_block(stream, stream->block, block_size);
+			stream->block_length = 0;
+		}
+		else if (*consumed == in_length) {
+			break;
+		}
+		else if ((stream->block_length == 0) && ((in_length - *consumed) >= block_size) && !(stream->opts.flags & SNAPPY_FLAG_CHAINED)) {
+			// Whole blocks are compressed straight from the caller's buffer,
+			// unless they need the previous block right before them
+			compress_stream_block(stream, (uint8_t *)in + *consumed, block_size);
+			*consumed += block_size;
+		}
+		else {
+			uint32_t len = MIN(block_size - stream->block_length, in_length - *consumed);
+			memcpy(stream->block + stream->block_length, in + *consumed, len);
+			stream->block_length += len;
+			*consumed += len;
+		}
+	}
+
+	return SNAPPY_OK;
+}
+
+snappy_status snappy_compress_stream_flush(struct snappy_compress_stream *stream, uint8_t *out, size_t out_length, size_t *produced)
+{
+	size_t consumed;
+	snappy_status status = snappy_compress_stream_feed(stream, NULL, 0, &consumed, out, out_length, produced);
+	if (status != SNAPPY_OK)
+		return status;
+
+	bool done = (stream->pending_end == 0) && (stream->block_length < stream->opts.block_size);
+	return done ? SNAPPY_OK : SNAPPY_BUFFER_TOO_SMALL;
+}
+
+snappy_status snappy_compress_stream_finish(struct snappy_compress_stream *stream, uint8_t *out, size_t out_length, size_t *produced)
+{
+	*produced = 0;
+	if (!stream->finished) {
+		size_t consumed;
+		snappy_compress_stream_feed(stream, NULL, 0, &consumed, out, out_length, produced);
+		if (!compress_stream_has_room(stream))
+			return SNAPPY_BUFFER_TOO_SMALL;
+
+		// Compress the last, partial block and end the stream
+		if (stream->block_length != 0)
+			compress_stream_block(stream, stream->block, stream->block_length);
+		stream->block_length = 0;
+
+		struct host_buffer_context output = {
+			.buffer = stream->pending,
+			.curr = stream->pending + stream->pending_end
+		};
+		write_uint32(output.curr, STREAM_END_MARKER);
+		output.curr += sizeof(uint32_t);
+		write_varint64(&output, stream->total_length);
+		stream->pending_end = output.curr - output.buffer;
+		stream->finished = true;
+	}
+
+	drain_compress_stream(stream, out, out_length, produced);
+	return (stream->pending_end == 0) ? SNAPPY_OK : SNAPPY_BUFFER_TOO_SMALL;
+}
+
+void snappy_compress_stream_free(struct snappy_compress_stream *stream)
+{
+	if (stream == NULL)
+		return;
+
+	free_block_compressor(&stream->compressor);
+	free(stream->window);
+	free(stream->pending);
+	free(stream);
+}
+
+/**
+ * Fold the masked checksums of a range of input blocks into a running fold,
+ * the same way a DPU tasklet does for the blocks it compresses.
+ *
+ * @param data: first block of the range
+ * @param length: length of the range
+ * @param block_size: size of each block
+ * @param crc_fold: running fold, starting at CRC32C_INIT
+ * @return Updated running fold
+ */
+static uint32_t fold_block_crcs(const uint8_t *data, uint32_t length, uint32_t block_size, uint32_t crc_fold)
+{
+	for (uint32_t offset = 0; offset < length; offset += block_size) {
+		uint32_t len = MIN(block_size, length - offset);
+		crc_fold = crc32c_update_word(crc_fold, crc32c_mask(crc32c_host(CRC32C_INIT, data + offset, len)));
+	}
+	return crc_fold;
+}
+
+/**
+ * Estimate the cycles a DPU tasklet takes to compress a range of blocks.
+ * Blocks of one repeated byte are only read, and blocks that look random
+ * find few matches.
+ *
+ * @param data: first block of the range
+ * @param length: length of the range
+ * @param block_size: size of each block
+ * @return Estimated cycles, see DPU_COMPRESS_BYTE_CYCLES
+ */
+static uint32_t estimate_dpu_compress_work(const uint8_t *data, uint32_t length, uint32_t block_size)
+{
+	uint32_t work = 0;
+	for (uint32_t offset = 0; offset < length; offset += block_size) {
+		uint32_t len = MIN(block_size, length - offset);
+		uint32_t byte_cycles = DPU_COMPRESS_BYTE_CYCLES;
+		if (is_run_block(data + offset, len))
+			byte_cycles = DPU_COMPRESS_RUN_BYTE_CYCLES;
+		else if (looks_random(data + offset, len))
+			byte_cycles = DPU_COMPRESS_RANDOM_BYTE_CYCLES;
+		work += DPU_COMPRESS_BLOCK_CYCLES + byte_cycles * len;
+	}
+	return work;
+}
+
+/**
+ * A compression job on the DPUs, for any number of inputs, split into whole
+ * groups of blocks for each DPU and task.
+ */
+struct dpu_compress_job {
+	struct host_buffer_context *inputs;		// Input of each file
+	struct host_buffer_context *outputs;	// Output of each file, the blocks are appended at curr
+	struct dpu_batch batch;					// Jobs of each DPU and task
+	struct program_runtime *runtime;		// Time spent on each part
+};
+
+/**
+ * Copy the input blocks and jobs of the DPUs of a rank in.
+ */
+static void compress_copy_in(struct dpu_set_t dpu_rank, uint32_t dpu_idx, void *arg)
+{
+	struct dpu_compress_job *job = arg;
+	struct dpu_batch *batch = &job->batch;
+
+	uint32_t nr_dpus;
+	DPU_ASSERT(dpu_get_nr_dpus(dpu_rank, &nr_dpus));
+	uint8_t **buffers = malloc(sizeof(uint8_t *) * nr_dpus);
+	uint32_t *lengths = malloc(sizeof(uint32_t) * nr_dpus);
+	bool *gathered = malloc(sizeof(bool) * nr_dpus);
+
+	uint32_t largest_input_length = 0;
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		if (largest_input_length < batch->input_length[dpu_idx + i])
+			largest_input_length = batch->input_length[dpu_idx + i];
+	}
+
+	// Every DPU is sent the longest input, see dpu_context_xfer
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		gathered[i] = false;
+		lengths[i] = (batch->input_length[dpu_idx + i] != 0) ? ALIGN(largest_input_length, 8) : 0;
+		if (lengths[i] != 0)
+			buffers[i] = dpu_batch_input(batch, dpu_idx + i, job->inputs, lengths[i], &gathered[i]);
+	}
+	job->runtime->copy_in_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_TO_DPU, "input_buffer", buffers, lengths);
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		if (gathered[i])
+			free(buffers[i]);
+	}
+
+	uint32_t largest_jobs = 0;
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		if (largest_jobs < DPU_BATCH_NR_JOBS(batch, dpu_idx + i))
+			largest_jobs = DPU_BATCH_NR_JOBS(batch, dpu_idx + i);
+	}
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		buffers[i] = (uint8_t *)&batch->jobs[batch->first_job[dpu_idx + i]];
+		lengths[i] = (DPU_BATCH_NR_JOBS(batch, dpu_idx + i) != 0) ? (sizeof(struct dpu_job) * largest_jobs) : 0;
+	}
+	job->runtime->copy_in_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_TO_DPU, "job_table", buffers, lengths);
+
+	// Every other value the DPUs read is in their parameters
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		buffers[i] = (uint8_t *)&batch->params[dpu_idx + i];
+		lengths[i] = sizeof(struct dpu_params);
+	}
+	job->runtime->copy_in_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_TO_DPU, "params", buffers, lengths);
+
+	free(buffers);
+	free(lengths);
+	free(gathered);
+}
+
+/**
+ * Checksum the input on the host while the DPUs run, the same way each
+ * task does for the blocks it compresses.
+ */
+static void compress_expected_crcs(void *arg)
+{
+	struct dpu_compress_job *job = arg;
+	struct dpu_batch *batch = &job->batch;
+	if (!(batch->flags & SNAPPY_FLAG_CRC32C))
+		return;
+
+	for (uint32_t i = 0; i < batch->nr_jobs; i++) {
+		struct dpu_job *dpu_job = &batch->jobs[i];
+		struct dpu_job_source *source = &batch->sources[i];
+		uint32_t *crc_fold = DPU_BATCH_JOB_CRC_FOLD(batch, i);
+		*crc_fold = fold_block_crcs(job->inputs[dpu_job->file].buffer + source->input_start, dpu_job->input_length, dpu_job->block_size, *crc_fold);
+	}
+}
+
+/**
+ * Copy the compressed blocks of the DPUs of a rank out, check the input they
+ * compressed against the checksums calculated by the host, and append the
+ * blocks of each job to the output of its file.
+ */
+static snappy_status compress_copy_out(struct dpu_set_t dpu_rank, uint32_t dpu_idx, void *arg)
+{
+	struct dpu_compress_job *job = arg;
+	struct dpu_batch *batch = &job->batch;
+	struct dpu_set_t dpu;
+	struct timeval start;
+	struct timeval end;
+	snappy_status status = SNAPPY_OK;
+
+	gettimeofday(&start, NULL);
+
+	// Get number of DPUs in this rank
+	uint32_t nr_dpus;
+	DPU_ASSERT(dpu_get_nr_dpus(dpu_rank, &nr_dpus));
+	uint8_t **buffers = malloc(sizeof(uint8_t *) * nr_dpus);
+	uint32_t *lengths = malloc(sizeof(uint32_t) * nr_dpus);
+
+	// Check the input each task compressed against the checksums calculated by the host
+	if (batch->flags & SNAPPY_FLAG_CRC32C) {
+		uint32_t *input_crc = malloc(sizeof(uint32_t) * DPU_TASKLET_CRCS * nr_dpus);
+		for (uint32_t i = 0; i < nr_dpus; i++) {
+			buffers[i] = (uint8_t *)&input_crc[DPU_TASKLET_CRCS * i];
+			lengths[i] = sizeof(uint32_t) * DPU_TASKLET_CRCS;
+		}
+		job->runtime->copy_out_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_FROM_DPU, "input_crc", buffers, lengths);
+		for (uint32_t i = 0; i < nr_dpus; i++) {
+			if (!dpu_batch_check_crcs(batch, dpu_idx + i, &input_crc[DPU_TASKLET_CRCS * i]))
+				status = SNAPPY_INVALID_INPUT;
+		}
+		free(input_crc);
+	}
+
+	// Get the output length of each job back
+	uint32_t largest_jobs = 0;
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		if (largest_jobs < DPU_BATCH_NR_JOBS(batch, dpu_idx + i))
+			largest_jobs = DPU_BATCH_NR_JOBS(batch, dpu_idx + i);
+	}
+	struct dpu_job *results = malloc(sizeof(struct dpu_job) * largest_jobs * nr_dpus);
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		buffers[i] = (uint8_t *)&results[largest_jobs * i];
+		lengths[i] = (DPU_BATCH_NR_JOBS(batch, dpu_idx + i) != 0) ? (sizeof(struct dpu_job) * largest_jobs) : 0;
+	}
+	job->runtime->copy_out_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_FROM_DPU, "job_table", buffers, lengths);
+
+	// Find where the output of each job goes in its file: the jobs of a file
+	// are in order, so each one starts where the one before it ends
+	uint8_t **dests = malloc(sizeof(uint8_t *) * largest_jobs * nr_dpus);
+	uint8_t **file_ends = malloc(sizeof(uint8_t *) * largest_jobs * nr_dpus);
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		uint32_t dpu_jobs = DPU_BATCH_NR_JOBS(batch, dpu_idx + i);
+		const struct dpu_job *jobs = &batch->jobs[batch->first_job[dpu_idx + i]];
+		for (uint32_t j = 0; j < dpu_jobs; j++) {
+			struct host_buffer_context *output = &job->outputs[jobs[j].file];
+			dests[largest_jobs * i + j] = output->curr;
+			output->curr += results[largest_jobs * i + j].output_length;
+		}
+
+		// Where the output of the DPU's jobs of each file ends
+		for (uint32_t j = dpu_jobs; j-- > 0;) {
+			bool last = ((j + 1) == dpu_jobs) || (jobs[j + 1].file != jobs[j].file);
+			file_ends[largest_jobs * i + j] = last ? (dests[largest_jobs * i + j] + results[largest_jobs * i + j].output_length) : file_ends[largest_jobs * i + j + 1];
+		}
+	}
+
+	// Copy the output of each tasklet out in turn when it is at the same
+	// offset on every DPU, otherwise all of each DPU's output at once
+	uint32_t nr_regions = (batch->task_offset != NULL) ? batch->nr_tasklets : 1;
+	uint32_t *first = malloc(sizeof(uint32_t) * nr_dpus);
+	uint32_t *last = malloc(sizeof(uint32_t) * nr_dpus);
+	bool *staged = malloc(sizeof(bool) * nr_dpus);
+	for (uint32_t region = 0; region < nr_regions; region++) {
+		uint32_t offset = (batch->task_offset != NULL) ? batch->task_offset[region] : 0;
+		uint32_t largest_output_length = 0;
+		for (uint32_t i = 0; i < nr_dpus; i++) {
+			const uint32_t *task_jobs = DPU_BATCH_TASK_JOBS(batch, dpu_idx + i);
+			first[i] = (batch->task_offset != NULL) ? task_jobs[region] : 0;
+			last[i] = (batch->task_offset != NULL) ? task_jobs[region + 1] : DPU_BATCH_NR_JOBS(batch, dpu_idx + i);
+			lengths[i] = 0;
+			for (uint32_t j = first[i]; j < last[i]; j++) {
+				struct dpu_job *result = &results[largest_jobs * i + j];
+				if (lengths[i] < (result->output_offset + result->output_length - offset))
+					lengths[i] = result->output_offset + result->output_length - offset;
+			}
+			if (largest_output_length < lengths[i])
+				largest_output_length = lengths[i];
+		}
+
+		// Every DPU sends the longest output, see dpu_context_xfer. The output
+		// of a single job goes straight to its file when the padding after it
+		// lands on output of the same file that is copied out later,
+		// otherwise it is staged in one buffer for the rank.
+		uint32_t length = ALIGN(largest_output_length, 8);
+		uint32_t nr_staged = 0;
+		for (uint32_t i = 0; i < nr_dpus; i++) {
+			uint32_t j = largest_jobs * i + first[i];
+			lengths[i] = (last[i] != first[i]) ? length : 0;
+			staged[i] = (lengths[i] != 0) && (((last[i] - first[i]) != 1) || (results[j].output_offset != offset) || ((dests[j] + length) > file_ends[j]));
+			if (staged[i])
+				nr_staged++;
+		}
+		uint8_t *staging = (nr_staged != 0) ? malloc((size_t)length * nr_staged) : NULL;
+		nr_staged = 0;
+		for (uint32_t i = 0; i < nr_dpus; i++)
+			buffers[i] = staged[i] ? (staging + (size_t)length * nr_staged++) : dests[largest_jobs * i + first[i]];
+		job->runtime->copy_out_bytes += dpu_context_xfer_at(dpu_rank, DPU_XFER_FROM_DPU, "output_buffer", offset, buffers, lengths);
+
+		for (uint32_t i = 0; i < nr_dpus; i++) {
+			if (!staged[i])
+				continue;
+			for (uint32_t j = first[i]; j < last[i]; j++) {
+				struct dpu_job *result = &results[largest_jobs * i + j];
+				memcpy(dests[largest_jobs * i + j], buffers[i] + (result->output_offset - offset), result->output_length);
 			}
-			free(dpu_bufs[curr_dpu_idx]);
 		}
+		free(staging);
+	}
+	free(first);
+	free(last);
+	free(staged);
+	free(dests);
+	free(file_ends);
+	free(results);
+	free(buffers);
+	free(lengths);
+
+	// Don't count the time it takes to read the DPU log, since we don't count that for the host
+	gettimeofday(&end, NULL);
+	job->runtime->copy_out += get_runtime(&start, &end);	
+
+	// Print the logs
+	uint32_t i = 0;
+	DPU_FOREACH(dpu_rank, dpu) {
+		printf("------DPU %d Logs------\n", dpu_idx + i);
+		DPU_ASSERT(dpu_log_read(dpu, stdout));
+		i++;
 	}
 
+	return status;
+}
+
+static const struct dpu_job_ops compress_job_ops = {
+	.copy_in = compress_copy_in,
+	.overlap = compress_expected_crcs,
+	.copy_out = compress_copy_out
+};
+
+/**
+ * Compress a batch of inputs on the DPUs in one launch.
+ *
+ * @param inputs: holds the buffer information of each input
+ * @param outputs: holds the buffer information of each output
+ * @param nr_files: number of inputs
+ * @param opts: compression options, used for every input
+ * @param headers: write the stream header of each input before its blocks,
+ *                 otherwise only the blocks are appended to the output
+ * @param ctx: DPUs kept allocated across jobs, or NULL to allocate them for this job only
+ * @param runtime: struct holding break down of runtimes for different parts of the program
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status compress_dpu_batch(struct host_buffer_context *inputs, struct host_buffer_context *outputs, uint32_t nr_files, const struct compress_options *opts,
+										bool headers, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	struct timeval start;
+	struct timeval end;
 	gettimeofday(&start, NULL);
-	DPU_ASSERT(dpu_free(dpus));
+
+	// The DPU compressor keeps its hash table in WRAM, with no room to seed it
+	if (opts->dict != NULL) {
+		fprintf(stderr, "Compressing with a dictionary is only supported on host\n");
+		return SNAPPY_INVALID_INPUT;
+	}
+	if (!check_options(opts))
+		return SNAPPY_INVALID_INPUT;
+
+	uint32_t block_size = opts->block_size;
+	uint32_t flags = opts->flags;
+	uint32_t group_blocks = get_group_blocks(opts);
+
+	// Write the decompressed length, format flags and block size of each
+	// file. Inputs that are predicted not to compress are stored raw on host,
+	// without spending any time on the DPUs.
+	bool *on_dpu = malloc(sizeof(bool) * nr_files);
+	uint64_t total_length = 0;
+	for (uint32_t f = 0; f < nr_files; f++) {
+		struct host_buffer_context *input = &inputs[f];
+		struct host_buffer_context *output = &outputs[f];
+		if (headers)
+			write_stream_header(output, input->length, opts);
+		on_dpu[f] = true;
+
+		if (opts->skip_incompressible && (input->length != 0)) {
+			struct snappy_estimate estimate;
+			snappy_estimate_ratio(input, opts, &estimate);
+			if (estimate.ratio < ESTIMATE_MIN_RATIO) {
+				printf("%s predicted to be incompressible (ratio %f), storing it raw on host\n",
+						(input->file_name != NULL) ? input->file_name : "Input", estimate.ratio);
+				for (size_t offset = 0; offset < input->length; offset += block_size)
+					store_raw_block(input, output, MIN(input->length - offset, block_size), flags);
+				input->curr = input->buffer;
+				on_dpu[f] = false;
+			}
+		}
+		if (on_dpu[f])
+			total_length += input->length;
+	}
+
+	// The DPUs are only allocated for this job if the caller does not keep them
+	struct dpu_context local_ctx;
+	if (ctx == NULL) {
+		ctx = &local_ctx;
+		dpu_context_init(ctx, 0, 0, 1, false);
+	}
+
+	// Estimate the work of each group of blocks of every file
+	size_t group_length = (size_t)block_size * group_blocks;
+	uint32_t nr_groups = 0;
+	for (uint32_t f = 0; f < nr_files; f++) {
+		if (on_dpu[f])
+			nr_groups += (inputs[f].length + group_length - 1) / group_length;
+	}
+	uint32_t *group_work = malloc(sizeof(uint32_t) * nr_groups);
+	uint64_t total_work = 0;
+	uint32_t group_idx = 0;
+	for (uint32_t f = 0; f < nr_files; f++) {
+		for (size_t offset = 0; on_dpu[f] && (offset < inputs[f].length); offset += group_length) {
+			uint32_t length = MIN(inputs[f].length - offset, group_length);
+			group_work[group_idx] = estimate_dpu_compress_work(inputs[f].buffer + offset, length, block_size);
+			total_work += group_work[group_idx++];
+		}
+	}
+
+	// Pack whole groups of blocks of every file into the tasks, each task gets
+	// an even share of the work. The output of a job takes at most the length
+	// of its blocks and their headers, plus the compressed length of one block
+	// that did not get smaller, which is written before the block is stored
+	// raw instead.
+	struct dpu_compress_job *job = malloc(sizeof(struct dpu_compress_job));
+	job->inputs = inputs;
+	job->outputs = outputs;
+	job->runtime = runtime;
+	dpu_batch_init(&job->batch, ctx, total_length, total_work, 64, snappy_max_compressed_length(block_size) - block_size);
+
+	snappy_status status = SNAPPY_OK;
+	group_idx = 0;
+	for (uint32_t f = 0; (f < nr_files) && (status == SNAPPY_OK); f++) {
+		if (!on_dpu[f])
+			continue;
+
+		for (size_t offset = 0; offset < inputs[f].length; offset += group_length) {
+			uint32_t length = MIN(inputs[f].length - offset, group_length);
+			uint32_t nr_blocks = (length + block_size - 1) / block_size;
+			struct dpu_job group = {
+				.input_length = length,
+				.output_length = length + nr_blocks * BLOCK_HEADER_LENGTH(flags),
+				.block_size = block_size,
+				.flags = flags,
+				.group_blocks = group_blocks,
+				.file = f
+			};
+			if (!dpu_batch_add(&job->batch, &group, offset, 0, length, group_work[group_idx++])) {
+				fprintf(stderr, "The inputs do not fit in the DPUs\n");
+				status = SNAPPY_BUFFER_TOO_SMALL;
+				break;
+			}
+		}
+	}
+	dpu_batch_finish(&job->batch);
+	dpu_batch_align_tasks(&job->batch);
+	free(group_work);
+	free(on_dpu);
+	if (status == SNAPPY_OK)
+		dpu_batch_report(&job->batch);
+	
 	gettimeofday(&end, NULL);
-	runtime->d_free = get_runtime(&start, &end);
+	runtime->pre += get_runtime(&start, &end);
 
-	fclose(fout);
+	if ((status == SNAPPY_OK) && (job->batch.nr_jobs != 0)) {
+		// Load program, allocating the DPUs unless the caller keeps them allocated across jobs
+		dpu_context_load(ctx, DPU_COMPRESS_PROGRAM, runtime);
 
-	return SNAPPY_OK;
+		// Copy the input in, run the DPUs and copy the output out one wave of
+		// ranks at a time, and checksum the input on the host while the first wave runs
+		runtime->copy_out = 0.0;
+		runtime->copy_out_bytes = 0;
+		status = dpu_context_run(ctx, &compress_job_ops, job, runtime);
+
+		dpu_context_release(ctx, runtime);
+	}
+
+	for (uint32_t f = 0; f < nr_files; f++)
+		outputs[f].length = outputs[f].curr - outputs[f].buffer;
+
+	dpu_batch_free(&job->batch);
+	free(job);
+	return status;
+}
+
+snappy_status snappy_compress_dpu_batch(struct host_buffer_context *inputs, struct host_buffer_context *outputs, uint32_t nr_files, const struct compress_options *opts, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	return compress_dpu_batch(inputs, outputs, nr_files, opts, true, ctx, runtime);
+}
+
+snappy_status snappy_compress_dpu(struct host_buffer_context *input, struct host_buffer_context *output, const struct compress_options *opts, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	return compress_dpu_batch(input, output, 1, opts, true, ctx, runtime);
+}
+
+void snappy_compress_header(struct host_buffer_context *output, uint32_t length, const struct compress_options *opts)
+{
+	write_stream_header(output, length, opts);
+	output->length = output->curr - output->buffer;
+}
+
+snappy_status snappy_compress_dpu_blocks(struct host_buffer_context *input, struct host_buffer_context *output, const struct compress_options *opts, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	return compress_dpu_batch(input, output, 1, opts, false, ctx, runtime);
 }
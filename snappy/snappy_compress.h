@@ -2,6 +2,35 @@
 #define _SNAPPY_COMPRESSION_H_
 
 #include "dpu_snappy.h"
+#include "dpu_context.h"
+
+/**
+ * Options that control how a stream is compressed.
+ */
+struct compress_options {
+	uint32_t block_size;	// Size to compress at a time
+	uint32_t flags;			// SNAPPY_FLAG_* format flags of the stream
+	uint32_t nr_threads;	// Number of host threads used by snappy_compress_host
+	uint32_t level;			// Compression level used by snappy_compress_host
+	const struct snappy_dictionary *dict;	// Preset dictionary, or NULL
+	uint32_t group_blocks;	// Blocks in each group, if flags has SNAPPY_FLAG_CHAINED
+	bool skip_incompressible;	// Store blocks predicted not to compress raw, without compressing them
+};
+
+/**
+ * Compressibility of an input, estimated from samples of it.
+ */
+struct snappy_estimate {
+	double ratio;			// Predicted compression ratio, including the block headers
+	double entropy;			// Entropy of the sampled bytes, in bits per byte
+	double match_fraction;	// Fraction of the sampled bytes covered by copies
+	size_t sampled;			// Number of bytes sampled
+};
+
+// Compression levels: 1 is the fast Snappy compressor, higher levels search
+// hash chains for longer matches and produce the same format
+#define SNAPPY_MIN_LEVEL 1
+#define SNAPPY_MAX_LEVEL 9
 
 /**
  * Prepares the necessary constructs for compression.
@@ -11,30 +40,190 @@
  *
  * @param input: holds input buffer information
  * @param output: holds output buffer information
+ * @param opts: compression options
  * @param runtime: struct holding break down of runtimes for different parts of the program
  */
-void setup_compression(struct host_buffer_context *input, struct host_buffer_context *output, struct program_runtime *runtime);
+void setup_compression(struct host_buffer_context *input, struct host_buffer_context *output, const struct compress_options *opts, struct program_runtime *runtime);
 
 /**
- * Perform the Snappy compression on the host.
+ * Perform the Snappy compression on the host. Blocks are split into
+ * contiguous ranges, one per thread, and each thread compresses its range
+ * with its own hash table. The output does not depend on the number of threads.
+ * Levels above SNAPPY_MIN_LEVEL search hash chains for longer matches.
+ * With a preset dictionary, every block can refer back into it, and the
+ * dictionary and a block must fit in SNAPPY_MAX_DICT_WINDOW. With
+ * SNAPPY_FLAG_CHAINED, threads are given whole groups of blocks, and blocks
+ * can refer back into the previous block of their group.
+ * When skipping incompressible blocks, blocks without a dictionary or an
+ * earlier block to refer to, whose sampled bytes look random and in which
+ * few matches are found, are stored raw without compressing them.
  *
  * @param input: holds input buffer information
  * @param output: holds output buffer information
- * @param block_size: size to compress at a time
+ * @param opts: compression options
  * @return SNAPPY_OK if successful, error code otherwise
  */
-snappy_status snappy_compress_host(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t block_size);
+snappy_status snappy_compress_host(struct host_buffer_context *input, struct host_buffer_context *output, const struct compress_options *opts);
 
 /**
- * Perform the Snappy compression on the DPU.
+ * Choose a block size for compressing the input. A few windows of the input
+ * are compressed with every candidate block size to predict its ratio. Of the
+ * block sizes that reach min_ratio, the one that spreads the input most
+ * evenly over nr_units threads or DPU tasklets is chosen, preferring the best
+ * ratio among those that balance about as well. The candidates are printed.
  *
  * @param input: holds input buffer information
- * @param output: holds output buffer information
- * @param block_size: size to compress at a time
+ * @param opts: compression options, the block size is ignored
+ * @param nr_units: number of host threads or DPU tasklets the blocks are spread over
+ * @param min_ratio: smallest acceptable compression ratio, or negative to
+ *                   accept 90% of the best predicted ratio
+ * @param predicted_ratio[out]: predicted compression ratio of the chosen block size
+ * @return Chosen block size
+ */
+uint32_t snappy_choose_block_size(struct host_buffer_context *input, const struct compress_options *opts, uint32_t nr_units, double min_ratio, double *predicted_ratio);
+
+/**
+ * Estimate how well the input compresses with the block size of the options,
+ * without compressing it. The start of up to 256KB worth of blocks spread
+ * over the input is sampled. The matches the level 1 compressor would find in
+ * each sample are looked up in a hash table without writing any output, and
+ * the length of the literals and copies is added up. The byte entropy of the
+ * samples is reported next to the predicted ratio. Dictionaries and chained
+ * blocks are not taken into account.
+ *
+ * @param input: holds input buffer information
+ * @param opts: compression options
+ * @param estimate[out]: estimated compressibility of the input
+ */
+void snappy_estimate_ratio(struct host_buffer_context *input, const struct compress_options *opts, struct snappy_estimate *estimate);
+
+/**
+ * Incremental compression, which needs memory for a few blocks whatever the
+ * length of the input. The stream is written with SNAPPY_FLAG_STREAM, since
+ * its decompressed length is only known at the end.
+ */
+struct snappy_compress_stream;
+
+/**
+ * Start an incremental compression. The stream header is handed out by the
+ * first call that produces output.
+ *
+ * @param opts: compression options, the number of threads is ignored
+ * @return New compression stream, or NULL if the options are invalid
+ */
+struct snappy_compress_stream *snappy_compress_stream_init(const struct compress_options *opts);
+
+/**
+ * Add input to a compression stream. Input is compressed one block at a
+ * time, and compressed output is copied to out as long as it has room. Stops
+ * taking input when out is full, so the caller should call again with the
+ * rest of the input once it has drained out.
+ *
+ * @param stream: compression stream
+ * @param in: input to compress
+ * @param in_length: length of in
+ * @param consumed[out]: bytes of in taken by the stream
+ * @param out: buffer for the compressed output
+ * @param out_length: length of out
+ * @param produced[out]: bytes written to out
+ * @return SNAPPY_OK if successful, SNAPPY_INVALID_INPUT if the stream is finished
+ */
+snappy_status snappy_compress_stream_feed(struct snappy_compress_stream *stream, const uint8_t *in, size_t in_length, size_t *consumed, uint8_t *out, size_t out_length, size_t *produced);
+
+/**
+ * Hand out the compressed output of every full block fed so far. A partial
+ * block stays in the stream, since only the last block may be shorter than
+ * the block size.
+ *
+ * @param stream: compression stream
+ * @param out: buffer for the compressed output
+ * @param out_length: length of out
+ * @param produced[out]: bytes written to out
+ * @return SNAPPY_OK if everything was handed out, SNAPPY_BUFFER_TOO_SMALL if
+ *         out filled up first and flush should be called again
+ */
+snappy_status snappy_compress_stream_flush(struct snappy_compress_stream *stream, uint8_t *out, size_t out_length, size_t *produced);
+
+/**
+ * Compress the last block and hand out the end of the stream. No more input
+ * can be fed afterwards.
+ *
+ * @param stream: compression stream
+ * @param out: buffer for the compressed output
+ * @param out_length: length of out
+ * @param produced[out]: bytes written to out
+ * @return SNAPPY_OK if the stream is complete, SNAPPY_BUFFER_TOO_SMALL if
+ *         out filled up first and finish should be called again
+ */
+snappy_status snappy_compress_stream_finish(struct snappy_compress_stream *stream, uint8_t *out, size_t out_length, size_t *produced);
+
+/**
+ * Free a compression stream.
+ *
+ * @param stream: compression stream, may be NULL
+ */
+void snappy_compress_stream_free(struct snappy_compress_stream *stream);
+
+/**
+ * Perform the Snappy compression on the DPU. Preset dictionaries are not
+ * supported. When skipping incompressible blocks, an input predicted not to
+ * compress is stored raw on host without using the DPUs.
+ *
+ * @param input: holds input buffer information
+ * @param output: holds output buffer information, set up by setup_compression
+ * @param opts: compression options
+ * @param ctx: DPUs kept allocated across jobs, or NULL to allocate NR_DPUS DPUs
+ *             running NR_TASKLETS tasklets and free them for this job only
  * @param runtime: struct holding break down of runtimes for different parts of the program
  * @return SNAPPY_OK if successful, error code otherwise
  */
-snappy_status snappy_compress_dpu(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t block_size, struct program_runtime *runtime);
+snappy_status snappy_compress_dpu(struct host_buffer_context *input, struct host_buffer_context *output, const struct compress_options *opts, struct dpu_context *ctx, struct program_runtime *runtime);
+
+/**
+ * Compress many independent inputs on the DPUs in one launch, each into its
+ * own stream. The blocks of all the inputs are packed into the tasklets of
+ * every DPU, so that small inputs share DPUs and large ones are split
+ * between them, and the output of each tasklet is copied back to the output
+ * of its input.
+ *
+ * @param inputs: holds the buffer information of each input
+ * @param outputs: holds the buffer information of each output, set up by setup_compression
+ * @param nr_files: number of inputs
+ * @param opts: compression options, used for every input
+ * @param ctx: DPUs kept allocated across jobs, or NULL to allocate NR_DPUS DPUs
+ *             running NR_TASKLETS tasklets and free them for this job only
+ * @param runtime: struct holding break down of runtimes for different parts of the program
+ * @return SNAPPY_OK if successful, SNAPPY_BUFFER_TOO_SMALL if the inputs do
+ *         not fit in the DPUs together, error code otherwise
+ */
+snappy_status snappy_compress_dpu_batch(struct host_buffer_context *inputs, struct host_buffer_context *outputs, uint32_t nr_files, const struct compress_options *opts, struct dpu_context *ctx, struct program_runtime *runtime);
+
+/**
+ * Write the stream header of an input that is compressed in rounds, each
+ * round appending its blocks with snappy_compress_dpu_blocks.
+ *
+ * @param output: holds output buffer information, the header is written at output->curr
+ * @param length: decompressed length of the whole input
+ * @param opts: compression options, the same for every round
+ */
+void snappy_compress_header(struct host_buffer_context *output, uint32_t length, const struct compress_options *opts);
+
+/**
+ * Compress one round of an input too long for the DPUs, and append its
+ * blocks to the output without a stream header. Every round but the last
+ * must be whole groups of blocks, so that the rounds together are the same
+ * stream as the input compressed at once.
+ *
+ * @param input: holds the buffer information of the round
+ * @param output: holds output buffer information, set up by setup_compression
+ *                for the longest round
+ * @param opts: compression options
+ * @param ctx: DPUs kept allocated across rounds
+ * @param runtime: struct holding break down of runtimes for different parts of the program
+ * @return SNAPPY_OK if successful, SNAPPY_BUFFER_TOO_SMALL if the round does
+ *         not fit in the DPUs, error code otherwise
+ */
+snappy_status snappy_compress_dpu_blocks(struct host_buffer_context *input, struct host_buffer_context *output, const struct compress_options *opts, struct dpu_context *ctx, struct program_runtime *runtime);
 
 
 #endif /* _SNAPPY_COMPRESSION_H_ */
@@ -3,11 +3,39 @@
 #include <dpu_log.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #include "snappy_decompress.h"
+#include "crc32c.h"
 
 #define DPU_DECOMPRESS_PROGRAM "dpu-decompress/decompress.dpu"
-#define TOTAL_NR_TASKLETS (NR_DPUS * NR_TASKLETS)
+
+/**
+ * Bytes of slack allocated past the end of the host output buffer. The copy
+ * engine may write this far past the current element, which lets the common
+ * cases use fixed-size moves instead of checking the bounds on every byte.
+ */
+#define HOST_OUTPUT_SLOP 64
+
+// Format flags this decoder understands
+#define SUPPORTED_FLAGS (SNAPPY_FLAG_CRC32C | SNAPPY_FLAG_STREAM | SNAPPY_FLAG_DICT | SNAPPY_FLAG_CHAINED)
+
+// Longest stream header or decompressed length gathered by a decompression stream
+#define STREAM_GATHER_LENGTH 32
+
+// Estimated DPU cycles to decompress each byte of a compressed block, for the
+// tags and literals read, and each byte it decompresses to, plus the cycles
+// to start each block. Raw and run blocks are only copied or filled. Only
+// their ratios matter, they split the work between tasklets and can be tuned
+// from the cycles the tasklets print.
+#define DPU_DECOMPRESS_INPUT_BYTE_CYCLES 4
+#define DPU_DECOMPRESS_OUTPUT_BYTE_CYCLES 2
+#define DPU_DECOMPRESS_COPY_BYTE_CYCLES 1
+#define DPU_DECOMPRESS_BLOCK_CYCLES 256
 
 /**
  * Attempt to read a varint from the input buffer. The format of a varint
@@ -18,7 +46,7 @@
  * @param input: holds input buffer information
  * @param val: read value of the varint
  * @return False if all 5 bytes were read and there is still more data to
- *		   read, True otherwise
+ *		   read, or if the input ends first, True otherwise
  */
 static inline bool read_varint32(struct host_buffer_context *input, uint32_t *val)
 {
@@ -26,8 +54,11 @@ static inline bool read_varint32(struct host_buffer_context *input, uint32_t *va
 	*val = 0;
 
 	for (uint8_t count = 0; count < 5; count++) {
+		if (input->curr >= (input->buffer + input->length))
+			return false;
+
 		int8_t c = (int8_t)(*input->curr++);
-		*val |= (c & BITMASK(7)) << shift;
+		*val |= (uint32_t)(c & BITMASK(7)) << shift;
 		if (!(c & (1 << 7)))
 			return true;
 		shift += 7;
@@ -36,6 +67,36 @@ static inline bool read_varint32(struct host_buffer_context *input, uint32_t *va
 	return false;
 }
 
+/**
+ * Read a varint of up to 64 bits from a buffer that may end in the middle of
+ * it. The format is the same as read_varint32.
+ *
+ * @param ptr[in,out]: where to read from, moved past the varint if it was read
+ * @param end: end of the buffer
+ * @param val[out]: value of the varint
+ * @return 1 if the varint was read, 0 if the buffer ends before the varint
+ *         does, -1 if it is longer than 10 bytes
+ */
+static int parse_varint64(const uint8_t **ptr, const uint8_t *end, uint64_t *val)
+{
+	const uint8_t *p = *ptr;
+	*val = 0;
+
+	for (uint32_t shift = 0; shift < 64; shift += 7) {
+		if (p == end)
+			return 0;
+
+		uint8_t c = *p++;
+		*val |= (uint64_t)(c & BITMASK(7)) << shift;
+		if (!(c & (1 << 7))) {
+			*ptr = p;
+			return 1;
+		}
+	}
+
+	return -1;
+}
+
 /**
  * Read an unsigned integer from the input buffer. Increments
  * the current location in the input buffer.
@@ -47,447 +108,1898 @@ static uint32_t read_uint32(struct host_buffer_context *input)
 {
 	uint32_t val = 0;
 	for (uint8_t i = 0; i < sizeof(uint32_t); i++) {
-		val |= (*input->curr++) << (8 * i);
+		val |= (uint32_t)(*input->curr++) << (8 * i);
 	}
 
 	return val;
 }
-		
+
 /**
- * Read the size of the long literal tag, which is used for literals with
- * length greater than 60 bytes.
+ * Read the part of the stream header that follows the decompressed length:
+ * the block size, preceded by a zero and the format flags if any flags are set,
+ * and followed by the dictionary ID with SNAPPY_FLAG_DICT and the group size
+ * with SNAPPY_FLAG_CHAINED.
  *
  * @param input: holds input buffer information
- * @param len: length in bytes of the size to read
- * @return 0 if we reached the end of input buffer, size of literal otherwise
+ * @param dblock_size[out]: decompressed size of each block
+ * @param flags[out]: format flags of the stream
+ * @param dict_id[out]: ID of the preset dictionary, if the stream has one
+ * @param group_blocks[out]: blocks in each group, 1 if blocks are not chained
+ * @return False if the header could not be read, True otherwise
  */
-static inline uint32_t read_long_literal_size(struct host_buffer_context *input, uint32_t len)
+static bool read_block_size_header(struct host_buffer_context *input, uint32_t *dblock_size, uint32_t *flags, uint32_t *dict_id, uint32_t *group_blocks)
 {
-	if ((input->curr + len) >= (input->buffer + input->length))
-		return 0;
+	*flags = 0;
+	*dict_id = 0;
+	*group_blocks = 1;
+	if (!read_varint32(input, dblock_size))
+		return false;
 
-	uint32_t size = 0;
-	for (uint32_t i = 0; i < len; i++) {
-		size |= (*input->curr++ << (i << 3));
+	if (*dblock_size == 0) {
+		if (!read_varint32(input, flags) || !read_varint32(input, dblock_size))
+			return false;
+		if ((*flags & ~SUPPORTED_FLAGS) || ((*flags & SNAPPY_FLAG_DICT) && (*flags & SNAPPY_FLAG_CHAINED))) {
+			fprintf(stderr, "Unsupported format flags 0x%x\n", *flags);
+			return false;
+		}
+		if ((*flags & SNAPPY_FLAG_DICT) && !read_varint32(input, dict_id))
+			return false;
+		if ((*flags & SNAPPY_FLAG_CHAINED) && (!read_varint32(input, group_blocks) || (*group_blocks == 0)))
+			return false;
 	}
-	return size;
+
+	return true;
 }
 
 /**
- * Read a 1-byte offset tag and return the offset of the copy that is read.
+ * Check that the caller gave the preset dictionary a stream was compressed
+ * with, if it was compressed with one.
  *
- * @param tag: tag byte to parse
- * @param input: holds input buffer information
- * @return 0 if we reached the end of input buffer, offset of the copy otherwise
+ * @param flags: format flags of the stream
+ * @param dict_id: ID of the dictionary in the stream header
+ * @param dict: dictionary given by the caller, or NULL
+ * @return True if the stream can be decompressed with dict
  */
-static inline uint16_t make_offset_1_byte(uint8_t tag, struct host_buffer_context *input)
+static bool check_dictionary(uint32_t flags, uint32_t dict_id, const struct snappy_dictionary *dict)
 {
-	if (input->curr >= (input->buffer + input->length))
-		return 0;
-	return (uint16_t)(*input->curr++) | (uint16_t)(GET_OFFSET_1_BYTE(tag) << 8);
+	if (!(flags & SNAPPY_FLAG_DICT))
+		return true;
+
+	if (dict == NULL) {
+		fprintf(stderr, "The stream needs the dictionary with ID 0x%x\n", dict_id);
+		return false;
+	}
+	if (dict->id != dict_id) {
+		fprintf(stderr, "Dictionary ID 0x%x does not match the stream's 0x%x\n", dict->id, dict_id);
+		return false;
+	}
+	return true;
 }
 
 /**
- * Read a 2-byte offset tag and return the offset of the copy that is read.
+ * Read the decompressed length at the start of a stream. Streams written with
+ * SNAPPY_FLAG_STREAM store it after their last block instead, so their block
+ * headers are walked to find it. Moves input->curr past the length at the start.
  *
- * @param tag: tag byte to parse
- * @param input: holds input buffer information
- * @return 0 if we reached the end of input buffer, offset of the copy otherwise
+ * @param input: holds input buffer information, curr points at the start of the stream
+ * @param dlength[out]: decompressed length of the stream
+ * @param body_length[out]: length of the stream up to the end of its last block
+ * @return False if the length could not be read, True otherwise
  */
-static inline uint16_t make_offset_2_byte(uint8_t tag, struct host_buffer_context *input)
+static bool read_decompressed_length(struct host_buffer_context *input, uint32_t *dlength, unsigned long *body_length)
 {
-	UNUSED(tag);
+	*body_length = input->length;
+	if (!read_varint32(input, dlength))
+		return false;
 
-	uint16_t total = 0;
-	if ((input->curr + sizeof(uint16_t)) > (input->buffer + input->length))
-		return 0;
-	else {
-		total = (*input->curr & 0xFF) | ((*(input->curr + 1) & 0xFF) << 8);
-		input->curr += sizeof(uint16_t);
-		return total;
+	struct host_buffer_context stream = *input;
+	uint32_t dblock_size;
+	uint32_t flags;
+	uint32_t dict_id;
+	uint32_t group_blocks;
+	if (!read_block_size_header(&stream, &dblock_size, &flags, &dict_id, &group_blocks))
+		return false;
+	if (!(flags & SNAPPY_FLAG_STREAM))
+		return true;
+
+	const uint8_t *input_end = input->buffer + input->length;
+	while ((size_t)(input_end - stream.curr) >= sizeof(uint32_t)) {
+		uint32_t size = read_uint32(&stream);
+		if (size == STREAM_END_MARKER) {
+			const uint8_t *ptr = stream.curr;
+			uint64_t length;
+			if ((parse_varint64(&ptr, input_end, &length) != 1) || (length > UINT32_MAX))
+				return false;
+
+			*dlength = length;
+			*body_length = stream.curr - sizeof(uint32_t) - input->buffer;
+			return true;
+		}
+
+		if (flags & SNAPPY_FLAG_CRC32C)
+			stream.curr += sizeof(uint32_t);
+		if (GET_BLOCK_SIZE(size) > (size_t)(input_end - stream.curr))
+			break;
+		stream.curr += GET_BLOCK_SIZE(size);
 	}
+
+	return false;
+}
+
+/**
+ * Decoding information for every possible tag byte, computed the same way as
+ * char_table in upstream Snappy. Each entry packs:
+ *   bits 0-7:   literal or copy length (1 for long literals, since the
+ *               extra bytes store length - 1)
+ *   bits 8-10:  upper 3 bits of the offset for 1-byte offset copies
+ *   bits 11-13: number of extra bytes that follow the tag
+ */
+static const uint16_t char_table[256] = {
+	0x0001, 0x0804, 0x1001, 0x2001, 0x0002, 0x0805, 0x1002, 0x2002,
+	0x0003, 0x0806, 0x1003, 0x2003, 0x0004, 0x0807, 0x1004, 0x2004,
+	0x0005, 0x0808, 0x1005, 0x2005, 0x0006, 0x0809, 0x1006, 0x2006,
+	0x0007, 0x080a, 0x1007, 0x2007, 0x0008, 0x080b, 0x1008, 0x2008,
+	0x0009, 0x0904, 0x1009, 0x2009, 0x000a, 0x0905, 0x100a, 0x200a,
+	0x000b, 0x0906, 0x100b, 0x200b, 0x000c, 0x0907, 0x100c, 0x200c,
+	0x000d, 0x0908, 0x100d, 0x200d, 0x000e, 0x0909, 0x100e, 0x200e,
+	0x000f, 0x090a, 0x100f, 0x200f, 0x0010, 0x090b, 0x1010, 0x2010,
+	0x0011, 0x0a04, 0x1011, 0x2011, 0x0012, 0x0a05, 0x1012, 0x2012,
+	0x0013, 0x0a06, 0x1013, 0x2013, 0x0014, 0x0a07, 0x1014, 0x2014,
+	0x0015, 0x0a08, 0x1015, 0x2015, 0x0016, 0x0a09, 0x1016, 0x2016,
+	0x0017, 0x0a0a, 0x1017, 0x2017, 0x0018, 0x0a0b, 0x1018, 0x2018,
+	0x0019, 0x0b04, 0x1019, 0x2019, 0x001a, 0x0b05, 0x101a, 0x201a,
+	0x001b, 0x0b06, 0x101b, 0x201b, 0x001c, 0x0b07, 0x101c, 0x201c,
+	0x001d, 0x0b08, 0x101d, 0x201d, 0x001e, 0x0b09, 0x101e, 0x201e,
+	0x001f, 0x0b0a, 0x101f, 0x201f, 0x0020, 0x0b0b, 0x1020, 0x2020,
+	0x0021, 0x0c04, 0x1021, 0x2021, 0x0022, 0x0c05, 0x1022, 0x2022,
+	0x0023, 0x0c06, 0x1023, 0x2023, 0x0024, 0x0c07, 0x1024, 0x2024,
+	0x0025, 0x0c08, 0x1025, 0x2025, 0x0026, 0x0c09, 0x1026, 0x2026,
+	0x0027, 0x0c0a, 0x1027, 0x2027, 0x0028, 0x0c0b, 0x1028, 0x2028,
+	0x0029, 0x0d04, 0x1029, 0x2029, 0x002a, 0x0d05, 0x102a, 0x202a,
+	0x002b, 0x0d06, 0x102b, 0x202b, 0x002c, 0x0d07, 0x102c, 0x202c,
+	0x002d, 0x0d08, 0x102d, 0x202d, 0x002e, 0x0d09, 0x102e, 0x202e,
+	0x002f, 0x0d0a, 0x102f, 0x202f, 0x0030, 0x0d0b, 0x1030, 0x2030,
+	0x0031, 0x0e04, 0x1031, 0x2031, 0x0032, 0x0e05, 0x1032, 0x2032,
+	0x0033, 0x0e06, 0x1033, 0x2033, 0x0034, 0x0e07, 0x1034, 0x2034,
+	0x0035, 0x0e08, 0x1035, 0x2035, 0x0036, 0x0e09, 0x1036, 0x2036,
+	0x0037, 0x0e0a, 0x1037, 0x2037, 0x0038, 0x0e0b, 0x1038, 0x2038,
+	0x0039, 0x0f04, 0x1039, 0x2039, 0x003a, 0x0f05, 0x103a, 0x203a,
+	0x003b, 0x0f06, 0x103b, 0x203b, 0x003c, 0x0f07, 0x103c, 0x203c,
+	0x0801, 0x0f08, 0x103d, 0x203d, 0x1001, 0x0f09, 0x103e, 0x203e,
+	0x1801, 0x0f0a, 0x103f, 0x203f, 0x2001, 0x0f0b, 0x1040, 0x2040,
+};
+
+// Mask that keeps the extra bytes of an element out of a 32-bit load
+static const uint32_t wordmask[] = {
+	0u, 0xffu, 0xffffu, 0xffffffu, 0xffffffffu
+};
+
+// The fast decode loop runs while this much input and output remains in the block
+#define FAST_LOOP_INPUT_MARGIN 16
+#define FAST_LOOP_OUTPUT_MARGIN 64
+
+/**
+ * State of the host decoder while it works through one block.
+ */
+struct host_decoder {
+	const uint8_t *ip;		// Current position in the compressed block
+	const uint8_t *ip_end;	// End of the compressed block
+	uint8_t *op_base;		// Start of the block's output
+	uint8_t *op_window;		// Start of the output copies may reach, the previous block of a chained group or op_base
+	uint8_t *op;			// Current position in the output
+	uint8_t *op_end;		// End of the block's output
+	uint8_t *op_slop;		// End of the region the copy engine may scribble over
+	const uint8_t *dict_end;	// End of the preset dictionary, which comes right before every block
+	uint32_t dict_length;	// Length of the preset dictionary, 0 if there is none
+};
+
+/**
+ * Read a little-endian 32-bit value that may not be aligned.
+ */
+static inline uint32_t load_le32(const uint8_t *ptr)
+{
+	uint32_t val;
+	memcpy(&val, ptr, sizeof(val));
+	return val;
+}
+
+/**
+ * Copy 8 bytes from src to dst. Neither pointer needs to be aligned.
+ */
+static inline void unaligned_copy64(const uint8_t *src, uint8_t *dst)
+{
+	uint64_t val;
+	memcpy(&val, src, sizeof(val));
+	memcpy(dst, &val, sizeof(val));
+}
+
+/**
+ * Copy 16 bytes from src to dst. Neither pointer needs to be aligned.
+ */
+static inline void unaligned_copy128(const uint8_t *src, uint8_t *dst)
+{
+#ifdef __SSE2__
+	_mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+#else
+	unaligned_copy64(src, dst);
+	unaligned_copy64(src + 8, dst + 8);
+#endif
+}
+
+/**
+ * Copy len bytes from src to dst in wide chunks. May read and write up to
+ * WIDE_COPY_OVERRUN bytes past the end of either buffer, so the caller must
+ * make sure that is safe. src and dst must either not overlap or be at least
+ * WIDE_COPY_OVERRUN + 1 bytes apart.
+ */
+#ifdef __AVX2__
+#define WIDE_COPY_OVERRUN 31
+static inline void wide_copy(const uint8_t *src, uint8_t *dst, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i += 32)
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+}
+#else
+#define WIDE_COPY_OVERRUN 15
+static inline void wide_copy(const uint8_t *src, uint8_t *dst, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i += 16)
+		unaligned_copy128(src + i, dst + i);
 }
+#endif
 
 /**
- * Read a 4-byte offset tag and return the offset of the copy that is read.
+ * Copy [src, src + (op_limit - op)) to op, where src is behind op and the two
+ * ranges may overlap (offset < length). In that case the bytes between src
+ * and op form a repeating pattern, which is first widened to at least 8 bytes
+ * by copying it onto itself, and then replicated with 8 or 16-byte moves.
  *
- * @param tag: tag byte to parse
- * @param input: holds input buffer information
- * @return 0 if we reached the end of input buffer, offset of the copy otherwise
+ * Writes up to 15 bytes past op_limit, which must not cross buf_limit. Near
+ * the end of the buffer the copy falls back to a byte loop.
+ *
+ * @param src: where to copy from
+ * @param op: where to copy to
+ * @param op_limit: end of the copy destination
+ * @param buf_limit: end of the region the copy may scribble over
  */
-static inline uint32_t make_offset_4_byte(uint8_t tag, struct host_buffer_context *input)
+static inline void incremental_copy(const uint8_t *src, uint8_t *op, uint8_t *op_limit, uint8_t *buf_limit)
 {
-	UNUSED(tag);
+	if (op_limit + 16 > buf_limit) {
+		while (op < op_limit)
+			*op++ = *src++;
+		return;
+	}
+
+	// Each step doubles the distance between src and op
+	while (((op - src) < 8) && (op < op_limit)) {
+		unaligned_copy64(src, op);
+		op += op - src;
+	}
 
-	uint32_t total = 0;
-	if ((input->curr + sizeof(uint32_t)) > (input->buffer + input->length))
-		return 0;
+	if ((op - src) >= 16) {
+		while (op < op_limit) {
+			unaligned_copy128(src, op);
+			src += 16;
+			op += 16;
+		}
+	}
 	else {
-		total = (*input->curr & 0xFF) |
-				((*(input->curr + 1) & 0xFF) << 8) |
-				((*(input->curr + 2) & 0xFF) << 16) |
-			 ((*(input->curr + 3) & 0xFF) << 24);
-		input->curr += sizeof(uint32_t);
-		return total;
+		while (op < op_limit) {
+			unaligned_copy64(src, op);
+			src += 8;
+			op += 8;
+		}
 	}
 }
 
 /**
  * Copy and append data from the input bufer to the output buffer.
  *
- * @param input: holds input buffer information
- * @param output: holds output buffer information
+ * @param d: decoder state
  * @param len: length of data to copy over
+ * @return False if the literal runs past the input or output buffer, True otherwise
  */
-static void writer_append_host(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t len)
+static inline bool writer_append_host(struct host_decoder *d, uint32_t len)
 {
-	//printf("Writing %u bytes at 0x%x\n", len, (input->curr - input->buffer));
-	while (len &&
-		(input->curr < (input->buffer + input->length)) &&
-		(output->curr < (output->buffer + output->length)))
-	{
-		*output->curr = *input->curr;
-		input->curr++;
-		output->curr++;
-		len--;
-	}
+	//printf("Writing %u bytes at %p\n", len, d->ip);
+	size_t input_remain = d->ip_end - d->ip;
+	if ((len > input_remain) || (len > (size_t)(d->op_end - d->op)))
+		return false;
+
+	size_t output_room = d->op_slop - d->op;
+	if ((len <= 16) && (input_remain >= 16) && (output_room >= 16))
+		unaligned_copy128(d->ip, d->op);
+	else if ((input_remain >= (len + WIDE_COPY_OVERRUN)) && (output_room >= (len + WIDE_COPY_OVERRUN)))
+		wide_copy(d->ip, d->op, len);
+	else
+		memcpy(d->op, d->ip, len);
+
+	d->ip += len;
+	d->op += len;
+	return true;
 }
 
 /**
- * Copy and append previously uncompressed data to the output buffer.
+ * Copy and append data that starts before the block, in the preset
+ * dictionary. The copy carries on from the start of the block if it is
+ * longer than the part of the dictionary it reaches.
  *
- * @param output: holds output buffer information
+ * @param d: decoder state
  * @param copy_length: length of data to copy over
  * @param offset: where to copy from, offset from current output pointer
  * @return False if offset if invalid, True otherwise
  */
-static bool write_copy_host(struct host_buffer_context *output, uint32_t copy_length, uint32_t offset)
+static bool write_dict_copy_host(struct host_decoder *d, uint32_t copy_length, uint32_t offset)
 {
-	//printf("Copying %u bytes from offset=0x%lx to 0x%lx\n", copy_length, (output->curr - output->buffer) - offset, output->curr - output->buffer);
-	const uint8_t *copy_curr = output->curr;
-	copy_curr -= offset;
-	if (copy_curr < output->buffer)
-	{
+	size_t pos = d->op - d->op_base;
+	if ((offset - 1) >= (pos + d->dict_length)) {
 		printf("bad offset!\n");
 		return false;
 	}
-	while (copy_length &&
-		output->curr < (output->buffer + output->length))
-	{
-		*output->curr = *copy_curr;
-		copy_curr++;
-		output->curr++;
-		copy_length -= 1;
-	}
+	if (copy_length > (size_t)(d->op_end - d->op))
+		return false;
 
+	uint32_t dict_part = MIN(copy_length, offset - pos);
+	memcpy(d->op, d->dict_end - (offset - pos), dict_part);
+	for (uint32_t i = dict_part; i < copy_length; i++)
+		d->op[i] = d->op_base[i - dict_part];
+
+	d->op += copy_length;
 	return true;
 }
 
+/**
+ * Copy and append previously uncompressed data to the output buffer.
+ *
+ * @param d: decoder state
+ * @param copy_length: length of data to copy over
+ * @param offset: where to copy from, offset from current output pointer
+ * @return False if offset if invalid, True otherwise
+ */
+static inline bool write_copy_host(struct host_decoder *d, uint32_t copy_length, uint32_t offset)
+{
+	//printf("Copying %u bytes from offset=0x%lx to 0x%lx\n", copy_length, (d->op - d->op_base) - offset, d->op - d->op_base);
+	if ((offset - 1) >= (size_t)(d->op - d->op_window))
+		return write_dict_copy_host(d, copy_length, offset);
+	if (copy_length > (size_t)(d->op_end - d->op))
+		return false;
+
+	const uint8_t *copy_curr = d->op - offset;
+	uint8_t *op_limit = d->op + copy_length;
 
-snappy_status setup_decompression(struct host_buffer_context *input, struct host_buffer_context *output, struct program_runtime *runtime)
+	// Short copies that don't overlap the destination are a single move
+	if ((copy_length <= 16) && (offset >= 16) && ((d->op_slop - d->op) >= 16))
+		unaligned_copy128(copy_curr, d->op);
+	else
+		incremental_copy(copy_curr, d->op, op_limit, d->op_slop);
+
+	d->op = op_limit;
+	return true;
+}
+
+/**
+ * Decompress one block. The fast loop decodes elements without bounds checks
+ * on the input or output, as long as a full element is guaranteed to fit in
+ * what remains of the block. The tail of the block goes through the careful
+ * loop, which checks every read and write.
+ *
+ * @param d: decoder state, positioned at the start of the block
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status decompress_block_host(struct host_decoder *d)
 {
-	struct timeval start;
-	struct timeval end;
-	gettimeofday(&start, NULL);
+	const uint8_t *ip = d->ip;
+	uint8_t *op = d->op;
 
-	// Read the decompressed length
-	uint32_t dlength;
-	if (!read_varint32(input, &dlength)) {
-		fprintf(stderr, "Failed to read decompressed length\n");
-		return SNAPPY_INVALID_INPUT;
-	}
+	/* There are two types of elements in a Snappy stream: Literals and
+	copies (backreferences). Each element starts with a tag byte,
+	and the lower two bits of this tag byte signal what type of element
+	will follow. The char_table gives the element's length and how many
+	extra bytes follow the tag. */
+	while (((d->ip_end - ip) >= FAST_LOOP_INPUT_MARGIN) && ((d->op_end - op) >= FAST_LOOP_OUTPUT_MARGIN)) {
+		const uint8_t tag = *ip++;
+		const uint16_t entry = char_table[tag];
+		const uint32_t trailer = load_le32(ip) & wordmask[entry >> 11];
+		const uint32_t length = entry & 0xFF;
+		ip += entry >> 11;
 
-	// Check that uncompressed length is within the max we can store
-	if (dlength > output->max) {
-		fprintf(stderr, "Output length is to big: max=%ld len=%d\n", output->max, dlength);
-		return SNAPPY_BUFFER_TOO_SMALL;
+		if (GET_ELEMENT_TYPE(tag) == EL_TYPE_LITERAL) {
+			/* For literals up to and including 60 bytes in length, the upper
+			 * six bits of the tag byte contain (len-1). Longer literals store
+			 * (len-1) in the extra bytes. The literal follows immediately
+			 * thereafter in the bytestream.
+			 */
+			const uint32_t literal_length = length + trailer;
+			if ((literal_length <= 16) && ((d->ip_end - ip) >= 16)) {
+				unaligned_copy128(ip, op);
+				ip += literal_length;
+				op += literal_length;
+				continue;
+			}
+
+			d->ip = ip;
+			d->op = op;
+			if (!writer_append_host(d, literal_length))
+				return SNAPPY_INVALID_INPUT;
+			ip = d->ip;
+			op = d->op;
+			continue;
+		}
+
+		/* Copies are references back into previous decompressed data, telling
+		 * the decompressor to reuse data it has previously decoded.
+		 * They encode two values: The _offset_, saying how many bytes back
+		 * from the current position to read, and the _length_, how many bytes
+		 * to copy. At most 64 bytes are copied, so they always fit here.
+		 */
+		const uint32_t offset = (entry & 0x700) + trailer;
+		if ((offset - 1) >= (size_t)(op - d->op_window)) {
+			d->op = op;
+			if (!write_dict_copy_host(d, length, offset))
+				return SNAPPY_INVALID_INPUT;
+			op = d->op;
+			continue;
+		}
+
+		if ((length <= 16) && (offset >= 16))
+			unaligned_copy128(op - offset, op);
+		else
+			incremental_copy(op - offset, op, op + length, d->op_slop);
+		op += length;
 	}
 
-	// Allocate output buffer
-	output->buffer = malloc(ALIGN(dlength, 8) | BITMASK(11));
-	output->curr = output->buffer;
-	output->length = dlength;
+	d->ip = ip;
+	d->op = op;
 
-	gettimeofday(&end, NULL);
-	runtime->pre = get_runtime(&start, &end);
+	// Careful loop for the tail of the block
+	while (d->ip < d->ip_end) {
+		const uint8_t tag = *d->ip++;
+		const uint16_t entry = char_table[tag];
+		const uint32_t extra = entry >> 11;
+		if (extra > (size_t)(d->ip_end - d->ip))
+			return SNAPPY_INVALID_INPUT;
+
+		uint32_t trailer = 0;
+		for (uint32_t i = 0; i < extra; i++)
+			trailer |= (uint32_t)d->ip[i] << (i << 3);
+		d->ip += extra;
+
+		if (GET_ELEMENT_TYPE(tag) == EL_TYPE_LITERAL) {
+			if (!writer_append_host(d, (entry & 0xFF) + trailer))
+				return SNAPPY_INVALID_INPUT;
+		}
+		else if (!write_copy_host(d, entry & 0xFF, (entry & 0x700) + trailer)) {
+			return SNAPPY_INVALID_INPUT;
+		}
+	}
 
 	return SNAPPY_OK;
 }
 
 
-snappy_status snappy_decompress_host(struct host_buffer_context *input, struct host_buffer_context *output)
+/**
+ * Location of every block in a compressed stream, found by walking the
+ * block size headers.
+ */
+struct block_index {
+	uint32_t dblock_size;		// Decompressed size of every block but the last
+	uint32_t flags;				// Format flags of the stream
+	uint32_t group_blocks;		// Blocks in each group, 1 if blocks are not chained
+	uint32_t num_blocks;		// Number of blocks in the stream
+	uint32_t dlength;			// Decompressed length of the whole stream
+	uint8_t **block;			// Start of each block's compressed data
+	uint32_t *compressed_size;	// Compressed size of each block
+	uint8_t *type;				// BLOCK_TYPE_* encoding of each block
+	uint32_t *crc;				// Masked CRC32C of each block, if the stream has them
+	const uint8_t *dict_end;	// End of the preset dictionary, if the stream has one
+	uint32_t dict_length;		// Length of the preset dictionary, 0 if there is none
+};
+
+/**
+ * Free the arrays held by a block index.
+ */
+static void free_block_index(struct block_index *index)
 {
-	// Read the decompressed block size
-	uint32_t dblock_size;
-	if (!read_varint32(input, &dblock_size)) {
-		fprintf(stderr, "Failed to read decompressed block size\n");
+	free(index->block);
+	free(index->compressed_size);
+	free(index->type);
+	free(index->crc);
+	index->block = NULL;
+	index->compressed_size = NULL;
+	index->type = NULL;
+	index->crc = NULL;
+}
+
+/**
+ * Walk the block size headers of a compressed stream and record where each
+ * block starts. Does not move input->curr.
+ *
+ * @param input: holds input buffer information, curr points at the first block
+ * @param dlength: decompressed length of the whole stream
+ * @param dblock_size: decompressed size of each block
+ * @param flags: format flags of the stream
+ * @param group_blocks: blocks in each group, 1 if blocks are not chained
+ * @param dict: preset dictionary of the stream, or NULL if it has none
+ * @param index[out]: block locations, must be freed with free_block_index
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status build_block_index(struct host_buffer_context *input, uint32_t dlength, uint32_t dblock_size, uint32_t flags,
+		uint32_t group_blocks, const struct snappy_dictionary *dict, struct block_index *index)
+{
+	if ((dblock_size == 0) && (dlength != 0)) {
+		fprintf(stderr, "Invalid decompressed block size\n");
 		return SNAPPY_INVALID_INPUT;
 	}
 
-	while (input->curr < (input->buffer + input->length)) {
-		// Read the compressed block size
-		uint32_t compressed_size = read_uint32(input);	
-		uint8_t *block_end = input->curr + compressed_size;
-	
-		while (input->curr != block_end) {	
-			uint16_t length;
-			uint32_t offset;
-			const uint8_t tag = *input->curr++;
-			//printf("Got tag byte 0x%x at index 0x%lx\n", tag, input->curr - input->buffer - 1);
-
-			/* There are two types of elements in a Snappy stream: Literals and
-			copies (backreferences). Each element starts with a tag byte,
-			and the lower two bits of this tag byte signal what type of element
-			will follow. */
-			switch (GET_ELEMENT_TYPE(tag))
-			{
-			case EL_TYPE_LITERAL:
-				/* For literals up to and including 60 bytes in length, the upper
-				 * six bits of the tag byte contain (len-1). The literal follows
-				 * immediately thereafter in the bytestream.
-				 */
-				length = GET_LENGTH_2_BYTE(tag) + 1;
-				if (length > 60)
-				{
-					length = read_long_literal_size(input, length - 60) + 1;
-				}
-
-				writer_append_host(input, output, length);
-				break;
-
-			/* Copies are references back into previous decompressed data, telling
-			 * the decompressor to reuse data it has previously decoded.
-			 * They encode two values: The _offset_, saying how many bytes back
-			 * from the current position to read, and the _length_, how many bytes
-			 * to copy.
-			 */
-			case EL_TYPE_COPY_1:
-				length = GET_LENGTH_1_BYTE(tag) + 4;
-				offset = make_offset_1_byte(tag, input);
-				if (!write_copy_host(output, length, offset))
-					return SNAPPY_INVALID_INPUT;
-				break;
-
-			case EL_TYPE_COPY_2:
-				length = GET_LENGTH_2_BYTE(tag) + 1;
-				offset = make_offset_2_byte(tag, input);
-				if (!write_copy_host(output, length, offset))
-					return SNAPPY_INVALID_INPUT;
-				break;
-
-			case EL_TYPE_COPY_4:
-				length = GET_LENGTH_2_BYTE(tag) + 1;
-				offset = make_offset_4_byte(tag, input);
-				if (!write_copy_host(output, length, offset))
-					return SNAPPY_INVALID_INPUT;
-				break;
-			}
-		}
+	index->dblock_size = dblock_size;
+	index->flags = flags;
+	index->group_blocks = group_blocks;
+	index->dlength = dlength;
+	index->dict_end = (dict != NULL) ? (dict->data + dict->length) : NULL;
+	index->dict_length = (dict != NULL) ? dict->length : 0;
+	index->num_blocks = (dblock_size == 0) ? 0 : (dlength + dblock_size - 1) / dblock_size;
+	index->block = malloc(sizeof(uint8_t *) * (index->num_blocks + 1));
+	index->compressed_size = malloc(sizeof(uint32_t) * (index->num_blocks + 1));
+	index->type = malloc(sizeof(uint8_t) * (index->num_blocks + 1));
+	index->crc = malloc(sizeof(uint32_t) * (index->num_blocks + 1));
+
+	uint8_t *input_start = input->curr;
+	uint8_t *input_end = input->buffer + input->length;
+	uint32_t i;
+	for (i = 0; i < index->num_blocks; i++) {
+		if ((size_t)(input_end - input->curr) < BLOCK_HEADER_LENGTH(flags))
+			break;
+
+		uint32_t size = read_uint32(input);
+		index->compressed_size[i] = GET_BLOCK_SIZE(size);
+		index->type[i] = GET_BLOCK_TYPE(size);
+		if (flags & SNAPPY_FLAG_CRC32C)
+			index->crc[i] = read_uint32(input);
+		index->block[i] = input->curr;
+		if (index->compressed_size[i] > (size_t)(input_end - input->curr))
+			break;
+		input->curr += index->compressed_size[i];
+	}
+
+	// A block cut short also stops the walk, possibly right at the end
+	bool complete = (i == index->num_blocks) && (input->curr == input_end);
+	input->curr = input_start;
+	if (!complete) {
+		fprintf(stderr, "Block headers do not match the decompressed length\n");
+		free_block_index(index);
+		return SNAPPY_INVALID_INPUT;
 	}
 
 	return SNAPPY_OK;
 }
 
+/**
+ * Split the blocks of a stream into contiguous ranges of whole groups, one
+ * per thread, since the blocks of a chained group are decoded in order.
+ *
+ * @param num_blocks: number of blocks in the stream
+ * @param group_blocks: blocks in each group, 1 if blocks are not chained
+ * @param nr_threads[in,out]: number of threads, lowered to the number of groups
+ * @return Number of blocks in the range of each thread
+ */
+static uint32_t get_blocks_per_thread(uint32_t num_blocks, uint32_t group_blocks, uint32_t *nr_threads)
+{
+	uint32_t num_groups = num_blocks / group_blocks + ((num_blocks % group_blocks) != 0);
+	if (*nr_threads > num_groups)
+		*nr_threads = (num_groups == 0) ? 1 : num_groups;
+	return (num_groups + *nr_threads - 1) / *nr_threads * group_blocks;
+}
+
+/**
+ * Work given to one host decompression thread.
+ */
+struct decompress_worker {
+	struct block_index *index;
+	struct host_buffer_context *output;
+	uint32_t first_block;		// First block this thread decodes
+	uint32_t last_block;		// One past the last block this thread decodes
+	snappy_status status;		// Result of the thread
+};
 
-snappy_status snappy_decompress_dpu(struct host_buffer_context *input, struct host_buffer_context *output, struct program_runtime *runtime)
+/**
+ * Decompress a contiguous range of blocks. Block i is written at
+ * i * dblock_size in the output buffer. The copy engine may scribble past a
+ * block into the rest of this thread's range, but never into the range of
+ * the next thread.
+ *
+ * @param arg: struct decompress_worker describing the range
+ * @return NULL
+ */
+static void *decompress_worker_fn(void *arg)
 {
-	struct timeval start;
-	struct timeval end;
-	gettimeofday(&start, NULL);
+	struct decompress_worker *worker = arg;
+	struct block_index *index = worker->index;
+	uint8_t *output_end = worker->output->buffer + index->dlength;
 
-	// Calculate workload of each task
-	uint32_t dblock_size;
-	if (!read_varint32(input, &dblock_size)) {
-		fprintf(stderr, "Failed to read decompressed block size\n");
-		return SNAPPY_INVALID_INPUT;
-	}
-	uint8_t *input_start = input->curr;
+	struct host_decoder d;
+	if (worker->last_block == index->num_blocks)
+		d.op_slop = output_end + HOST_OUTPUT_SLOP;
+	else
+		d.op_slop = worker->output->buffer + (size_t)worker->last_block * index->dblock_size;
 
-	uint32_t num_blocks = (output->length + dblock_size - 1) / dblock_size;
-	uint32_t input_blocks_per_dpu = (num_blocks + NR_DPUS - 1) / NR_DPUS;
-	uint32_t input_blocks_per_task = (num_blocks + TOTAL_NR_TASKLETS - 1) / TOTAL_NR_TASKLETS;
+	for (uint32_t i = worker->first_block; i < worker->last_block; i++) {
+		d.ip = index->block[i];
+		d.ip_end = index->block[i] + index->compressed_size[i];
+		d.op_base = worker->output->buffer + (size_t)i * index->dblock_size;
+		d.op_window = d.op_base;
+		if ((i % index->group_blocks) != 0)
+			d.op_window -= index->dblock_size;
+		d.op = d.op_base;
+		d.op_end = MIN(d.op_base + index->dblock_size, output_end);
+		d.dict_end = index->dict_end;
+		d.dict_length = index->dict_length;
 
-	uint32_t input_offset[NR_DPUS][NR_TASKLETS] = {0};
-	uint32_t output_offset[NR_DPUS][NR_TASKLETS] = {0};
+		snappy_status status = SNAPPY_OK;
+		switch (index->type[i]) {
+		case BLOCK_TYPE_SNAPPY:
+			status = decompress_block_host(&d);
+			break;
 
-	uint32_t dpu_idx = 0;
-	uint32_t task_idx = 0;
-	uint32_t task_blocks = 0;
-	uint32_t total_offset = 0;
-	for (uint32_t i = 0; i < num_blocks; i++) {
-		// If we have reached the next DPU's boundary, update the index
-		if (i == (input_blocks_per_dpu * (dpu_idx + 1))) {
-			dpu_idx++;
-			task_idx = 0;
-			task_blocks = 0;
-		}
+		case BLOCK_TYPE_RAW:
+			if (index->compressed_size[i] == (size_t)(d.op_end - d.op)) {
+				memcpy(d.op, d.ip, index->compressed_size[i]);
+				d.op = d.op_end;
+			}
+			break;
+
+		case BLOCK_TYPE_RUN:
+			if (index->compressed_size[i] == 1) {
+				memset(d.op, *d.ip, d.op_end - d.op);
+				d.op = d.op_end;
+			}
+			break;
 
-		// If we have reached the next task's boundary, log the offset
-		// to the input_offset and output_offset arrays. This should roughly
-		// evenly divide the work between NR_TASKLETS tasks on NR_DPUS.
-		if (task_blocks == (input_blocks_per_task * task_idx)) {
-			input_offset[dpu_idx][task_idx] = total_offset;
-			output_offset[dpu_idx][task_idx] = i * dblock_size;
-			task_idx++;
+		default:
+			status = SNAPPY_INVALID_INPUT;
+			break;
 		}
 
-		// Read the compressed block size
-		uint32_t compressed_size = read_uint32(input);
-		input->curr += compressed_size;
-		
-		total_offset += compressed_size + sizeof(uint32_t);	
-		task_blocks++;
+		if ((status == SNAPPY_OK) && (d.op != d.op_end)) {
+			fprintf(stderr, "Block %u decompressed to the wrong length\n", i);
+			status = SNAPPY_INVALID_INPUT;
+		}
+		if ((status == SNAPPY_OK) && (index->flags & SNAPPY_FLAG_CRC32C) &&
+				(crc32c_mask(crc32c_host(CRC32C_INIT, d.op_base, d.op_end - d.op_base)) != index->crc[i])) {
+			fprintf(stderr, "Block %u failed its checksum\n", i);
+			status = SNAPPY_INVALID_INPUT;
+		}
+		if (status != SNAPPY_OK) {
+			worker->status = status;
+			break;
+		}
 	}
-	input->curr = input_start; // Reset the pointer back to start for copying data to the DPU
 
-	gettimeofday(&end, NULL);
-	runtime->pre += get_runtime(&start, &end);
+	return NULL;
+}
 
-	// Allocate the DPUs
-	gettimeofday(&start, NULL);
-	struct dpu_set_t dpus;
-	struct dpu_set_t dpu_rank;
-	struct dpu_set_t dpu;
-	DPU_ASSERT(dpu_alloc(NR_DPUS, NULL, &dpus));
-	gettimeofday(&end, NULL);
-	runtime->d_alloc = get_runtime(&start, &end);	
 
-	gettimeofday(&start, NULL);	
-	DPU_ASSERT(dpu_load(dpus, DPU_DECOMPRESS_PROGRAM, NULL));
-	gettimeofday(&end, NULL);
-	runtime->load = get_runtime(&start, &end);
+/**
+ * Walk the tags of one block and check that it is well formed, without
+ * writing any output. Literals are skipped over, and copy offsets are checked
+ * against the running output position plus the length of the history before
+ * the block.
+ *
+ * @param ip: start of the compressed block
+ * @param ip_end: end of the compressed block
+ * @param max_length: largest decompressed length the block may have
+ * @param history_length: length of the preset dictionary or the previous
+ *                        block of a chained group, 0 if there is neither
+ * @param length[out]: decompressed length of the block
+ * @return SNAPPY_OK if the block is well formed, error code otherwise
+ */
+static snappy_status validate_block_host(const uint8_t *ip, const uint8_t *ip_end, uint32_t max_length, uint32_t history_length, uint32_t *length)
+{
+	uint32_t pos = 0;
+	while (ip < ip_end) {
+		const uint8_t tag = *ip++;
+		const uint16_t entry = char_table[tag];
+		const uint32_t extra = entry >> 11;
+		if (extra > (size_t)(ip_end - ip))
+			return SNAPPY_INVALID_INPUT;
 
-	// Calculate input length without header and aligned output length
-	gettimeofday(&start, NULL);
-	uint32_t total_input_length = input->length - (input->curr - input->buffer);
-	uint32_t aligned_output_length = ALIGN(output->length, 8);
+		uint32_t trailer;
+		if ((ip_end - ip) >= (long)sizeof(uint32_t)) {
+			trailer = load_le32(ip) & wordmask[extra];
+		}
+		else {
+			trailer = 0;
+			for (uint32_t i = 0; i < extra; i++)
+				trailer |= (uint32_t)ip[i] << (i << 3);
+		}
+		ip += extra;
 
-	uint32_t input_length;
-	uint32_t output_length;
+		uint32_t element_length = (entry & 0xFF);
+		if (GET_ELEMENT_TYPE(tag) == EL_TYPE_LITERAL) {
+			element_length += trailer;
+			if (element_length > (size_t)(ip_end - ip))
+				return SNAPPY_INVALID_INPUT;
+			ip += element_length;
+		}
+		else {
+			uint32_t offset = (entry & 0x700) + trailer;
+			if ((offset - 1) >= (pos + history_length))
+				return SNAPPY_INVALID_INPUT;
+		}
 
-	dpu_idx = 0;
-	DPU_RANK_FOREACH(dpus, dpu_rank) {
-#ifdef BULK_XFER
-		uint32_t largest_input_length = 0;
-		uint32_t starting_dpu_idx = dpu_idx;
-#endif
-		DPU_FOREACH(dpu_rank, dpu) {
-			// Check to get rid of array bounds compiler warning
-			if (dpu_idx >= NR_DPUS)
-				break; 
-
-			// Calculate input and output lengths for each DPU
-			if ((dpu_idx != (NR_DPUS - 1)) && (input_offset[dpu_idx + 1][0] != 0)) {
-				input_length = input_offset[dpu_idx + 1][0] - input_offset[dpu_idx][0];
-				output_length = output_offset[dpu_idx + 1][0] - output_offset[dpu_idx][0];
-			}
-			else if ((dpu_idx == 0) || (input_offset[dpu_idx][0] != 0)) {
-				input_length = total_input_length - input_offset[dpu_idx][0];
-				output_length = aligned_output_length - output_offset[dpu_idx][0];
-			}
-			else {
-				input_length = 0;
-				output_length = 0;
-			}
+		if (element_length > (max_length - pos))
+			return SNAPPY_INVALID_INPUT;
+		pos += element_length;
+	}
 
-			DPU_ASSERT(dpu_copy_to(dpu, "input_length", 0, &input_length, sizeof(uint32_t)));
-			DPU_ASSERT(dpu_copy_to(dpu, "output_length", 0, &output_length, sizeof(uint32_t)));
+	*length = pos;
+	return SNAPPY_OK;
+}
 
-#ifdef BULK_XFER
-			if (largest_input_length < input_length)
-				largest_input_length = input_length;
+/**
+ * Work given to one host validation thread.
+ */
+struct validate_worker {
+	struct block_index *index;
+	uint32_t *block_lengths;	// Decompressed length of each block
+	uint32_t first_block;		// First block this thread checks
+	uint32_t last_block;		// One past the last block this thread checks
+	snappy_status status;		// Result of the thread
+};
 
-			// If all prepared transfers have a larger transfer length by some margin then we have reached 
-			// the last DPU. Push existing transfers first to prevent segfault of copying too much data
-			if ((input_length + 30000) < largest_input_length) {
-				DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_TO_DPU, "input_buffer", 0, ALIGN(largest_input_length, 8), DPU_XFER_DEFAULT));
-				largest_input_length = input_length;
-			}
+/**
+ * Validate a contiguous range of blocks and record their decompressed
+ * lengths. Every block but the last must decompress to exactly dblock_size.
+ *
+ * @param arg: struct validate_worker describing the range
+ * @return NULL
+ */
+static void *validate_worker_fn(void *arg)
+{
+	struct validate_worker *worker = arg;
+	struct block_index *index = worker->index;
 
-			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)(input->curr + input_offset[dpu_idx][0])));
-#else
-			DPU_ASSERT(dpu_copy_to(dpu, "input_offset", 0, input_offset[dpu_idx], sizeof(uint32_t) * NR_TASKLETS));
-			DPU_ASSERT(dpu_copy_to(dpu, "output_offset", 0, output_offset[dpu_idx], sizeof(uint32_t) * NR_TASKLETS));
-			DPU_ASSERT(dpu_copy_to(dpu, "input_buffer", 0, input->curr + input_offset[dpu_idx][0], ALIGN(input_length,8)));
-#endif
-			dpu_idx++;
-		}
+	for (uint32_t i = worker->first_block; i < worker->last_block; i++) {
+		uint32_t expected = index->dblock_size;
+		if (i == (index->num_blocks - 1))
+			expected = index->dlength - i * index->dblock_size;
 
-#ifdef BULK_XFER
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_TO_DPU, "input_buffer", 0, ALIGN(largest_input_length, 8), DPU_XFER_DEFAULT));
+		uint32_t history_length = index->dict_length;
+		if ((i % index->group_blocks) != 0)
+			history_length = index->dblock_size;
 
-		dpu_idx = starting_dpu_idx;
-		DPU_FOREACH(dpu_rank, dpu) {
-			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)input_offset[dpu_idx]));
-			dpu_idx++;
-		}
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_TO_DPU, "input_offset", 0, sizeof(uint32_t) * NR_TASKLETS, DPU_XFER_DEFAULT));
+		snappy_status status = SNAPPY_OK;
+		switch (index->type[i]) {
+		case BLOCK_TYPE_SNAPPY:
+			status = validate_block_host(index->block[i], index->block[i] + index->compressed_size[i],
+					index->dblock_size, history_length, &worker->block_lengths[i]);
+			break;
+
+		case BLOCK_TYPE_RAW:
+			worker->block_lengths[i] = index->compressed_size[i];
+			break;
 
-		dpu_idx = starting_dpu_idx;
-		DPU_FOREACH(dpu_rank, dpu) {
-			DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)output_offset[dpu_idx]));
-			dpu_idx++;
+		case BLOCK_TYPE_RUN:
+			// A run fills whatever the block's decompressed length is
+			worker->block_lengths[i] = expected;
+			if (index->compressed_size[i] != 1)
+				status = SNAPPY_INVALID_INPUT;
+			break;
+
+		default:
+			status = SNAPPY_INVALID_INPUT;
+			break;
+		}
+		if ((status == SNAPPY_OK) && (worker->block_lengths[i] != expected)) {
+			fprintf(stderr, "Block %u decompresses to %u bytes, expected %u\n", i, worker->block_lengths[i], expected);
+			status = SNAPPY_INVALID_INPUT;
+		}
+		if (status != SNAPPY_OK) {
+			worker->status = status;
+			break;
 		}
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_TO_DPU, "output_offset", 0, sizeof(uint32_t) * NR_TASKLETS, DPU_XFER_DEFAULT));
-#endif
 	}
 
-	gettimeofday(&end, NULL);
-	runtime->copy_in = get_runtime(&start, &end);
+	return NULL;
+}
 
-	// Launch all DPUs
-	int ret = dpu_launch(dpus, DPU_SYNCHRONOUS);
-	if (ret != 0)
-	{
-		DPU_ASSERT(dpu_free(dpus));
-		return SNAPPY_INVALID_INPUT;
-	}
 
-	// Deallocate the DPUs
-	runtime->copy_out = 0;
-	dpu_idx = 0;
-	DPU_RANK_FOREACH(dpus, dpu_rank) {
-		uint32_t starting_dpu_idx = dpu_idx;
-		gettimeofday(&start, NULL);
-#ifdef BULK_XFER
-		uint32_t largest_output_length = 0;
-#endif
-		DPU_FOREACH(dpu_rank, dpu) {
-			// Get the results back from the DPU
-			DPU_ASSERT(dpu_copy_from(dpu, "output_length", 0, &output_length, sizeof(uint32_t)));
-			if (output_length != 0) {	
-#ifdef BULK_XFER
-				if (largest_output_length < output_length)
-					largest_output_length = output_length;
-
-				DPU_ASSERT(dpu_prepare_xfer(dpu, (void *)(output->buffer + output_offset[dpu_idx][0])));
-#else
-			DPU_ASSERT(dpu_copy_from(dpu, "output_buffer", 0, output->buffer + output_offset[dpu_idx][0], ALIGN(output_length, 8)));
-#endif		
-			}
+snappy_status setup_decompression(struct host_buffer_context *input, struct host_buffer_context *output, struct program_runtime *runtime)
+{
+	struct timeval start;
+	struct timeval end;
+	gettimeofday(&start, NULL);
 
-			dpu_idx++;
-		}
-#ifdef BULK_XFER	
-		DPU_ASSERT(dpu_push_xfer(dpu_rank, DPU_XFER_FROM_DPU, "output_buffer", 0, ALIGN(largest_output_length, 8), DPU_XFER_DEFAULT));
-#endif
-	
-		gettimeofday(&end, NULL);
-		runtime->copy_out += get_runtime(&start, &end);
+	// Read the decompressed length, and leave out the end of the stream if
+	// it was written with SNAPPY_FLAG_STREAM
+	uint32_t dlength;
+	if (!read_decompressed_length(input, &dlength, &input->length)) {
+		fprintf(stderr, "Failed to read decompressed length\n");
+		return SNAPPY_INVALID_INPUT;
+	}
 
-		// Print the logs
-		dpu_idx = starting_dpu_idx;
-		DPU_FOREACH(dpu_rank, dpu) {
-			printf("------DPU %d Logs------\n", dpu_idx);
-			DPU_ASSERT(dpu_log_read(dpu, stdout));
-			dpu_idx++;
-		}	
+	// Check that uncompressed length is within the max we can store
+	if (dlength > output->max) {
+		fprintf(stderr, "Output length is to big: max=%ld len=%d\n", output->max, dlength);
+		return SNAPPY_BUFFER_TOO_SMALL;
 	}
 
-	gettimeofday(&start, NULL);
-	DPU_ASSERT(dpu_free(dpus));
-	gettimeofday(&end, NULL);
-	runtime->d_free = get_runtime(&start, &end);
-	
-	return SNAPPY_OK;
-}	
+	// Allocate output buffer
+	output->buffer = malloc((ALIGN(dlength, 8) | BITMASK(11)) + HOST_OUTPUT_SLOP);
+	output->curr = output->buffer;
+	output->length = dlength;
+
+	gettimeofday(&end, NULL);
+	runtime->pre = get_runtime(&start, &end);
+
+	return SNAPPY_OK;
+}
+
+
+snappy_status snappy_decompress_host(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t nr_threads, const struct snappy_dictionary *dict)
+{
+	// Read the decompressed block size and format flags
+	uint32_t dblock_size;
+	uint32_t flags;
+	uint32_t dict_id;
+	uint32_t group_blocks;
+	if (!read_block_size_header(input, &dblock_size, &flags, &dict_id, &group_blocks)) {
+		fprintf(stderr, "Failed to read decompressed block size\n");
+		return SNAPPY_INVALID_INPUT;
+	}
+	if (!check_dictionary(flags, dict_id, dict))
+		return SNAPPY_INVALID_INPUT;
+
+	struct block_index index;
+	snappy_status status = build_block_index(input, output->length, dblock_size, flags, group_blocks,
+			(flags & SNAPPY_FLAG_DICT) ? dict : NULL, &index);
+	if (status != SNAPPY_OK)
+		return status;
+
+	// Give each thread a contiguous range of whole groups of blocks
+	uint32_t blocks_per_thread = get_blocks_per_thread(index.num_blocks, group_blocks, &nr_threads);
+
+	struct decompress_worker *workers = malloc(sizeof(struct decompress_worker) * nr_threads);
+	for (uint32_t i = 0; i < nr_threads; i++) {
+		workers[i].index = &index;
+		workers[i].output = output;
+		workers[i].first_block = MIN(i * blocks_per_thread, index.num_blocks);
+		workers[i].last_block = MIN((i + 1) * blocks_per_thread, index.num_blocks);
+		workers[i].status = SNAPPY_OK;
+	}
+
+	if (run_host_threads(nr_threads, decompress_worker_fn, workers, sizeof(struct decompress_worker)))
+		status = SNAPPY_BUFFER_TOO_SMALL;
+
+	for (uint32_t i = 0; i < nr_threads; i++) {
+		if (workers[i].status != SNAPPY_OK)
+			status = workers[i].status;
+	}
+
+	output->curr = output->buffer + output->length;
+	input->curr = input->buffer + input->length;
+
+	free(workers);
+	free_block_index(&index);
+	return status;
+}
+
+
+snappy_status snappy_validate_host(struct host_buffer_context *input, uint32_t nr_threads, const struct snappy_dictionary *dict, uint32_t **block_lengths, uint32_t *num_blocks,
+								   uint32_t *type_blocks, uint32_t *dlength)
+{
+	// Read the decompressed length and block size, leaving input as it is
+	struct host_buffer_context body = *input;
+	uint32_t dblock_size;
+	uint32_t flags;
+	uint32_t dict_id;
+	uint32_t group_blocks;
+	if (!read_decompressed_length(&body, dlength, &body.length) || !read_block_size_header(&body, &dblock_size, &flags, &dict_id, &group_blocks)) {
+		fprintf(stderr, "Failed to read the stream header\n");
+		return SNAPPY_INVALID_INPUT;
+	}
+	if (!check_dictionary(flags, dict_id, dict))
+		return SNAPPY_INVALID_INPUT;
+
+	struct block_index index;
+	snappy_status status = build_block_index(&body, *dlength, dblock_size, flags, group_blocks,
+			(flags & SNAPPY_FLAG_DICT) ? dict : NULL, &index);
+	if (status != SNAPPY_OK)
+		return status;
+
+	uint32_t blocks_per_thread = get_blocks_per_thread(index.num_blocks, group_blocks, &nr_threads);
+
+	uint32_t *lengths = malloc(sizeof(uint32_t) * (index.num_blocks + 1));
+	struct validate_worker *workers = malloc(sizeof(struct validate_worker) * nr_threads);
+	for (uint32_t i = 0; i < nr_threads; i++) {
+		workers[i].index = &index;
+		workers[i].block_lengths = lengths;
+		workers[i].first_block = MIN(i * blocks_per_thread, index.num_blocks);
+		workers[i].last_block = MIN((i + 1) * blocks_per_thread, index.num_blocks);
+		workers[i].status = SNAPPY_OK;
+	}
+
+	if (run_host_threads(nr_threads, validate_worker_fn, workers, sizeof(struct validate_worker)))
+		status = SNAPPY_BUFFER_TOO_SMALL;
+
+	for (uint32_t i = 0; i < nr_threads; i++) {
+		if (workers[i].status != SNAPPY_OK)
+			status = workers[i].status;
+	}
+
+	*num_blocks = index.num_blocks;
+	if (type_blocks != NULL) {
+		memset(type_blocks, 0, sizeof(uint32_t) * NR_BLOCK_TYPES);
+		for (uint32_t i = 0; i < index.num_blocks; i++) {
+			if (index.type[i] < NR_BLOCK_TYPES)
+				type_blocks[index.type[i]]++;
+		}
+	}
+	if ((status == SNAPPY_OK) && (block_lengths != NULL))
+		*block_lengths = lengths;
+	else
+		free(lengths);
+
+	free(workers);
+	free_block_index(&index);
+	return status;
+}
+
+/**
+ * What a decompression stream is waiting for.
+ */
+enum decompress_stream_state {
+	STREAM_READ_HEADER,			// The stream header
+	STREAM_READ_BLOCK_HEADER,	// The header of the next block
+	STREAM_READ_BLOCK,			// The compressed data of the current block
+	STREAM_READ_LENGTH,			// The decompressed length after the last block
+	STREAM_DONE,				// Nothing, the whole stream has been read
+	STREAM_FAILED				// Nothing, the stream is invalid
+};
+
+/**
+ * State of an incremental decompression. Compressed data is gathered one
+ * block at a time, unless the caller passes in a whole block at once, and
+ * each block is decoded into a buffer that the caller drains.
+ */
+struct snappy_decompress_stream {
+	enum decompress_stream_state state;
+	uint32_t flags;					// Format flags of the stream
+	const struct snappy_dictionary *dict;	// Preset dictionary given by the caller, or NULL
+	uint32_t group_blocks;			// Blocks in each group, 1 if blocks are not chained
+	uint32_t dblock_size;			// Decompressed size of every block but the last
+	uint64_t dlength;				// Decompressed length of the stream, once known
+	uint64_t total_length;			// Decompressed length of the blocks decoded so far
+	uint8_t gather[STREAM_GATHER_LENGTH];	// Header bytes gathered from the caller
+	uint32_t gather_length;			// Length of the bytes in gather
+	uint32_t compressed_size;		// Compressed size of the current block
+	uint8_t type;					// BLOCK_TYPE_* encoding of the current block
+	uint32_t crc;					// Masked CRC32C of the current block, if the stream has them
+	uint8_t *compressed;			// Compressed data of the current block, gathered from the caller
+	uint32_t compressed_length;		// Length of the data in compressed
+	uint8_t *window;				// The previous block of the group with SNAPPY_FLAG_CHAINED, followed by block
+	uint8_t *block;					// Decompressed data of the current block
+	uint32_t pending_start;			// First byte of block not yet handed to the caller
+	uint32_t pending_end;			// End of the decompressed data in block
+	bool pending_run;				// A run block was read whose length is only known once the next header is
+	uint8_t run_value;				// Byte repeated by the pending run block
+	uint32_t run_crc;				// Masked CRC32C of the pending run block
+	bool short_block;				// A block shorter than the block size was decoded, so no more may follow
+};
+
+/**
+ * Largest compressed size a block of a stream may have. Blocks that do not
+ * get smaller are normally stored raw, but older streams may hold Snappy data
+ * up to the bound used by the compressor.
+ */
+static inline uint32_t stream_max_compressed_size(uint32_t dblock_size)
+{
+	return 32 + dblock_size + dblock_size / 6;
+}
+
+/**
+ * Parse the stream header from gathered bytes.
+ *
+ * @param stream: decompression stream
+ * @param ptr[in,out]: start of the header, moved past it if it was read
+ * @param end: end of the gathered bytes
+ * @return 1 if the header was read, 0 if more bytes are needed, -1 if it is invalid
+ */
+static int parse_stream_header(struct snappy_decompress_stream *stream, const uint8_t **ptr, const uint8_t *end)
+{
+	uint64_t dlength;
+	uint64_t dblock_size;
+	uint64_t flags = 0;
+	uint64_t dict_id = 0;
+	uint64_t group_blocks = 1;
+	int ret;
+
+	if ((ret = parse_varint64(ptr, end, &dlength)) != 1)
+		return ret;
+	if ((ret = parse_varint64(ptr, end, &dblock_size)) != 1)
+		return ret;
+	if (dblock_size == 0) {
+		if ((ret = parse_varint64(ptr, end, &flags)) != 1)
+			return ret;
+		if ((ret = parse_varint64(ptr, end, &dblock_size)) != 1)
+			return ret;
+		if ((flags & SNAPPY_FLAG_DICT) && ((ret = parse_varint64(ptr, end, &dict_id)) != 1))
+			return ret;
+		if ((flags & SNAPPY_FLAG_CHAINED) && ((ret = parse_varint64(ptr, end, &group_blocks)) != 1))
+			return ret;
+	}
+
+	if ((dlength > UINT32_MAX) || (dblock_size > MAX_FILE_LENGTH) || (flags & ~(uint64_t)SUPPORTED_FLAGS) || (dict_id > UINT32_MAX) ||
+			(group_blocks == 0) || (group_blocks > UINT32_MAX) || ((flags & SNAPPY_FLAG_DICT) && (flags & SNAPPY_FLAG_CHAINED))) {
+		fprintf(stderr, "Unsupported stream header\n");
+		return -1;
+	}
+	if ((dblock_size == 0) && ((dlength != 0) || (flags & SNAPPY_FLAG_STREAM))) {
+		fprintf(stderr, "Invalid decompressed block size\n");
+		return -1;
+	}
+	if (!check_dictionary(flags, dict_id, stream->dict))
+		return -1;
+
+	stream->dlength = dlength;
+	stream->dblock_size = dblock_size;
+	stream->flags = flags;
+	stream->group_blocks = group_blocks;
+	return 1;
+}
+
+/**
+ * Gather a header that ends with a varint, and parse it once it is complete.
+ * Bytes past the header are left to the caller.
+ *
+ * @param stream: decompression stream
+ * @param in: caller's input
+ * @param available: length of in
+ * @param used[out]: bytes of in that belong to the header
+ * @return 1 if the header was read, 0 if more bytes are needed, -1 if it is invalid
+ */
+static int gather_stream_varints(struct snappy_decompress_stream *stream, const uint8_t *in, size_t available, size_t *used)
+{
+	uint32_t old_length = stream->gather_length;
+	uint32_t len = MIN(available, STREAM_GATHER_LENGTH - old_length);
+	memcpy(stream->gather + old_length, in, len);
+	stream->gather_length += len;
+
+	const uint8_t *ptr = stream->gather;
+	const uint8_t *end = stream->gather + stream->gather_length;
+	int ret;
+	if (stream->state == STREAM_READ_HEADER) {
+		ret = parse_stream_header(stream, &ptr, end);
+	}
+	else {
+		ret = parse_varint64(&ptr, end, &stream->dlength);
+	}
+
+	if ((ret == 0) && (stream->gather_length == STREAM_GATHER_LENGTH))
+		ret = -1;
+	if (ret == 1) {
+		*used = (ptr - stream->gather) - old_length;
+		stream->gather_length = 0;
+	}
+	else {
+		*used = len;
+	}
+	return ret;
+}
+
+/**
+ * Finish a decoded block: check its checksum and hand it to the caller.
+ *
+ * @param stream: decompression stream
+ * @param length: decompressed length of the block
+ * @param crc: masked CRC32C of the block, if the stream has them
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status finish_stream_block(struct snappy_decompress_stream *stream, uint32_t length, uint32_t crc)
+{
+	if ((stream->flags & SNAPPY_FLAG_CRC32C) &&
+			(crc32c_mask(crc32c_host(CRC32C_INIT, stream->block, length)) != crc)) {
+		fprintf(stderr, "Block at %lu failed its checksum\n", (unsigned long)stream->total_length);
+		return SNAPPY_INVALID_INPUT;
+	}
+
+	if (length < stream->dblock_size)
+		stream->short_block = true;
+	stream->total_length += length;
+	stream->pending_start = 0;
+	stream->pending_end = length;
+	return SNAPPY_OK;
+}
+
+/**
+ * Decode the current block of a stream.
+ *
+ * @param stream: decompression stream
+ * @param data: compressed data of the block
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status decode_stream_block(struct snappy_decompress_stream *stream, const uint8_t *data)
+{
+	// Only the header of a later block or the end of the stream tells
+	// whether a block of a stream without a known length is its last
+	uint32_t expected = stream->dblock_size;
+	if (!(stream->flags & SNAPPY_FLAG_STREAM))
+		expected = MIN(stream->dblock_size, stream->dlength - stream->total_length);
+
+	struct host_decoder d;
+	d.ip = data;
+	d.ip_end = data + stream->compressed_size;
+	d.op_base = stream->block;
+	d.op_window = stream->block;
+	d.op = stream->block;
+	d.op_end = stream->block + expected;
+	d.op_slop = stream->block + stream->dblock_size + HOST_OUTPUT_SLOP;
+	d.dict_end = NULL;
+	d.dict_length = 0;
+	if (stream->flags & SNAPPY_FLAG_DICT) {
+		d.dict_end = stream->dict->data + stream->dict->length;
+		d.dict_length = stream->dict->length;
+	}
+
+	// Move the previous block of the group right before this one, every
+	// block before this one was full
+	uint64_t block_index = stream->total_length / stream->dblock_size;
+	if ((stream->type == BLOCK_TYPE_SNAPPY) && ((block_index % stream->group_blocks) != 0)) {
+		memcpy(stream->window, stream->block, stream->dblock_size);
+		d.op_window = stream->window;
+	}
+
+	snappy_status status = SNAPPY_OK;
+	switch (stream->type) {
+	case BLOCK_TYPE_SNAPPY:
+		status = decompress_block_host(&d);
+		break;
+
+	case BLOCK_TYPE_RAW:
+		if (stream->compressed_size > expected)
+			return SNAPPY_INVALID_INPUT;
+		memcpy(d.op, d.ip, stream->compressed_size);
+		d.op += stream->compressed_size;
+		break;
+
+	case BLOCK_TYPE_RUN:
+		if (stream->compressed_size != 1)
+			return SNAPPY_INVALID_INPUT;
+		if (stream->flags & SNAPPY_FLAG_STREAM) {
+			stream->pending_run = true;
+			stream->run_value = *d.ip;
+			stream->run_crc = stream->crc;
+			return SNAPPY_OK;
+		}
+		memset(d.op, *d.ip, expected);
+		d.op = d.op_end;
+		break;
+
+	default:
+		return SNAPPY_INVALID_INPUT;
+	}
+
+	if (status != SNAPPY_OK)
+		return status;
+	if (!(stream->flags & SNAPPY_FLAG_STREAM) && (d.op != d.op_end)) {
+		fprintf(stderr, "Block at %lu decompressed to the wrong length\n", (unsigned long)stream->total_length);
+		return SNAPPY_INVALID_INPUT;
+	}
+
+	return finish_stream_block(stream, d.op - d.op_base, stream->crc);
+}
+
+/**
+ * Fill in a run block once its length is known.
+ *
+ * @param stream: decompression stream, with a pending run block
+ * @param length: decompressed length of the run block
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status fill_stream_run(struct snappy_decompress_stream *stream, uint64_t length)
+{
+	stream->pending_run = false;
+	if ((length == 0) || (length > stream->dblock_size))
+		return SNAPPY_INVALID_INPUT;
+
+	memset(stream->block, stream->run_value, length);
+	return finish_stream_block(stream, length, stream->run_crc);
+}
+
+/**
+ * Check if the gathered bytes start with the end marker of a stream with
+ * SNAPPY_FLAG_STREAM, which has no checksum after it.
+ *
+ * @param stream: decompression stream
+ * @return True if the blocks of the stream have ended
+ */
+static inline bool at_stream_end_marker(struct snappy_decompress_stream *stream)
+{
+	return (stream->flags & SNAPPY_FLAG_STREAM) && (stream->gather_length >= sizeof(uint32_t)) &&
+		(load_le32(stream->gather) == STREAM_END_MARKER);
+}
+
+/**
+ * Read the header of the next block, once it has been gathered.
+ *
+ * @param stream: decompression stream
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status read_stream_block_header(struct snappy_decompress_stream *stream)
+{
+	bool end = at_stream_end_marker(stream);
+	struct host_buffer_context header = {
+		.buffer = stream->gather,
+		.curr = stream->gather,
+		.length = stream->gather_length
+	};
+	uint32_t size = read_uint32(&header);
+	if ((stream->flags & SNAPPY_FLAG_CRC32C) && !end)
+		stream->crc = read_uint32(&header);
+	stream->gather_length = 0;
+
+	if (end) {
+		stream->state = STREAM_READ_LENGTH;
+		return SNAPPY_OK;
+	}
+	if (stream->short_block || (GET_BLOCK_SIZE(size) > stream_max_compressed_size(stream->dblock_size))) {
+		fprintf(stderr, "Invalid block header at %lu\n", (unsigned long)stream->total_length);
+		return SNAPPY_INVALID_INPUT;
+	}
+
+	stream->compressed_size = GET_BLOCK_SIZE(size);
+	stream->type = GET_BLOCK_TYPE(size);
+	stream->compressed_length = 0;
+	stream->state = STREAM_READ_BLOCK;
+
+	// The run block before this one was not the last, so it was full
+	if (stream->pending_run)
+		return fill_stream_run(stream, stream->dblock_size);
+	return SNAPPY_OK;
+}
+
+/**
+ * Take as much of the caller's input as the current state needs, and act on
+ * it once it is complete.
+ *
+ * @param stream: decompression stream, with no decompressed data pending
+ * @param in: caller's input
+ * @param available: length of in, not 0
+ * @param used[out]: bytes of in taken
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status step_decompress_stream(struct snappy_decompress_stream *stream, const uint8_t *in, size_t available, size_t *used)
+{
+	int ret;
+	uint32_t history_length;
+	*used = 0;
+
+	switch (stream->state) {
+	case STREAM_READ_HEADER:
+		ret = gather_stream_varints(stream, in, available, used);
+		if (ret != 1)
+			return (ret == 0) ? SNAPPY_OK : SNAPPY_INVALID_INPUT;
+
+		history_length = (stream->flags & SNAPPY_FLAG_CHAINED) ? stream->dblock_size : 0;
+		stream->window = malloc(history_length + stream->dblock_size + HOST_OUTPUT_SLOP);
+		stream->block = stream->window + history_length;
+		stream->compressed = malloc(stream_max_compressed_size(stream->dblock_size));
+		if ((stream->flags & SNAPPY_FLAG_STREAM) || (stream->dlength != 0))
+			stream->state = STREAM_READ_BLOCK_HEADER;
+		else
+			stream->state = STREAM_DONE;
+		return SNAPPY_OK;
+
+	case STREAM_READ_BLOCK_HEADER: {
+		// Gather the block size first, since the end marker is shorter
+		uint32_t need = sizeof(uint32_t);
+		if ((stream->gather_length >= need) && !at_stream_end_marker(stream))
+			need = BLOCK_HEADER_LENGTH(stream->flags);
+
+		uint32_t len = MIN(available, need - stream->gather_length);
+		memcpy(stream->gather + stream->gather_length, in, len);
+		stream->gather_length += len;
+		*used = len;
+		if ((stream->gather_length < need) ||
+				((stream->gather_length < BLOCK_HEADER_LENGTH(stream->flags)) && !at_stream_end_marker(stream)))
+			return SNAPPY_OK;
+		return read_stream_block_header(stream);
+	}
+
+	case STREAM_READ_BLOCK: {
+		const uint8_t *data;
+		if ((stream->compressed_length == 0) && (available >= stream->compressed_size)) {
+			// Whole blocks are decoded straight from the caller's buffer
+			data = in;
+			*used = stream->compressed_size;
+		}
+		else {
+			uint32_t len = MIN(available, stream->compressed_size - stream->compressed_length);
+			memcpy(stream->compressed + stream->compressed_length, in, len);
+			stream->compressed_length += len;
+			*used = len;
+			if (stream->compressed_length < stream->compressed_size)
+				return SNAPPY_OK;
+			data = stream->compressed;
+		}
+
+		snappy_status status = decode_stream_block(stream, data);
+		if (status != SNAPPY_OK)
+			return status;
+
+		if (!(stream->flags & SNAPPY_FLAG_STREAM) && (stream->total_length == stream->dlength))
+			stream->state = STREAM_DONE;
+		else
+			stream->state = STREAM_READ_BLOCK_HEADER;
+		return SNAPPY_OK;
+	}
+
+	case STREAM_READ_LENGTH:
+		ret = gather_stream_varints(stream, in, available, used);
+		if (ret != 1)
+			return (ret == 0) ? SNAPPY_OK : SNAPPY_INVALID_INPUT;
+
+		// The last block is a run, which fills the rest of the stream
+		if (stream->pending_run) {
+			if (stream->dlength < stream->total_length)
+				return SNAPPY_INVALID_INPUT;
+			snappy_status status = fill_stream_run(stream, stream->dlength - stream->total_length);
+			if (status != SNAPPY_OK)
+				return status;
+		}
+
+		if (stream->total_length != stream->dlength) {
+			fprintf(stderr, "Blocks do not match the decompressed length\n");
+			return SNAPPY_INVALID_INPUT;
+		}
+		stream->state = STREAM_DONE;
+		return SNAPPY_OK;
+
+	default:
+		return SNAPPY_INVALID_INPUT;
+	}
+}
+
+struct snappy_decompress_stream *snappy_decompress_stream_init(const struct snappy_dictionary *dict)
+{
+	struct snappy_decompress_stream *stream = calloc(1, sizeof(struct snappy_decompress_stream));
+	stream->state = STREAM_READ_HEADER;
+	stream->dict = dict;
+	return stream;
+}
+
+snappy_status snappy_decompress_stream_feed(struct snappy_decompress_stream *stream, const uint8_t *in, size_t in_length, size_t *consumed, uint8_t *out, size_t out_length, size_t *produced)
+{
+	*consumed = 0;
+	*produced = 0;
+
+	while (true) {
+		// Hand out the current block before decoding the next one
+		if (stream->pending_start != stream->pending_end) {
+			uint32_t len = MIN(stream->pending_end - stream->pending_start, out_length - *produced);
+			memcpy(out + *produced, stream->block + stream->pending_start, len);
+			stream->pending_start += len;
+			*produced += len;
+			if (stream->pending_start != stream->pending_end)
+				return SNAPPY_OK;
+		}
+
+		if (stream->state == STREAM_FAILED)
+			return SNAPPY_INVALID_INPUT;
+		if ((stream->state == STREAM_DONE) || (*consumed == in_length))
+			return SNAPPY_OK;
+
+		size_t used;
+		snappy_status status = step_decompress_stream(stream, in + *consumed, in_length - *consumed, &used);
+		*consumed += used;
+		if (status != SNAPPY_OK) {
+			stream->state = STREAM_FAILED;
+			return status;
+		}
+	}
+}
+
+snappy_status snappy_decompress_stream_flush(struct snappy_decompress_stream *stream, uint8_t *out, size_t out_length, size_t *produced)
+{
+	size_t consumed;
+	snappy_status status = snappy_decompress_stream_feed(stream, NULL, 0, &consumed, out, out_length, produced);
+	if (status != SNAPPY_OK)
+		return status;
+
+	return (stream->pending_start == stream->pending_end) ? SNAPPY_OK : SNAPPY_BUFFER_TOO_SMALL;
+}
+
+snappy_status snappy_decompress_stream_finish(struct snappy_decompress_stream *stream, uint8_t *out, size_t out_length, size_t *produced)
+{
+	snappy_status status = snappy_decompress_stream_flush(stream, out, out_length, produced);
+	if (status != SNAPPY_OK)
+		return status;
+
+	if (stream->state != STREAM_DONE) {
+		fprintf(stderr, "Compressed stream ended early\n");
+		stream->state = STREAM_FAILED;
+		return SNAPPY_INVALID_INPUT;
+	}
+
+	return SNAPPY_OK;
+}
+
+void snappy_decompress_stream_free(struct snappy_decompress_stream *stream)
+{
+	if (stream == NULL)
+		return;
+
+	free(stream->window);
+	free(stream->compressed);
+	free(stream);
+}
+
+/**
+ * A decompression job on the DPUs, for any number of inputs, split into
+ * whole groups of blocks for each DPU and task.
+ */
+struct dpu_decompress_job {
+	struct host_buffer_context *inputs;		// Input of each file
+	struct host_buffer_context *outputs;	// Output of each file
+	struct dpu_batch batch;					// Jobs of each DPU and task
+	struct program_runtime *runtime;		// Time spent on each part
+};
+
+/**
+ * Copy the input blocks and jobs of the DPUs of a rank in.
+ */
+static void decompress_copy_in(struct dpu_set_t dpu_rank, uint32_t dpu_idx, void *arg)
+{
+	struct dpu_decompress_job *job = arg;
+	struct dpu_batch *batch = &job->batch;
+
+	uint32_t nr_dpus;
+	DPU_ASSERT(dpu_get_nr_dpus(dpu_rank, &nr_dpus));
+	uint8_t **buffers = malloc(sizeof(uint8_t *) * nr_dpus);
+	uint32_t *lengths = malloc(sizeof(uint32_t) * nr_dpus);
+	bool *gathered = malloc(sizeof(bool) * nr_dpus);
+
+	uint32_t largest_input_length = 0;
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		if (largest_input_length < batch->input_length[dpu_idx + i])
+			largest_input_length = batch->input_length[dpu_idx + i];
+	}
+
+	// Every DPU is sent the longest input, see dpu_context_xfer
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		gathered[i] = false;
+		lengths[i] = (batch->input_length[dpu_idx + i] != 0) ? ALIGN(largest_input_length, 8) : 0;
+		if (lengths[i] != 0)
+			buffers[i] = dpu_batch_input(batch, dpu_idx + i, job->inputs, lengths[i], &gathered[i]);
+	}
+	job->runtime->copy_in_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_TO_DPU, "input_buffer", buffers, lengths);
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		if (gathered[i])
+			free(buffers[i]);
+	}
+
+	uint32_t largest_jobs = 0;
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		if (largest_jobs < DPU_BATCH_NR_JOBS(batch, dpu_idx + i))
+			largest_jobs = DPU_BATCH_NR_JOBS(batch, dpu_idx + i);
+	}
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		buffers[i] = (uint8_t *)&batch->jobs[batch->first_job[dpu_idx + i]];
+		lengths[i] = (DPU_BATCH_NR_JOBS(batch, dpu_idx + i) != 0) ? (sizeof(struct dpu_job) * largest_jobs) : 0;
+	}
+	job->runtime->copy_in_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_TO_DPU, "job_table", buffers, lengths);
+
+	// Every other value the DPUs read is in their parameters
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		buffers[i] = (uint8_t *)&batch->params[dpu_idx + i];
+		lengths[i] = sizeof(struct dpu_params);
+	}
+	job->runtime->copy_in_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_TO_DPU, "params", buffers, lengths);
+
+	free(buffers);
+	free(lengths);
+	free(gathered);
+}
+
+/**
+ * Copy the decompressed data of the DPUs of a rank out, straight to its
+ * place in the output when a DPU only ran one file, and check it against
+ * the block checksums.
+ */
+static snappy_status decompress_copy_out(struct dpu_set_t dpu_rank, uint32_t dpu_idx, void *arg)
+{
+	struct dpu_decompress_job *job = arg;
+	struct dpu_batch *batch = &job->batch;
+	struct dpu_set_t dpu;
+	struct timeval start;
+	struct timeval end;
+	snappy_status status = SNAPPY_OK;
+
+	gettimeofday(&start, NULL);
+
+	uint32_t nr_dpus;
+	DPU_ASSERT(dpu_get_nr_dpus(dpu_rank, &nr_dpus));
+	uint8_t **buffers = malloc(sizeof(uint8_t *) * nr_dpus);
+	uint32_t *lengths = malloc(sizeof(uint32_t) * nr_dpus);
+	bool *staged = malloc(sizeof(bool) * nr_dpus);
+
+	// Check the output of each task against the block checksums
+	if (batch->flags & SNAPPY_FLAG_CRC32C) {
+		uint32_t *output_crc = malloc(sizeof(uint32_t) * DPU_TASKLET_CRCS * nr_dpus);
+		for (uint32_t i = 0; i < nr_dpus; i++) {
+			buffers[i] = (uint8_t *)&output_crc[DPU_TASKLET_CRCS * i];
+			lengths[i] = sizeof(uint32_t) * DPU_TASKLET_CRCS;
+		}
+		job->runtime->copy_out_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_FROM_DPU, "output_crc", buffers, lengths);
+		for (uint32_t i = 0; i < nr_dpus; i++) {
+			if (!dpu_batch_check_crcs(batch, dpu_idx + i, &output_crc[DPU_TASKLET_CRCS * i]))
+				status = SNAPPY_INVALID_INPUT;
+		}
+		free(output_crc);
+	}
+
+	uint32_t largest_output_length = 0;
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		if (largest_output_length < batch->output_length[dpu_idx + i])
+			largest_output_length = batch->output_length[dpu_idx + i];
+	}
+
+	// Every DPU sends the longest output, see dpu_context_xfer
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		staged[i] = false;
+		lengths[i] = (batch->output_length[dpu_idx + i] != 0) ? ALIGN(largest_output_length, 8) : 0;
+		if (lengths[i] != 0)
+			buffers[i] = dpu_batch_output(batch, dpu_idx + i, job->outputs, lengths[i], &staged[i]);
+	}
+	job->runtime->copy_out_bytes += dpu_context_xfer(dpu_rank, DPU_XFER_FROM_DPU, "output_buffer", buffers, lengths);
+	for (uint32_t i = 0; i < nr_dpus; i++) {
+		if (staged[i])
+			dpu_batch_scatter(batch, dpu_idx + i, job->outputs, buffers[i]);
+	}
+	free(buffers);
+	free(lengths);
+	free(staged);
+
+	gettimeofday(&end, NULL);
+	job->runtime->copy_out += get_runtime(&start, &end);
+
+	// Print the logs
+	uint32_t i = 0;
+	DPU_FOREACH(dpu_rank, dpu) {
+		printf("------DPU %d Logs------\n", dpu_idx + i);
+		DPU_ASSERT(dpu_log_read(dpu, stdout));
+		i++;
+	}
+
+	return status;
+}
+
+static const struct dpu_job_ops decompress_job_ops = {
+	.copy_in = decompress_copy_in,
+	.overlap = NULL,
+	.copy_out = decompress_copy_out
+};
+
+/**
+ * Estimate the cycles a DPU tasklet takes to decompress a block. Blocks that
+ * compress well have fewer tags and literals to read for their length.
+ *
+ * @param type: BLOCK_TYPE_* encoding of the block
+ * @param compressed_size: compressed size of the block
+ * @param length: decompressed length of the block
+ * @return Estimated cycles, see DPU_DECOMPRESS_INPUT_BYTE_CYCLES
+ */
+static inline uint32_t estimate_dpu_decompress_block(uint8_t type, uint32_t compressed_size, uint32_t length)
+{
+	if (type != BLOCK_TYPE_SNAPPY)
+		return DPU_DECOMPRESS_BLOCK_CYCLES + DPU_DECOMPRESS_COPY_BYTE_CYCLES * length;
+	return DPU_DECOMPRESS_BLOCK_CYCLES + DPU_DECOMPRESS_INPUT_BYTE_CYCLES * compressed_size + DPU_DECOMPRESS_OUTPUT_BYTE_CYCLES * length;
+}
+
+/**
+ * Decompressed length of a block of a file.
+ *
+ * @param block: index of the block
+ * @param dblock_size: decompressed size of every block but the last
+ * @param dlength: decompressed length of the file
+ * @param block_lengths: decompressed length of each block, or NULL if every
+ *                       block but the last is full
+ * @return Decompressed length of the block
+ */
+static inline uint32_t dpu_block_length(uint32_t block, uint32_t dblock_size, uint32_t dlength, const uint32_t *block_lengths)
+{
+	if (block_lengths != NULL)
+		return block_lengths[block];
+	return MIN(dblock_size, dlength - block * dblock_size);
+}
+
+/**
+ * Find the format of a file of a batch, from its block size header unless
+ * the file is one round of a stream whose header was read before.
+ *
+ * @param input: holds input buffer information, at the block size header
+ *               if format is NULL, moved past it
+ * @param format: format of the stream the round is from, or NULL
+ * @param file_format[out]: format of the file
+ * @return False if the header could not be read, True otherwise
+ */
+static bool read_batch_format(struct host_buffer_context *input, const struct snappy_stream_format *format, struct snappy_stream_format *file_format)
+{
+	if (format != NULL) {
+		*file_format = *format;
+		return true;
+	}
+	return read_block_size_header(input, &file_format->dblock_size, &file_format->flags, &file_format->dict_id, &file_format->group_blocks);
+}
+
+/**
+ * Read the format of a file of a batch and find where each of its blocks
+ * starts, checking that the blocks are all within the file.
+ *
+ * @param input: holds input buffer information, at the block size header
+ *               (or the first block, with a format), moved to the first block
+ * @param dlength: decompressed length of the file
+ * @param format: format of the stream the file is one round of, or NULL to read it
+ * @param file_format[out]: format of the file
+ * @param index[out]: block locations, must be freed with free_block_index
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status index_dpu_decompress_file(struct host_buffer_context *input, uint32_t dlength, const struct snappy_stream_format *format,
+											   struct snappy_stream_format *file_format, struct block_index *index)
+{
+	if (!read_batch_format(input, format, file_format)) {
+		fprintf(stderr, "Failed to read decompressed block size\n");
+		return SNAPPY_INVALID_INPUT;
+	}
+	return build_block_index(input, dlength, file_format->dblock_size, file_format->flags, file_format->group_blocks, NULL, index);
+}
+
+/**
+ * Estimate the cycles the DPU tasklets take to decompress a whole file, from
+ * the headers of its blocks.
+ *
+ * @param index: block locations of the file
+ * @param block_lengths: decompressed length of each block, or NULL if every
+ *                       block but the last is full
+ * @return Estimated cycles
+ */
+static uint64_t estimate_dpu_decompress_file(const struct block_index *index, const uint32_t *block_lengths)
+{
+	uint64_t work = 0;
+	for (uint32_t i = 0; i < index->num_blocks; i++)
+		work += estimate_dpu_decompress_block(index->type[i], index->compressed_size[i], dpu_block_length(i, index->dblock_size, index->dlength, block_lengths));
+	return work;
+}
+
+/**
+ * Pack the blocks of one compressed file into a batch, in whole groups, and
+ * fold the checksums of each group's blocks into the fold of its task.
+ *
+ * @param batch: batch being packed
+ * @param input: holds input buffer information
+ * @param index: block locations of the file
+ * @param file_format: format of the file
+ * @param file: index of the file in the batch
+ * @param dict: preset dictionary, or NULL if there is none
+ * @param block_lengths: decompressed length of each block, or NULL if every
+ *                       block but the last is full
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status pack_decompress_file(struct dpu_batch *batch, const struct host_buffer_context *input, const struct block_index *index,
+										  const struct snappy_stream_format *file_format, uint32_t file, const struct snappy_dictionary *dict, const uint32_t *block_lengths)
+{
+	uint32_t dblock_size = file_format->dblock_size;
+	uint32_t flags = file_format->flags;
+	uint32_t group_blocks = file_format->group_blocks;
+	if (!check_dictionary(flags, file_format->dict_id, dict))
+		return SNAPPY_INVALID_INPUT;
+	if ((flags & SNAPPY_FLAG_DICT) && (dict->length > SNAPPY_MAX_DICT_LENGTH)) {
+		fprintf(stderr, "The dictionary does not fit in the DPU buffer of %u bytes\n", SNAPPY_MAX_DICT_LENGTH);
+		return SNAPPY_INVALID_INPUT;
+	}
+
+	// Chained blocks are split between DPUs and tasks in whole groups
+	uint32_t num_blocks = index->num_blocks;
+	uint32_t output_offset = 0;
+	for (uint32_t first = 0; first < num_blocks; first += group_blocks) {
+		uint32_t last = MIN(first + group_blocks, num_blocks);
+		uint8_t *group_start = index->block[first] - BLOCK_HEADER_LENGTH(flags);
+		uint32_t work = 0;
+		struct dpu_job group = {
+			.input_length = 0,
+			.output_length = 0,
+			.block_size = dblock_size,
+			.flags = flags,
+			.group_blocks = group_blocks,
+			.file = file
+		};
+
+		for (uint32_t i = first; i < last; i++) {
+			// Use the validated block lengths if we have them, otherwise every
+			// block but the last is full
+			uint32_t length = dpu_block_length(i, dblock_size, index->dlength, block_lengths);
+			group.output_length += length;
+			group.input_length += index->compressed_size[i] + BLOCK_HEADER_LENGTH(flags);
+			work += estimate_dpu_decompress_block(index->type[i], index->compressed_size[i], length);
+		}
+
+		if (!dpu_batch_add(batch, &group, group_start - input->buffer, output_offset, group.output_length, work)) {
+			fprintf(stderr, "The inputs do not fit in the DPUs\n");
+			return SNAPPY_BUFFER_TOO_SMALL;
+		}
+		output_offset += group.output_length;
+
+		// Fold the checksums of the blocks into the task or the job the group went to
+		if (flags & SNAPPY_FLAG_CRC32C) {
+			uint32_t *crc_fold = DPU_BATCH_JOB_CRC_FOLD(batch, batch->nr_jobs - 1);
+			for (uint32_t i = first; i < last; i++)
+				*crc_fold = crc32c_update_word(*crc_fold, index->crc[i]);
+		}
+	}
+
+	return SNAPPY_OK;
+}
+
+/**
+ * Decompress a batch of inputs on the DPUs in one launch.
+ *
+ * @param inputs: holds the buffer information of each input, at its block size header
+ * @param outputs: holds the buffer information of each output, set up by setup_decompression
+ * @param nr_files: number of inputs
+ * @param dict: preset dictionary, or NULL if there is none
+ * @param block_lengths: decompressed length of each block of each input, or NULL
+ * @param format: format of the stream the only input is one round of, its
+ *                blocks then start at the input, or NULL
+ * @param ctx: DPUs kept allocated across jobs, or NULL to allocate them for this job only
+ * @param runtime: struct holding break down of runtimes for different parts of the program
+ * @return SNAPPY_OK if successful, error code otherwise
+ */
+static snappy_status decompress_dpu_batch(struct host_buffer_context *inputs, struct host_buffer_context *outputs, uint32_t nr_files, const struct snappy_dictionary *dict, const uint32_t *const *block_lengths,
+										  const struct snappy_stream_format *format, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	struct timeval start;
+	struct timeval end;
+	gettimeofday(&start, NULL);
+
+	// Find the blocks of every file, and check that they are all there
+	struct snappy_stream_format *file_formats = malloc(sizeof(struct snappy_stream_format) * nr_files);
+	struct block_index *indexes = malloc(sizeof(struct block_index) * nr_files);
+	uint64_t total_length = 0;
+	uint64_t total_work = 0;
+	uint32_t nr_indexed;
+	snappy_status status = SNAPPY_OK;
+	for (nr_indexed = 0; nr_indexed < nr_files; nr_indexed++) {
+		uint32_t f = nr_indexed;
+		uint8_t *input_start = inputs[f].curr;
+		status = index_dpu_decompress_file(&inputs[f], outputs[f].length, format, &file_formats[f], &indexes[f]);
+		inputs[f].curr = input_start; // Reset the pointer back to start for copying data to the DPU
+		if (status != SNAPPY_OK)
+			break;
+
+		total_length += outputs[f].length;
+		total_work += estimate_dpu_decompress_file(&indexes[f], (block_lengths != NULL) ? block_lengths[f] : NULL);
+	}
+
+	// The DPUs are only allocated for this job if the caller does not keep them
+	struct dpu_context local_ctx;
+	if (ctx == NULL) {
+		ctx = &local_ctx;
+		dpu_context_init(ctx, 0, 0, 1, false);
+	}
+
+	// Pack the blocks of every file into the tasks, each task gets an even
+	// share of the work estimated from the block headers
+	struct dpu_decompress_job *job = malloc(sizeof(struct dpu_decompress_job));
+	job->inputs = inputs;
+	job->outputs = outputs;
+	job->runtime = runtime;
+	dpu_batch_init(&job->batch, ctx, total_length, total_work, 1, 0);
+
+	for (uint32_t f = 0; (f < nr_files) && (status == SNAPPY_OK); f++)
+		status = pack_decompress_file(&job->batch, &inputs[f], &indexes[f], &file_formats[f], f, dict, (block_lengths != NULL) ? block_lengths[f] : NULL);
+	for (uint32_t f = 0; f < nr_indexed; f++)
+		free_block_index(&indexes[f]);
+	free(indexes);
+	free(file_formats);
+	dpu_batch_finish(&job->batch);
+	if (status == SNAPPY_OK)
+		dpu_batch_report(&job->batch);
+
+	gettimeofday(&end, NULL);
+	runtime->pre += get_runtime(&start, &end);
+
+	if ((status == SNAPPY_OK) && (job->batch.nr_jobs != 0)) {
+		// Allocate the DPUs, unless the caller keeps them allocated across jobs
+		dpu_context_load(ctx, DPU_DECOMPRESS_PROGRAM, runtime);
+
+		// Every DPU gets the whole dictionary, padded to the MRAM transfer
+		// size, this is counted as part of the copy in. Its length goes with
+		// the parameters of each DPU.
+		double broadcast_time = 0;
+		uint64_t broadcast_bytes = 0;
+		if (job->batch.flags & SNAPPY_FLAG_DICT) {
+			gettimeofday(&start, NULL);
+			uint8_t *dict_buffer = calloc(ALIGN(dict->length, 8), 1);
+			memcpy(dict_buffer, dict->data, dict->length);
+			DPU_ASSERT(dpu_broadcast_to(ctx->dpus, "dictionary_buffer", 0, dict_buffer, ALIGN(dict->length, 8), DPU_XFER_DEFAULT));
+			free(dict_buffer);
+			for (uint32_t i = 0; i < job->batch.nr_dpus; i++)
+				job->batch.params[i].dictionary_length = dict->length;
+			gettimeofday(&end, NULL);
+			broadcast_time = get_runtime(&start, &end);
+			broadcast_bytes = (uint64_t)ALIGN(dict->length, 8) * job->batch.nr_dpus;
+		}
+
+		// Copy the input in, run the DPUs and copy the output out, one wave of ranks at a time
+		runtime->copy_out = 0;
+		runtime->copy_out_bytes = 0;
+		status = dpu_context_run(ctx, &decompress_job_ops, job, runtime);
+		runtime->copy_in += broadcast_time;
+		runtime->copy_in_bytes += broadcast_bytes;
+
+		dpu_context_release(ctx, runtime);
+	}
+
+	dpu_batch_free(&job->batch);
+	free(job);
+	return status;
+}
+
+snappy_status snappy_decompress_dpu_batch(struct host_buffer_context *inputs, struct host_buffer_context *outputs, uint32_t nr_files, const struct snappy_dictionary *dict, const uint32_t *const *block_lengths, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	return decompress_dpu_batch(inputs, outputs, nr_files, dict, block_lengths, NULL, ctx, runtime);
+}
+
+snappy_status snappy_decompress_dpu(struct host_buffer_context *input, struct host_buffer_context *output, const struct snappy_dictionary *dict, const uint32_t *block_lengths, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	return decompress_dpu_batch(input, output, 1, dict, &block_lengths, NULL, ctx, runtime);
+}
+
+snappy_status snappy_read_stream_format(struct host_buffer_context *input, const struct snappy_dictionary *dict, struct snappy_stream_format *format)
+{
+	if (!read_varint32(input, &format->dlength) ||
+			!read_block_size_header(input, &format->dblock_size, &format->flags, &format->dict_id, &format->group_blocks)) {
+		fprintf(stderr, "Failed to read the stream header\n");
+		return SNAPPY_INVALID_INPUT;
+	}
+	if ((format->dblock_size == 0) || !check_dictionary(format->flags, format->dict_id, dict))
+		return SNAPPY_INVALID_INPUT;
+
+	return SNAPPY_OK;
+}
+
+size_t snappy_next_dpu_round(const struct snappy_stream_format *format, const uint8_t *blocks, size_t available, uint32_t first_block,
+							 size_t max_length, uint32_t *nr_blocks, uint32_t *length)
+{
+	uint32_t num_blocks = (format->dlength + format->dblock_size - 1) / format->dblock_size;
+	size_t header_length = BLOCK_HEADER_LENGTH(format->flags);
+	size_t used = 0;
+	uint32_t block = first_block;
+	*length = 0;
+
+	// Take whole groups for as long as they are all there and fit
+	while (block < num_blocks) {
+		uint32_t last = MIN(block + format->group_blocks, num_blocks);
+		size_t group_used = used;
+		uint64_t group_length = *length;
+		uint32_t i;
+		for (i = block; (i < last) && ((group_used + header_length) <= available); i++) {
+			group_used += header_length + GET_BLOCK_SIZE(load_le32(blocks + group_used));
+			group_length += dpu_block_length(i, format->dblock_size, format->dlength, NULL);
+		}
+		if ((i < last) || (group_used > available) || (group_length > max_length))
+			break;
+
+		used = group_used;
+		*length = group_length;
+		block = last;
+	}
+
+	*nr_blocks = block - first_block;
+	return used;
+}
+
+snappy_status snappy_decompress_dpu_blocks(struct host_buffer_context *input, struct host_buffer_context *output, const struct snappy_stream_format *format,
+										   const struct snappy_dictionary *dict, struct dpu_context *ctx, struct program_runtime *runtime)
+{
+	return decompress_dpu_batch(input, output, 1, dict, NULL, format, ctx, runtime);
+}
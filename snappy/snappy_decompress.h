@@ -2,6 +2,18 @@
 #define _SNAPPY_DECOMPRESSION_H_
 
 #include "dpu_snappy.h"
+#include "dpu_context.h"
+
+/**
+ * Format of a compressed stream, as read from its header.
+ */
+struct snappy_stream_format {
+	uint32_t dlength;		// Decompressed length of the stream
+	uint32_t dblock_size;	// Decompressed size of each block
+	uint32_t flags;			// Format flags
+	uint32_t dict_id;		// ID of the preset dictionary, if the stream has one
+	uint32_t group_blocks;	// Blocks in each group, 1 if blocks are not chained
+};
 
 /**
  * Prepares the necessary constructs for running decompression.
@@ -15,22 +27,185 @@
 snappy_status setup_decompression(struct host_buffer_context *input, struct host_buffer_context *output, struct program_runtime *runtime);
 
 /**
- * Perform the Snappy decompression on the host.
+ * Perform the Snappy decompression on the host. Blocks are split into
+ * contiguous ranges, one per thread, and each thread decodes its blocks
+ * straight into their final place in the output buffer.
  *
  * @param input: holds input buffer information
  * @param output: holds output buffer information
+ * @param nr_threads: number of host threads to decompress with
+ * @param dict: preset dictionary, needed if the stream was compressed with one, or NULL
  * @return SNAPPY_OK if successful, error code otherwise
  */
-snappy_status snappy_decompress_host(struct host_buffer_context *input, struct host_buffer_context *output);
+snappy_status snappy_decompress_host(struct host_buffer_context *input, struct host_buffer_context *output, uint32_t nr_threads, const struct snappy_dictionary *dict);
+
+/**
+ * Check that a compressed stream is well formed and find its decompressed
+ * length, without writing any output. Every block's tags are walked, copy
+ * offsets are checked against the running output position and block lengths
+ * are checked against the block size. Blocks are split across threads in the
+ * same way as for decompression. Block checksums are not checked, since that
+ * needs the decompressed data. Does not move input->curr.
+ *
+ * @param input: holds input buffer information, curr points at the start of the stream
+ * @param nr_threads: number of host threads to validate with
+ * @param dict: preset dictionary, needed if the stream was compressed with one, or NULL
+ * @param block_lengths[out]: if not NULL, set to a malloc'd array holding the
+ *                            decompressed length of every block
+ * @param num_blocks[out]: number of blocks in the stream
+ * @param type_blocks[out]: if not NULL, set to the number of blocks of each
+ *                          BLOCK_TYPE_*, NR_BLOCK_TYPES entries
+ * @param dlength[out]: decompressed length of the stream
+ * @return SNAPPY_OK if the stream is well formed, error code otherwise
+ */
+snappy_status snappy_validate_host(struct host_buffer_context *input, uint32_t nr_threads, const struct snappy_dictionary *dict, uint32_t **block_lengths, uint32_t *num_blocks,
+								   uint32_t *type_blocks, uint32_t *dlength);
+
+/**
+ * Incremental decompression, which needs memory for a couple of blocks
+ * whatever the length of the stream. Reads streams with or without
+ * SNAPPY_FLAG_STREAM.
+ */
+struct snappy_decompress_stream;
+
+/**
+ * Start an incremental decompression.
+ *
+ * @param dict: preset dictionary, needed if the stream was compressed with
+ *              one, or NULL. It must outlive the stream.
+ * @return New decompression stream
+ */
+struct snappy_decompress_stream *snappy_decompress_stream_init(const struct snappy_dictionary *dict);
+
+/**
+ * Add compressed input to a decompression stream. Blocks are decoded one at a
+ * time and copied to out as long as it has room. Stops taking input when out
+ * is full or the stream is complete, so the caller should call again with the
+ * rest of the input once it has drained out.
+ *
+ * @param stream: decompression stream
+ * @param in: compressed input
+ * @param in_length: length of in
+ * @param consumed[out]: bytes of in taken by the stream
+ * @param out: buffer for the decompressed output
+ * @param out_length: length of out
+ * @param produced[out]: bytes written to out
+ * @return SNAPPY_OK if successful, SNAPPY_INVALID_INPUT if the stream is invalid
+ */
+snappy_status snappy_decompress_stream_feed(struct snappy_decompress_stream *stream, const uint8_t *in, size_t in_length, size_t *consumed, uint8_t *out, size_t out_length, size_t *produced);
+
+/**
+ * Hand out the decompressed data of the blocks decoded so far.
+ *
+ * @param stream: decompression stream
+ * @param out: buffer for the decompressed output
+ * @param out_length: length of out
+ * @param produced[out]: bytes written to out
+ * @return SNAPPY_OK if everything was handed out, SNAPPY_BUFFER_TOO_SMALL if
+ *         out filled up first and flush should be called again
+ */
+snappy_status snappy_decompress_stream_flush(struct snappy_decompress_stream *stream, uint8_t *out, size_t out_length, size_t *produced);
+
+/**
+ * Hand out the rest of the decompressed data and check that the whole stream
+ * has been read.
+ *
+ * @param stream: decompression stream
+ * @param out: buffer for the decompressed output
+ * @param out_length: length of out
+ * @param produced[out]: bytes written to out
+ * @return SNAPPY_OK if the stream is complete, SNAPPY_BUFFER_TOO_SMALL if out
+ *         filled up first and finish should be called again,
+ *         SNAPPY_INVALID_INPUT if the stream ended early
+ */
+snappy_status snappy_decompress_stream_finish(struct snappy_decompress_stream *stream, uint8_t *out, size_t out_length, size_t *produced);
+
+/**
+ * Free a decompression stream.
+ *
+ * @param stream: decompression stream, may be NULL
+ */
+void snappy_decompress_stream_free(struct snappy_decompress_stream *stream);
 
 /**
  * Perform the Snappy decompression on the DPU.
  *
  * @param input: holds input buffer information
  * @param output: holds output buffer information
+ * @param dict: preset dictionary, needed if the stream was compressed with one, or NULL
+ * @param block_lengths: decompressed length of every block as reported by
+ *                       snappy_validate_host, or NULL to assume full blocks
+ * @param ctx: DPUs kept allocated across jobs, or NULL to allocate NR_DPUS DPUs
+ *             running NR_TASKLETS tasklets and free them for this job only
  * @param runtime: struct holding breakdown of runtimes for different parts of the program
  * @return SNAPPY_OK if successful, error code otherwise
  */
-snappy_status snappy_decompress_dpu(struct host_buffer_context *input, struct host_buffer_context *output, struct program_runtime *runtime);
+snappy_status snappy_decompress_dpu(struct host_buffer_context *input, struct host_buffer_context *output, const struct snappy_dictionary *dict, const uint32_t *block_lengths, struct dpu_context *ctx, struct program_runtime *runtime);
+
+/**
+ * Decompress many independent inputs on the DPUs in one launch. The blocks
+ * of all the inputs are packed into the tasklets of every DPU, so that small
+ * inputs share DPUs and large ones are split between them, and the output of
+ * each tasklet is copied back to the output of its input.
+ *
+ * @param inputs: holds the buffer information of each input, set up by setup_decompression
+ * @param outputs: holds the buffer information of each output, set up by setup_decompression
+ * @param nr_files: number of inputs
+ * @param dict: preset dictionary, needed if any stream was compressed with one, or NULL
+ * @param block_lengths: decompressed length of every block of each input as
+ *                       reported by snappy_validate_host, or NULL to assume full blocks
+ * @param ctx: DPUs kept allocated across jobs, or NULL to allocate NR_DPUS DPUs
+ *             running NR_TASKLETS tasklets and free them for this job only
+ * @param runtime: struct holding breakdown of runtimes for different parts of the program
+ * @return SNAPPY_OK if successful, SNAPPY_BUFFER_TOO_SMALL if the inputs do
+ *         not fit in the DPUs together, error code otherwise
+ */
+snappy_status snappy_decompress_dpu_batch(struct host_buffer_context *inputs, struct host_buffer_context *outputs, uint32_t nr_files, const struct snappy_dictionary *dict, const uint32_t *const *block_lengths, struct dpu_context *ctx, struct program_runtime *runtime);
+
+/**
+ * Read the header at the start of a compressed stream, to decompress it in
+ * rounds when it is too long for the DPUs.
+ *
+ * @param input: holds input buffer information, moved past the header
+ * @param dict: preset dictionary, needed if the stream was compressed with one, or NULL
+ * @param format[out]: format of the stream
+ * @return SNAPPY_OK if successful, SNAPPY_INVALID_INPUT if the header cannot
+ *         be read or the stream needs another dictionary
+ */
+snappy_status snappy_read_stream_format(struct host_buffer_context *input, const struct snappy_dictionary *dict, struct snappy_stream_format *format);
+
+/**
+ * Find the next round of a stream decompressed in rounds: as many whole
+ * groups of blocks as are all in a buffer and decompress to at most
+ * max_length bytes.
+ *
+ * @param format: format of the stream, which must have its length in the header
+ * @param blocks: the blocks of the stream that were read, from the first of the round
+ * @param available: length of blocks
+ * @param first_block: index of the first block of the round in the stream
+ * @param max_length: most bytes the round may decompress to
+ * @param nr_blocks[out]: number of blocks in the round
+ * @param length[out]: decompressed length of the round
+ * @return Compressed length of the round, 0 if not even one group fits
+ */
+size_t snappy_next_dpu_round(const struct snappy_stream_format *format, const uint8_t *blocks, size_t available, uint32_t first_block,
+							 size_t max_length, uint32_t *nr_blocks, uint32_t *length);
+
+/**
+ * Decompress one round of a stream too long for the DPUs, found with
+ * snappy_next_dpu_round.
+ *
+ * @param input: holds the buffer information of the round, at its first block
+ * @param output: holds output buffer information, its length set to the
+ *                decompressed length of the round
+ * @param format: format of the stream
+ * @param dict: preset dictionary, needed if the stream was compressed with one, or NULL
+ * @param ctx: DPUs kept allocated across rounds
+ * @param runtime: struct holding breakdown of runtimes for different parts of the program
+ * @return SNAPPY_OK if successful, SNAPPY_BUFFER_TOO_SMALL if the round does
+ *         not fit in the DPUs, error code otherwise
+ */
+snappy_status snappy_decompress_dpu_blocks(struct host_buffer_context *input, struct host_buffer_context *output, const struct snappy_stream_format *format,
+										   const struct snappy_dictionary *dict, struct dpu_context *ctx, struct program_runtime *runtime);
 
 #endif /* _SNAPPY_DECOMPRESSION_H_ */
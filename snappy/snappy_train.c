@@ -0,0 +1,306 @@
+/**
+ * Train a preset dictionary for dpu_snappy from a set of sample files.
+ *
+ * The dictionary is built from the segments of the samples that hold the most
+ * common content, following the idea of the COVER trainer used by zstd.
+ * Every SEGMENT_DMER_LENGTH-byte string (d-mer) is scored by the number of
+ * samples it appears in. The samples are split into one epoch for each
+ * segment the dictionary has room for, and the segment of each epoch whose
+ * distinct d-mers have the highest total score is picked. The d-mers of a
+ * picked segment are then scored zero, so later epochs look for new content.
+ * Segments are placed from the end of the dictionary backwards, since content
+ * near its end is closest to every block and is reached with the shortest
+ * copy offsets.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "dpu_snappy.h"
+
+const char options[]="k:o:s:";
+
+// Length of the strings counted across samples
+#define SEGMENT_DMER_LENGTH 8
+
+// Number of buckets the d-mers are hashed into
+#define DMER_HASH_BITS 20
+#define DMER_HASH_SIZE (1U << DMER_HASH_BITS)
+
+// Default dictionary and segment lengths
+#define DEFAULT_DICT_LENGTH KILOBYTE(16)
+#define DEFAULT_SEGMENT_LENGTH 128
+
+/**
+ * All samples, read one after the other into a single buffer.
+ */
+struct sample_set {
+	uint8_t *data;				// Contents of every sample
+	size_t length;				// Total length of the samples
+	uint32_t num_samples;		// Number of samples
+	size_t *sample_end;			// Offset of the end of each sample in data
+};
+
+/**
+ * Hash the d-mer that starts at ptr.
+ */
+static inline uint32_t hash_dmer(const uint8_t *ptr)
+{
+	uint64_t val;
+	memcpy(&val, ptr, sizeof(val));
+	return (uint32_t)((val * 0xCF1BBCDCB7A56463ULL) >> (64 - DMER_HASH_BITS));
+}
+
+/**
+ * Read every sample file into one buffer.
+ *
+ * @param files: names of the sample files
+ * @param num_files: number of sample files
+ * @param samples[out]: the samples, freed by the caller
+ * @return 1 if a file could not be read, 0 otherwise
+ */
+static int read_samples(char **files, uint32_t num_files, struct sample_set *samples)
+{
+	samples->data = NULL;
+	samples->length = 0;
+	samples->num_samples = 0;
+	samples->sample_end = malloc(sizeof(size_t) * num_files);
+
+	for (uint32_t i = 0; i < num_files; i++) {
+		FILE *fin = fopen(files[i], "r");
+		if (fin == NULL) {
+			fprintf(stderr, "Invalid sample file: %s\n", files[i]);
+			return 1;
+		}
+
+		fseek(fin, 0, SEEK_END);
+		size_t length = ftell(fin);
+		fseek(fin, 0, SEEK_SET);
+
+		// Leave room to hash the last d-mer of the last sample in one read
+		samples->data = realloc(samples->data, samples->length + length + SEGMENT_DMER_LENGTH);
+		size_t n = fread(samples->data + samples->length, 1, length, fin);
+		fclose(fin);
+		if (n != length) {
+			fprintf(stderr, "Failed to read sample file: %s\n", files[i]);
+			return 1;
+		}
+
+		samples->length += length;
+		samples->sample_end[samples->num_samples++] = samples->length;
+	}
+
+	return 0;
+}
+
+/**
+ * Score every d-mer by the number of samples it appears in.
+ *
+ * @param samples: the samples
+ * @param freq[out]: score of each d-mer hash
+ */
+static void count_dmers(const struct sample_set *samples, uint32_t *freq)
+{
+	// Last sample each d-mer was seen in, so it is only counted once per sample
+	uint32_t *last_sample = malloc(sizeof(uint32_t) * DMER_HASH_SIZE);
+	memset(last_sample, 0xFF, sizeof(uint32_t) * DMER_HASH_SIZE);
+	memset(freq, 0, sizeof(uint32_t) * DMER_HASH_SIZE);
+
+	size_t start = 0;
+	for (uint32_t i = 0; i < samples->num_samples; i++) {
+		size_t end = samples->sample_end[i];
+		for (size_t pos = start; (pos + SEGMENT_DMER_LENGTH) <= end; pos++) {
+			uint32_t h = hash_dmer(samples->data + pos);
+			if (last_sample[h] != i) {
+				last_sample[h] = i;
+				freq[h]++;
+			}
+		}
+		start = end;
+	}
+
+	free(last_sample);
+}
+
+/**
+ * Find the segment of an epoch whose distinct d-mers have the highest total
+ * score, by sliding a window of segment_length bytes over it.
+ *
+ * @param samples: the samples
+ * @param freq: score of each d-mer hash
+ * @param active: number of times each d-mer hash is in the window, all zero
+ *                on entry and on return
+ * @param epoch_start: first byte of the epoch
+ * @param epoch_end: end of the epoch
+ * @param segment_length: length of the segments
+ * @param best_start[out]: first byte of the best segment
+ * @return Score of the best segment
+ */
+static uint64_t find_best_segment(const struct sample_set *samples, const uint32_t *freq, uint16_t *active,
+		size_t epoch_start, size_t epoch_end, uint32_t segment_length, size_t *best_start)
+{
+	uint32_t dmers_per_segment = segment_length - SEGMENT_DMER_LENGTH + 1;
+	uint64_t score = 0;
+	uint64_t best_score = 0;
+	*best_start = epoch_start;
+
+	size_t last_dmer = epoch_end - SEGMENT_DMER_LENGTH;
+	for (size_t pos = epoch_start; pos <= last_dmer; pos++) {
+		uint32_t h = hash_dmer(samples->data + pos);
+		if (active[h]++ == 0)
+			score += freq[h];
+
+		// Drop the d-mer that fell out of the window
+		if ((pos - epoch_start) >= dmers_per_segment) {
+			uint32_t old = hash_dmer(samples->data + pos - dmers_per_segment);
+			if (--active[old] == 0)
+				score -= freq[old];
+		}
+
+		if (score > best_score) {
+			best_score = score;
+			*best_start = (pos + 1 >= dmers_per_segment + epoch_start) ? (pos + 1 - dmers_per_segment) : epoch_start;
+		}
+	}
+
+	// Empty the window for the next epoch
+	size_t window_start = (last_dmer + 1 >= epoch_start + dmers_per_segment) ? (last_dmer + 1 - dmers_per_segment) : epoch_start;
+	for (size_t pos = window_start; pos <= last_dmer; pos++)
+		active[hash_dmer(samples->data + pos)]--;
+
+	return best_score;
+}
+
+/**
+ * Build a dictionary out of the best segment of each epoch.
+ *
+ * @param samples: the samples
+ * @param dict: buffer for the dictionary
+ * @param dict_length: length of dict
+ * @param segment_length: length of the segments
+ * @return Length of the dictionary, which ends at dict + dict_length
+ */
+static uint32_t train_dictionary(const struct sample_set *samples, uint8_t *dict, uint32_t dict_length, uint32_t segment_length)
+{
+	uint32_t *freq = malloc(sizeof(uint32_t) * DMER_HASH_SIZE);
+	uint16_t *active = calloc(DMER_HASH_SIZE, sizeof(uint16_t));
+	count_dmers(samples, freq);
+
+	// One epoch per segment the dictionary has room for
+	size_t num_epochs = dict_length / segment_length;
+	if (num_epochs == 0)
+		num_epochs = 1;
+	size_t epoch_length = samples->length / num_epochs;
+	if (epoch_length < segment_length) {
+		epoch_length = segment_length;
+		num_epochs = samples->length / epoch_length;
+	}
+
+	uint32_t tail = dict_length;
+	for (size_t epoch = 0; (epoch < num_epochs) && (tail > 0); epoch++) {
+		size_t epoch_start = epoch * epoch_length;
+		size_t epoch_end = MIN(epoch_start + epoch_length, samples->length);
+		if ((epoch_end - epoch_start) < SEGMENT_DMER_LENGTH)
+			continue;
+
+		size_t segment_start;
+		uint64_t score = find_best_segment(samples, freq, active, epoch_start, epoch_end, segment_length, &segment_start);
+		if (score == 0)
+			continue;
+
+		// Score the picked d-mers zero, so other epochs look for new content
+		size_t segment_end = MIN(segment_start + segment_length, epoch_end);
+		for (size_t pos = segment_start; (pos + SEGMENT_DMER_LENGTH) <= segment_end; pos++)
+			freq[hash_dmer(samples->data + pos)] = 0;
+
+		uint32_t len = MIN(segment_end - segment_start, tail);
+		tail -= len;
+		memcpy(dict + tail, samples->data + segment_end - len, len);
+	}
+
+	free(freq);
+	free(active);
+	return dict_length - tail;
+}
+
+/**
+ * Print out application usage.
+ *
+ * @param exe_name: name of the application
+ */
+static void usage(const char *exe_name)
+{
+	fprintf(stderr, "Train a preset dictionary for dpu_snappy from sample files\n");
+	fprintf(stderr, "usage: %s [-s <dict_size>] [-k <segment_length>] -o <dict_file> <sample_file>...\n", exe_name);
+	fprintf(stderr, "s: largest dictionary size, default is %u, at most %u\n", DEFAULT_DICT_LENGTH, SNAPPY_MAX_DICT_LENGTH);
+	fprintf(stderr, "k: length of the segments the dictionary is made of, default is %u\n", DEFAULT_SEGMENT_LENGTH);
+	fprintf(stderr, "o: dictionary file\n");
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+	uint32_t dict_length = DEFAULT_DICT_LENGTH;
+	uint32_t segment_length = DEFAULT_SEGMENT_LENGTH;
+	char *dict_file = NULL;
+
+	while ((opt = getopt(argc, argv, options)) != -1)
+	{
+		switch(opt)
+		{
+		case 'k':
+			segment_length = atoi(optarg);
+			break;
+
+		case 'o':
+			dict_file = optarg;
+			break;
+
+		case 's':
+			dict_length = atoi(optarg);
+			break;
+
+		default:
+			usage(argv[0]);
+			return -2;
+		}
+	}
+
+	if ((dict_file == NULL) || (optind == argc) || (dict_length == 0) || (dict_length > SNAPPY_MAX_DICT_LENGTH) ||
+			(segment_length < SEGMENT_DMER_LENGTH) || (segment_length > dict_length)) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	struct sample_set samples;
+	if (read_samples(&argv[optind], argc - optind, &samples))
+		return -1;
+	if (samples.length < segment_length) {
+		fprintf(stderr, "The samples are shorter than one segment\n");
+		return -1;
+	}
+
+	uint8_t *dict = malloc(dict_length);
+	uint32_t trained_length = train_dictionary(&samples, dict, dict_length, segment_length);
+	if (trained_length == 0) {
+		fprintf(stderr, "The samples have no content in common\n");
+		return -1;
+	}
+
+	FILE *fout = fopen(dict_file, "w");
+	if ((fout == NULL) || (fwrite(dict + dict_length - trained_length, 1, trained_length, fout) != trained_length)) {
+		fprintf(stderr, "Failed to write dictionary file: %s\n", dict_file);
+		return -1;
+	}
+	fclose(fout);
+
+	printf("Trained a %u byte dictionary from %u samples (%zu bytes)\n", trained_length, samples.num_samples, samples.length);
+
+	free(dict);
+	free(samples.data);
+	free(samples.sample_end);
+	return 0;
+}